@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <stdint.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <time.h>
 #include <sys/select.h>
@@ -1052,9 +1053,9 @@ static int __core_restart(uint c)
 }
 
 
-void cpu_core_restart(uint c)
+int cpu_core_restart(uint c)
 {
-	__core_restart(c);
+	return __core_restart(c);
 }
 
 
@@ -1077,6 +1078,12 @@ void cpu_core_restart_all()
 		__core_restart(c);
 }
 
+void cpu_relax()
+{
+	if(ncores > physical_cores)
+		sched_yield();
+}
+
 void cpu_core_barrier_sync()
 {
 	pthread_barrier_wait(& core_barrier);
@@ -1116,6 +1123,95 @@ void cpu_enable_interrupts()
 }
 
 
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+
+/*
+	Fast context switch for x86-64.
+
+	bios_switch_stack(&old->sp, new->sp) pushes the callee-saved registers
+	(rbp, rbx, r12-r15) and the x87 control word and MXCSR, which the ABI
+	also requires to be preserved, saves the stack pointer, loads the
+	new one and pops the same frame off it. Everything else is
+	caller-saved, so the compiler has already taken care of it.
+
+	A new context gets a frame whose return address is bios_context_start,
+	which calls the context function held in rbx.
+
+	The frame, from the saved stack pointer up, is:
+		fpu cw, mxcsr, r15, r14, r13, r12, rbx, rbp, return address
+ */
+void bios_switch_stack(void** oldsp, void* newsp);
+void bios_context_start();
+
+__asm__(
+	"	.text\n"
+	"	.p2align 4\n"
+	"	.local bios_switch_stack\n"
+	"	.type bios_switch_stack, @function\n"
+	"bios_switch_stack:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	subq $16, %rsp\n"
+	"	stmxcsr 8(%rsp)\n"
+	"	fnstcw (%rsp)\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	ldmxcsr 8(%rsp)\n"
+	"	fldcw (%rsp)\n"
+	"	addq $16, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	"	.size bios_switch_stack, .-bios_switch_stack\n"
+	"\n"
+	"	.p2align 4\n"
+	"	.local bios_context_start\n"
+	"	.type bios_context_start, @function\n"
+	"bios_context_start:\n"
+	"	callq *%rbx\n"
+	"	ud2\n"
+	"	.size bios_context_start, .-bios_context_start\n"
+);
+
+
+void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
+{
+	/* 
+		The frame is placed so that, after the 'ret' into bios_context_start,
+		the stack is 16-byte aligned, as required before a call.
+	 */
+	uintptr_t top = ((uintptr_t)ss_sp + ss_size) & ~(uintptr_t)15;
+	uint64_t* frame = (uint64_t*)(top - 88);
+
+	memset(frame, 0, 88);
+
+	/* Start with the FPU control settings of the current context */
+	__asm__ volatile ("fnstcw %0" : "=m" (*(uint16_t*) &frame[0]));
+	__asm__ volatile ("stmxcsr %0" : "=m" (*(uint32_t*) &frame[1]));
+
+	frame[6] = (uint64_t) ctx_func;			/* rbx */
+	frame[7] = 0;							/* rbp, ends backtraces */
+	frame[8] = (uint64_t) bios_context_start;	/* return address */
+
+	ctx->sp = frame;
+}
+
+
+void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
+{
+	bios_switch_stack(&oldctx->sp, newctx->sp);
+}
+
+#else
+
 void cpu_initialize_context(cpu_context_t* ctx, void* ss_sp, size_t ss_size, void (*ctx_func)())
 {
   /* Init the context from this context! */
@@ -1138,6 +1234,8 @@ void cpu_swap_context(cpu_context_t* oldctx, cpu_context_t* newctx)
 	swapcontext(oldctx, newctx);
 }
 
+#endif
+
 
 
 /*
@@ -387,8 +387,9 @@ void cpu_core_halt();
 
 	This call will restart the given core, if it was halted.
 	@param c the core to restart
+	@returns 1 if the core was halted, else 0
 */
-void cpu_core_restart(uint c);
+int cpu_core_restart(uint c);
 
 /**
 	@brief Restart some halted core.
@@ -404,11 +405,34 @@ void cpu_core_restart_one();
 */
 void cpu_core_restart_all();
 
+/**
+	@brief Hint that the core is busy-waiting on another core.
+
+	A core spinning on a lock held by another core should call this periodically.
+	When the simulated cores outnumber the physical processors of the host, the
+	core holding the lock may not be running at all; in this case the call yields
+	the host processor, so that the lock holder can make progress. Otherwise,
+	it returns immediately.
+*/
+void cpu_relax();
+
 
 /**
 	@brief A type for saving CPU context into.
+
+	On x86-64, a context switch only saves the callee-saved registers
+	on the stack of the old context, and the context is just the saved
+	stack pointer. The signal mask is not part of the context; it is
+	left to the interrupt layer (@c cpu_disable_interrupts() etc).
+
+	On other architectures, or when compiled with @c BIOS_UCONTEXT,
+	the context is a @c ucontext_t, switched by @c swapcontext().
 */
+#if defined(__x86_64__) && !defined(BIOS_UCONTEXT)
+typedef struct { void* sp; } cpu_context_t;
+#else
 typedef ucontext_t cpu_context_t;
+#endif
 
 
 /**
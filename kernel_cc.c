@@ -23,8 +23,23 @@
  	Pre-emption aware mutex.
  	-------------------------
 
- 	This mutex will act as a spinlock if preemption is off, and a
- 	yielding mutex if preemption is on.
+ 	The mutex word is 0 when the mutex is unlocked. Else, it holds the TCB of
+ 	the owner (or MUTEX_ANON, if there is no current thread), or-ed with 
+ 	MUTEX_WAITERS when threads may be parked on the mutex.
+
+ 	In the non-preemptive domain, the mutex acts as a spinlock. In the
+ 	preemptive domain, a thread spins for a bounded time and then parks
+ 	on a wait queue. The spinning is skipped when there is no other core to
+ 	release the mutex, or when other threads are already parked.
+ 	Mutex_Unlock() releases a contended mutex and wakes up the first parked
+ 	waiter, which retries to lock it. The mutex is not handed to the waiter
+ 	while it sleeps: a core spinning on the mutex in the non-preemptive
+ 	domain could then wait for ever for the waiter to be scheduled on it.
+
+ 	So that a Mutex remains a single word, the wait queues are kept in a
+ 	small hash table, keyed by the mutex address. A queue is a ring of
+ 	waiters, as for condition variables, protected by a mutex that is
+ 	only locked with preemption off.
 
  	Therefore, we can call the same function from both the preemptive and
  	the non-preemptive domain of the kernel.
@@ -32,34 +47,281 @@
  	The implementation is based on GCC atomics, as the standard C11 primitives
  	are not supported by all recent compilers. Eventually, this will change.
  */
+
+#define MUTEX_WAITERS ((Mutex)1)
+#define MUTEX_ANON ((Mutex)2)
+
+#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+
+/** \cond HELPER Helper structures for parking on a mutex. */
+typedef struct __mutex_waiter {
+	rlnode node;				/* become part of a ring */
+	Mutex* mutex;				/* the mutex waited for */
+	TCB* thread;				/* the parked thread */
+	int priority;				/* the priority of the thread when it parked */
+	int dequeued;				/* set when Mutex_Unlock removes the thread from the queue to wake it */
+} __mutex_waiter;
+
+#define MUTEX_WAITQ_SIZE 64
+
+static struct mutex_waitq {
+	Mutex lock;					/* protects waitset, locked with preemption off */
+	__mutex_waiter* waitset;	/* ring of waiters, or NULL */
+} mutex_waitq[MUTEX_WAITQ_SIZE];
+/** \endcond */
+
+static inline struct mutex_waitq* mutex_waitq_of(Mutex* lock)
+{
+	uintptr_t h = (uintptr_t)lock / sizeof(Mutex);
+	return & mutex_waitq[(h ^ (h >> 6)) % MUTEX_WAITQ_SIZE];
+}
+
+static inline Mutex mutex_self()
+{
+	TCB* tcb = cur_thread();
+	return (tcb!=NULL) ? (Mutex)tcb : MUTEX_ANON;
+}
+
+static inline int mutex_acquire(Mutex* lock, Mutex self)
+{
+	Mutex unlocked = 0;
+	return __atomic_compare_exchange_n(lock, &unlocked, self, 0, 
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+/* The owner of a locked mutex, or NULL if it is not a normal thread */
+static inline TCB* mutex_owner(Mutex w)
+{
+	TCB* owner = (TCB*)(w & ~MUTEX_WAITERS);
+	return ((Mutex)owner != MUTEX_ANON && owner->type == NORMAL_THREAD) ? owner : NULL;
+}
+
+
+/*
+	Priority inheritance.
+
+	A thread parking on a mutex whose owner has a lower priority counts
+	as a priority inversion. With MUTEX_PRIORITY_INHERITANCE, the owner
+	then inherits the priority of the waiter (see set_inherited_priority()).
+
+	The owner keeps the inherited priority until it releases the last of its
+	contended mutexes (those with MUTEX_WAITERS set), which are counted in
+	its pi_mutexes. Inheritance is not transitive: if the owner is itself
+	blocked on a mutex, its own owner is not raised.
+
+	The counts and inherited priorities are updated under pi_lock, which is
+	locked with preemption off, after the wait queue lock.
+ */
+static Mutex pi_lock = MUTEX_INIT;
+static unsigned long mutex_inversions = 0;
+
+unsigned long get_mutex_inversions()
+{
+	return __atomic_load_n(&mutex_inversions, __ATOMIC_RELAXED);
+}
+
+/* A waiter with the given priority is parking on a mutex owned by owner */
+static void mutex_pi_block(TCB* owner, int priority, int contended)
+{
+	Mutex_Lock(&pi_lock);
+	if(contended) owner->pi_mutexes++;
+	if(priority > thread_priority(owner)) {
+		mutex_inversions++;
+#ifdef MUTEX_PRIORITY_INHERITANCE
+		set_inherited_priority(owner, priority);
+#endif
+	}
+	Mutex_Unlock(&pi_lock);
+}
+
+/* A contended mutex is released by owner, or acquired by next (either may be NULL) */
+static void mutex_pi_update(TCB* owner, TCB* next, int priority)
+{
+	Mutex_Lock(&pi_lock);
+	if(owner && --owner->pi_mutexes == 0 && owner->inherited_priority >= 0)
+		set_inherited_priority(owner, -1);
+	if(next) {
+		next->pi_mutexes++;
+#ifdef MUTEX_PRIORITY_INHERITANCE
+		if(priority > next->inherited_priority)
+			set_inherited_priority(next, priority);
+#endif
+	}
+	Mutex_Unlock(&pi_lock);
+}
+
+
+/* Remove a waiter from the ring of its wait queue */
+static inline void mutex_waitq_remove(struct mutex_waitq* wq, __mutex_waiter* w)
+{
+	if(wq->waitset == w) {
+		__mutex_waiter* nextw = w->node.next->obj;
+		wq->waitset = (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+}
+
+/* Return the first waiter for lock after (and excluding) w, or NULL */
+static inline __mutex_waiter* mutex_waitq_find(struct mutex_waitq* wq, 
+	Mutex* lock, __mutex_waiter* after)
+{
+	if(wq->waitset == NULL) return NULL;
+
+	rlnode* head = & wq->waitset->node;
+	rlnode* p = (after==NULL) ? head : after->node.next;
+	if(after!=NULL && p==head) return NULL;
+	do {
+		__mutex_waiter* w = p->obj;
+		if(w->mutex == lock) return w;
+		p = p->next;
+	} while(p != head);
+	return NULL;
+}
+
+/* 
+	Park the current thread until the mutex is unlocked, and lock it. The
+	thread retries whenever it is woken up, until it finds the mutex unlocked.
+ */
+static void mutex_park(Mutex* lock, Mutex self)
+{
+	struct mutex_waitq* wq = mutex_waitq_of(lock);
+	__mutex_waiter waiter = { .mutex = lock, .thread = cur_thread(), .dequeued = 0 };
+	waiter.priority = thread_priority(waiter.thread);
+	rlnode_init(& waiter.node, &waiter);
+
+	int preempt = preempt_off;
+	Mutex_Lock(& wq->lock);
+
+	for(;;) {
+		/* Announce ourselves as a waiter, unless the mutex is free */
+		Mutex w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+		if(w == 0) {
+			if(mutex_acquire(lock, self)) break;
+			continue;
+		}
+		int contended = ! (w & MUTEX_WAITERS);
+		if(contended && 
+			! __atomic_compare_exchange_n(lock, &w, w|MUTEX_WAITERS, 0, 
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			continue;
+
+		/* The owner cannot release the mutex while we hold the wait queue lock */
+		TCB* owner = mutex_owner(w);
+		if(owner) mutex_pi_block(owner, waiter.priority, contended);
+
+		/* Queue and sleep. Mutex_Unlock will find us when it sees MUTEX_WAITERS. */
+		if(wq->waitset)
+			rlist_push_back(& wq->waitset->node, & waiter.node);
+		else
+			wq->waitset = &waiter;
+
+		sleep_releasing(STOPPED, & wq->lock, SCHED_MUTEX, NO_TIMEOUT);
+
+		Mutex_Lock(& wq->lock);
+
+		/* Woken up by Mutex_Unlock, which dequeued us, or spuriously; retry */
+		if(! waiter.dequeued)
+			mutex_waitq_remove(wq, &waiter);
+		waiter.dequeued = 0;
+		rlnode_init(& waiter.node, &waiter);
+	}
+
+	/* The waiters we passed by still need MUTEX_WAITERS, and pass their priority to us */
+	int priority = -1;
+	for(__mutex_waiter* other = mutex_waitq_find(wq, lock, NULL); 
+			other != NULL; other = mutex_waitq_find(wq, lock, other))
+		if(other->priority > priority) priority = other->priority;
+	if(priority >= 0) {
+		__atomic_or_fetch(lock, MUTEX_WAITERS, __ATOMIC_RELAXED);
+		TCB* me = mutex_owner(self);
+		if(me) mutex_pi_update(NULL, me, priority);
+	}
+
+	Mutex_Unlock(& wq->lock);
+	if(preempt) preempt_on;
+}
+
+
 void Mutex_Lock(Mutex* lock)
 {
-#define MUTEX_SPINS (cpu_cores()>1 ?  1000 : 10000)
+	Mutex self = mutex_self();
+	if(mutex_acquire(lock, self)) return;
+
+	if(! cpu_interrupts_enabled()) {
+		/* Non-preemptive domain: spin */
+		int spin=MUTEX_SPINS;
+		do {
+			while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+#if defined(__x86__) || defined(__x86_64__)
+				__builtin_ia32_pause();
+#endif
+				if(spin>0) 
+					spin--; 
+				else { 
+					spin=MUTEX_SPINS; 
+					cpu_relax();
+				}
+			}
+		} while(! mutex_acquire(lock, self));
+		return;
+	}
 
-  while(__atomic_test_and_set(lock,__ATOMIC_ACQUIRE)) {
-    int spin=MUTEX_SPINS;
-    while(__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+	/* Preemptive domain: spin for a while, if the owner can release the mutex meanwhile */
+	if(cpu_cores()>1) {
+		for(int spin=MUTEX_SPINS; spin>0; spin--) {
+			Mutex w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+			if(w == 0) {
+				if(mutex_acquire(lock, self)) return;
+			} 
+			else if(w & MUTEX_WAITERS)
+				break;
 #if defined(__x86__) || defined(__x86_64__)
-      __builtin_ia32_pause();
+			__builtin_ia32_pause();
 #endif
-      if(spin>0) 
-      	spin--; 
-      else { 
-      	spin=MUTEX_SPINS; 
-      	if(cpu_interrupts_enabled())
-      		yield(SCHED_MUTEX); 
-      }
-    }
-  }
-#undef MUTEX_SPINS
+		}
+	}
+
+	mutex_park(lock, self);
+}
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+	return mutex_acquire(lock, mutex_self());
 }
 
 
 void Mutex_Unlock(Mutex* lock)
 {
-  __atomic_clear(lock, __ATOMIC_RELEASE);
+	/* Fast path: no waiters */
+	Mutex w = __atomic_load_n(lock, __ATOMIC_RELAXED);
+	while(! (w & MUTEX_WAITERS)) {
+		if(__atomic_compare_exchange_n(lock, &w, 0, 0, 
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			return;
+	}
+
+	/* Release the mutex and wake up the first waiter, to retry locking it */
+	struct mutex_waitq* wq = mutex_waitq_of(lock);
+	int preempt = preempt_off;
+	Mutex_Lock(& wq->lock);
+
+	TCB* owner = mutex_owner(w);
+	__mutex_waiter* waiter = mutex_waitq_find(wq, lock, NULL);
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+	mutex_pi_update(owner, NULL, -1);
+	if(waiter) {
+		mutex_waitq_remove(wq, waiter);
+		waiter->dequeued = 1;
+		wakeup(waiter->thread);
+	}
+
+	Mutex_Unlock(& wq->lock);
+	if(preempt) preempt_on;
 }
 
+#undef MUTEX_SPINS
+
 
 /*
 	Condition variables.	
@@ -156,16 +418,17 @@ static int cv_wait(Mutex* mutex, CondVar* cv,
   @internal
   Helper for Cond_Signal and Cond_Broadcast. This method 
   will actually find a waiter to signal, if one exists. 
-  Else, it leaves the cv->waitset == NULL.
+  Else, it leaves the cv->waitset == NULL. With handoff, the
+  waiter is woken with wakeup_handoff().
  */
-static inline void cv_signal(CondVar* cv)
+static inline void cv_signal(CondVar* cv, int handoff)
 {
 	/* Wakeup first process in the waiters' queue, if it exists. */
 	while(cv->waitset) {
 		__cv_waiter* waiter = cv->waitset;
 		remove_from_ring(cv, waiter);
 		waiter->removed = 1;
-		if(wakeup(waiter->thread)) {
+		if(handoff ? wakeup_handoff(waiter->thread) : wakeup(waiter->thread)) {
 			waiter->signalled = 1;
 			return;
 		}
@@ -189,7 +452,7 @@ int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
 void Cond_Signal(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  cv_signal(cv);
+  cv_signal(cv, 0);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -197,7 +460,7 @@ void Cond_Signal(CondVar* cv)
 void Cond_Broadcast(CondVar* cv)
 {
   Mutex_Lock(&(cv->waitset_lock));
-  while(cv->waitset) cv_signal(cv);
+  while(cv->waitset) cv_signal(cv, 0);
   Mutex_Unlock(&(cv->waitset_lock));
 }
 
@@ -214,6 +477,9 @@ void Cond_Broadcast(CondVar* cv)
 /**
  * @brief The kernel lock.
  *
+ * This is only used with KERNEL_BIG_LOCK. Normally, system calls lock 
+ * the kernel objects they access (see kernel_cc.h).
+ *
  * Kernel locking is provided by a semaphore, implemented as a monitor.
  * A semaphre for kernel locking has advantages over a simple mutex. 
  * The main advantage is that @c kernel_mutex is held for a very short time
@@ -249,23 +515,23 @@ void kernel_unlock()
 	Mutex_Unlock(& kernel_mutex);
 }
 
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan_name, TimerDuration timeout)
 {
-	/* Atomically release kernel semaphore */
-	Mutex_Lock(& kernel_mutex);
-	kernel_sem++;
-	Cond_Signal(&kernel_sem_cv);	
-
-	int ret = cv_wait(&kernel_mutex, cv, cause, timeout);
+#ifdef KERNEL_BIG_LOCK
+	/* Release the kernel semaphore; we still hold mx, so no signal is lost */
+	kernel_unlock();
 
-	/* Reacquire kernel semaphore */
-	while(kernel_sem<=0)
-		Cond_Wait(& kernel_mutex, &kernel_sem_cv);
-	kernel_sem--;
-	Mutex_Unlock(& kernel_mutex);		
+	int ret = cv_wait(mx, cv, cause, timeout);
 
+	/* Reacquire the kernel semaphore, in the locking order */
+	Mutex_Unlock(mx);
+	kernel_lock();
+	Mutex_Lock(mx);
 	return ret;
+#else
+	return cv_wait(mx, cv, cause, timeout);
+#endif
 }
 
 void kernel_signal(CondVar* cv) 
@@ -279,12 +545,25 @@ void kernel_broadcast(CondVar* cv)
 	Cond_Broadcast(cv); 
 }
 
-void kernel_sleep(Thread_state newstate, enum SCHED_CAUSE cause)
+void kernel_broadcast_handoff(CondVar* cv) 
+{ 
+	Mutex_Lock(&(cv->waitset_lock));
+	if(cv->waitset) cv_signal(cv, 1);
+	while(cv->waitset) cv_signal(cv, 0);
+	Mutex_Unlock(&(cv->waitset_lock));
+}
+
+void kernel_sleep(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause)
 {
+#ifdef KERNEL_BIG_LOCK
+	if(mx) Mutex_Unlock(mx);
 	Mutex_Lock(& kernel_mutex);
 	kernel_sem++;
 	Cond_Signal(&kernel_sem_cv);
 	sleep_releasing(newstate, &kernel_mutex, cause, NO_TIMEOUT);
+#else
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
+#endif
 }
 
 
@@ -32,55 +32,127 @@
 
 
 
+/**
+	@brief Try to lock a mutex, without waiting.
+
+	This is useful in the non-preemptive domain, when the usual
+	locking order cannot be followed.
+
+	@returns 1 if the mutex was locked, 0 if it was already held
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
+/**
+	@brief Enable priority inheritance for mutexes.
+
+	When defined, a thread that blocks on a mutex raises the priority of the
+	mutex owner to its own, until the owner releases its contended mutexes.
+	This keeps a low-priority owner from being starved by the threads it blocks.
+
+	It is defined unless @c NO_MUTEX_PRIORITY_INHERITANCE is (build with
+	`make MUTEX_PI=0`).
+ */
+#ifndef NO_MUTEX_PRIORITY_INHERITANCE
+#define MUTEX_PRIORITY_INHERITANCE
+#endif
+
+/**
+	@brief The number of priority inversions on mutexes.
+
+	This counts the times a thread blocked on a mutex owned by a thread of
+	lower priority, whether or not @c MUTEX_PRIORITY_INHERITANCE is defined.
+ */
+unsigned long get_mutex_inversions();
+
+
 /*
- * Kernel preemption control.
- * These are wrappers for the kernel monitor.
+ * Kernel locking.
+ *
+ * Kernel objects are protected by their own mutexes: each PCB, FCB and
+ * pipe has one, and the process table freelist, the FCB freelist and the
+ * port map have one each. System calls lock only the objects they use,
+ * and wait on condition variables with @c kernel_wait(), releasing the
+ * object's mutex.
+ *
+ * Since a Mutex may block in the preemptive domain, these mutexes
+ * must not be locked with preemption off.
+ *
+ * The locking order is:
+ *   port map -> PCB of init -> PCB of a parent -> PCB of a child
+ *            -> FCB, pipe, freelists
+ *
+ * For debugging, defining KERNEL_BIG_LOCK makes every system call run
+ * holding a single kernel lock, as in older versions of the kernel. The
+ * object mutexes are still used, and are always locked after it.
  */
+//#define KERNEL_BIG_LOCK
 
 /**
 	@brief Lock the kernel.
+
+	This is only used when @c KERNEL_BIG_LOCK is defined.
  */
 void kernel_lock();
 
 /**
 	@brief Unlock the kernel.
+
+	This is only used when @c KERNEL_BIG_LOCK is defined.
  */
 void kernel_unlock();
 
 /**
-	@brief Wait on a condition variable using the kernel lock.
+	@brief Wait on a condition variable, releasing a kernel mutex.
+
+	This is @c Cond_Wait for the kernel: it must be called with @c mx locked,
+	and returns with @c mx locked. With @c KERNEL_BIG_LOCK, the kernel lock is
+	also released while waiting.
+
 	@returns 1 if signalled, 0 if not
   */
-int kernel_wait_wchan(CondVar* cv, enum SCHED_CAUSE cause, 
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
 	const char* wchan, TimerDuration timeout);
 
-#define kernel_wait(cv, cause) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, NO_TIMEOUT)
-#define kernel_timedwait(cv, cause, timeout) \
-	kernel_wait_wchan((cv),(cause),__FUNCTION__, (timeout))
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
 
 /**
 	@brief Signal a kernel condition to one waiter.
 
-	This call must be made 
+	This call should be made holding the mutex that waiters pass to
+	@c kernel_wait(), or a wakeup may be lost.
   */
 void kernel_signal(CondVar* cv);
 
 /**
 	@brief Signal a kernel condition to all waiters.
+
+	@see kernel_signal
   */
 void kernel_broadcast(CondVar* cv);
 
-
 /**
-	@brief Put thread to sleep, unlocking the kernel.
+	@brief Signal a kernel condition to all waiters, handing the core to the first.
 
-	System calls should call this function instead of @c sleep_releasing,
-	as the kernel lock is not a mutex.
+	The first waiter is woken with @c wakeup_handoff(), so that if the caller
+	blocks next, the core switches directly to it. This is meant for 
+	producer/consumer pairs, such as the two ends of a pipe.
+
+	@see kernel_broadcast
   */
-void kernel_sleep(Thread_state state, enum SCHED_CAUSE cause);
+void kernel_broadcast_handoff(CondVar* cv);
 
+/**
+	@brief Put thread to sleep, unlocking a kernel mutex.
 
+	System calls should call this function instead of @c sleep_releasing,
+	as it also releases the kernel lock when @c KERNEL_BIG_LOCK is defined.
+	The mutex @c mx may be NULL.
+  */
+void kernel_sleep(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause);
 
 /** @brief Set the preemption status for the current core.
 
@@ -15,6 +15,88 @@
 DCB DT[MAX_TERMINALS];
 
 
+/* ===================================
+
+  Polling
+
+  ====================================*/
+
+void poll_queue_init(poll_queue* pq)
+{
+  pq->lock = MUTEX_INIT;
+  rlnode_init(&pq->waiters, NULL);
+}
+
+void poll_wait(poll_table* pt, poll_queue* pq)
+{
+  if(pt==NULL) return;
+
+  /* A stream may register the same queue more than once (e.g., a socket, for each direction) */
+  if(! is_rlist_empty(&pt->entries) && ((poll_entry*) pt->entries.prev->obj)->queue == pq)
+    return;
+
+  poll_entry* pe = xmalloc(sizeof(poll_entry));
+  pe->queue = pq;
+  pe->table = pt;
+  rlnode_init(&pe->queue_node, pe);
+  rlnode_init(&pe->table_node, pe);
+  rlist_push_back(&pt->entries, &pe->table_node);
+
+  Mutex_Lock(&pq->lock);
+  rlist_push_back(&pq->waiters, &pe->queue_node);
+  Mutex_Unlock(&pq->lock);
+}
+
+void poll_wakeup(poll_queue* pq)
+{
+  Mutex_Lock(&pq->lock);
+  for(rlnode* n = pq->waiters.next; n != &pq->waiters; n = n->next) {
+    poll_table* pt = ((poll_entry*) n->obj)->table;
+    pt->wake(pt);
+  }
+  Mutex_Unlock(&pq->lock);
+}
+
+static void poll_table_trigger(poll_table* pt)
+{
+  Mutex_Lock(&pt->lock);
+  pt->triggered = 1;
+  kernel_signal(&pt->ready);
+  Mutex_Unlock(&pt->lock);
+}
+
+void poll_table_init(poll_table* pt)
+{
+  pt->lock = MUTEX_INIT;
+  pt->ready = COND_INIT;
+  pt->triggered = 0;
+  rlnode_init(&pt->entries, NULL);
+  pt->wake = poll_table_trigger;
+}
+
+int poll_table_wait(poll_table* pt, TimerDuration timeout)
+{
+  Mutex_Lock(&pt->lock);
+  if(! pt->triggered)
+    kernel_timedwait(&pt->lock, &pt->ready, SCHED_IO, timeout);
+  int triggered = pt->triggered;
+  pt->triggered = 0;
+  Mutex_Unlock(&pt->lock);
+  return triggered;
+}
+
+void poll_table_destroy(poll_table* pt)
+{
+  while(! is_rlist_empty(&pt->entries)) {
+    poll_entry* pe = rlist_pop_front(&pt->entries)->obj;
+    Mutex_Lock(&pe->queue->lock);
+    rlist_remove(&pe->queue_node);
+    Mutex_Unlock(&pe->queue->lock);
+    free(pe);
+  }
+}
+
+
 /* ===================================
 
   The null device driver
@@ -47,10 +129,17 @@ void* nulldev_open(uint minor)
   return NULL;
 }
 
+int nulldev_poll(void* dev, poll_table* pt)
+{
+  /* Always ready, so there is nothing to wait for */
+  return POLL_READ | POLL_WRITE;
+}
+
 static file_ops nulldev_fops = {
   .Open = nulldev_open,
   .Read = nulldev_read,
   .Write = nulldev_write,
+  .Poll = nulldev_poll,
   .Close = nulldev_close
 };
 
@@ -70,6 +159,9 @@ typedef struct serial_device_control_block {
   uint devno;
   Mutex spinlock;
   CondVar rx_ready;
+  poll_queue pollq;     /* Woken up with rx_ready */
+  int has_lookahead;    /* A byte read by serial_poll, not yet returned */
+  char lookahead;
 } serial_dcb_t;
 
 serial_dcb_t serial_dcb[MAX_TERMINALS];
@@ -90,40 +182,79 @@ void serial_rx_handler()
    */
   for(int i=0;i<bios_serial_ports();i++) {
     serial_dcb_t* dcb = &serial_dcb[i];
+    Mutex_Lock(&dcb->spinlock);
     Cond_Broadcast(&dcb->rx_ready);
+    poll_wakeup(&dcb->pollq);
+    Mutex_Unlock(&dcb->spinlock);
   }
   if(pre) preempt_on;
 }
 
 /*
-  Read from the device, sleeping if needed.
+  Read a byte from the device, if one is available. 
+  The device must be locked.
  */
-int serial_read(void* dev, char *buf, unsigned int size)
+static int serial_getc(serial_dcb_t* dcb, char* c)
+{
+  if(dcb->has_lookahead) {
+    *c = dcb->lookahead;
+    dcb->has_lookahead = 0;
+    return 1;
+  }
+  return bios_read_serial(dcb->devno, c);
+}
+
+/*
+  Read from the device into a sequence of buffers, sleeping if needed.
+ */
+int serial_readv(void* dev, const iovec_t* iov, unsigned int iovcnt)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   preempt_off;            /* Stop preemption */
 
+  /* 
+    The spinlock is also locked by the interrupt handler, so it must
+    only be locked with preemption off.
+   */
+  Mutex_Lock(&dcb->spinlock);
+
   uint count =  0;
+  uint i = 0, pos = 0;
 
-  while(count<size) {
-    int valid = bios_read_serial(dcb->devno, &buf[count]);
+  while(i<iovcnt) {
+    if(pos == iov[i].len) { i++; pos = 0; continue; }   /* skip empty buffers */
+    char* buf = (char*) iov[i].base;
+    int valid = serial_getc(dcb, &buf[pos]);
     
     if (valid) {
       count++;
+      pos++;
     }
     else if(count==0) {
-      kernel_wait(&dcb->rx_ready, SCHED_IO);
+      kernel_wait(&dcb->spinlock, &dcb->rx_ready, SCHED_IO);
     }
     else
       break;
   }
 
+  Mutex_Unlock(&dcb->spinlock);
+
   preempt_on;           /* Restart preemption */
 
   return count;
 }
 
+/*
+  Read from the device, sleeping if needed.
+ */
+int serial_read(void* dev, char *buf, unsigned int size)
+{
+  if(size==0) return 0;
+  iovec_t iov = { buf, size };
+  return serial_readv(dev, &iov, 1);
+}
+
 
 /*
   A polling driver for serial writes
@@ -136,19 +267,23 @@ void serial_tx_handler()
 }
 
 /* 
-  Write call 
+  Vectored write call 
   This is currently a polling driver.
 */
-int serial_write(void* dev, const char* buf, unsigned int size)
+int serial_writev(void* dev, const iovec_t* iov, unsigned int iovcnt)
 {
   serial_dcb_t* dcb = (serial_dcb_t*)dev;
 
   unsigned int count = 0;
-  while(count < size) {
-    int success = bios_write_serial(dcb->devno, buf[count] );
+  unsigned int i = 0, pos = 0;
+  while(i < iovcnt) {
+    if(pos == iov[i].len) { i++; pos = 0; continue; }   /* skip empty buffers */
+    const char* buf = (const char*) iov[i].base;
+    int success = bios_write_serial(dcb->devno, buf[pos] );
 
     if(success) {
       count++;
+      pos++;
     } 
     else if(count==0)
     {
@@ -161,6 +296,40 @@ int serial_write(void* dev, const char* buf, unsigned int size)
   return count;  
 }
 
+/* 
+  Write call 
+*/
+int serial_write(void* dev, const char* buf, unsigned int size)
+{
+  if(size==0) return 0;
+  iovec_t iov = { (void*) buf, size };
+  return serial_writev(dev, &iov, 1);
+}
+
+
+/*
+  The device is readable if a byte can be read; it is read ahead, 
+  as the bios cannot peek. Writing is always possible (it polls).
+ */
+int serial_poll(void* dev, poll_table* pt)
+{
+  serial_dcb_t* dcb = (serial_dcb_t*)dev;
+
+  preempt_off;
+  Mutex_Lock(&dcb->spinlock);
+
+  if(! dcb->has_lookahead)
+    dcb->has_lookahead = bios_read_serial(dcb->devno, &dcb->lookahead);
+  int mask = POLL_WRITE | (dcb->has_lookahead ? POLL_READ : 0);
+  if(! dcb->has_lookahead)
+    poll_wait(pt, &dcb->pollq);
+
+  Mutex_Unlock(&dcb->spinlock);
+  preempt_on;
+
+  return mask;
+}
+
 
 int serial_close(void* dev) 
 {
@@ -180,6 +349,9 @@ file_ops serial_fops = {
   .Open = serial_open,
   .Read = serial_read,
   .Write = serial_write,
+  .ReadV = serial_readv,
+  .WriteV = serial_writev,
+  .Poll = serial_poll,
   .Close = serial_close
 };
 
@@ -211,6 +383,8 @@ void initialize_devices()
     serial_dcb[i].devno = i;
     serial_dcb[i].rx_ready = COND_INIT;
     serial_dcb[i].spinlock = MUTEX_INIT;
+    poll_queue_init(&serial_dcb[i].pollq);
+    serial_dcb[i].has_lookahead = 0;
   }
 
   cpu_interrupt_handler(SERIAL_RX_READY, serial_rx_handler);
@@ -233,4 +407,9 @@ uint device_no(Device_type major)
   return devtable[major].devnum;
 }
 
+int device_is(file_ops* ops, Device_type major)
+{
+  return ops == &devtable[major].dev_fops;
+}
+
 
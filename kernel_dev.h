@@ -9,6 +9,7 @@
 
 #include "util.h"
 #include "bios.h"
+#include "tinyos.h"
 
 /**
   @file kernel_dev.h
@@ -34,6 +35,79 @@
 */
 
 
+/**
+  @brief A queue of pollers.
+
+  A stream object that supports @c Poll keeps a poll queue, and calls
+  @ref poll_wakeup on it whenever its readiness may have changed (e.g., 
+  when data arrives at an empty pipe). Pollers are registered by 
+  @ref poll_wait.
+
+  Registration and wakeup must be done while holding the lock of 
+  the stream object, so that no wakeup is lost between checking 
+  the readiness of a stream and registering to it.
+ */
+typedef struct poll_queue {
+  Mutex lock;           /**< @brief Protects the list */
+  rlnode waiters;       /**< @brief List of @c poll_entry objects */
+} poll_queue;
+
+
+/**
+  @brief The state of a thread in @c Poll.
+
+  A polling thread registers one @c poll_entry to the poll queue of each 
+  stream it polls, and sleeps until one of them is woken up.
+
+  Other waiters (e.g., the items of an event queue) can replace the 
+  @c wake method, to be notified in a different way.
+ */
+typedef struct poll_table {
+  Mutex lock;           /**< @brief Protects @c triggered */
+  CondVar ready;        /**< @brief Signalled when @c triggered is set */
+  int triggered;        /**< @brief Set by @ref poll_wakeup */
+  rlnode entries;       /**< @brief The entries registered by this table */
+  void (*wake)(struct poll_table* pt);  /**< @brief Called by @ref poll_wakeup, with the poll queue locked */
+} poll_table;
+
+/** @brief The registration of a poll table to a poll queue */
+typedef struct poll_entry {
+  rlnode queue_node;    /**< @brief Node in the poll queue */
+  rlnode table_node;    /**< @brief Node in the table's entries */
+  poll_queue* queue;    /**< @brief The queue */
+  poll_table* table;    /**< @brief The table */
+} poll_entry;
+
+
+/** @brief Initialize a poll queue */
+void poll_queue_init(poll_queue* pq);
+
+/**
+  @brief Register a poll table to a poll queue.
+
+  This is called by the @c Poll method of a stream. If @c pt is NULL, 
+  it does nothing. 
+ */
+void poll_wait(poll_table* pt, poll_queue* pq);
+
+/** @brief Wake up all the poll tables registered to a poll queue. */
+void poll_wakeup(poll_queue* pq);
+
+/** @brief Initialize a poll table, for use by @ref poll_table_wait */
+void poll_table_init(poll_table* pt);
+
+/**
+  @brief Sleep until the poll table is woken up, or a timeout expires.
+
+  If the table was woken up since the last call, this returns immediately.
+  @returns 1 if the table was woken up, 0 on timeout.
+ */
+int poll_table_wait(poll_table* pt, TimerDuration timeout);
+
+/** @brief Unregister a poll table from all its queues. */
+void poll_table_destroy(poll_table* pt);
+
+
 /**
   @brief The device-specific file operations table.
 
@@ -81,6 +155,34 @@ typedef struct file_operations {
   */
     int (*Write)(void* this, const char* buf, unsigned int size);
 
+  /** @brief Vectored read operation (optional).
+
+    Like Read, but the data is placed into the 'iovcnt' buffers of 'iov', 
+    in order. Some buffers may be empty, but their total size is at least 1
+    and fits in an int.
+    If this is NULL, ReadV reads into the first buffer only.
+  */
+    int (*ReadV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Vectored write operation (optional).
+
+    Like Write, but the data is taken from the 'iovcnt' buffers of 'iov',
+    in order. Some buffers may be empty, but their total size is at least 1
+    and fits in an int.
+    If this is NULL, WriteV calls Write for each buffer.
+  */
+    int (*WriteV)(void* this, const iovec_t* iov, unsigned int iovcnt);
+
+  /** @brief Poll operation (optional).
+
+    Return the readiness of the stream, as a mask of @c POLL_READ, @c POLL_WRITE,
+    @c POLL_ERROR and @c POLL_HANGUP. If 'pt' is not NULL, the poll table must also
+    be registered (by @ref poll_wait) to the poll queue which is woken up 
+    when this readiness changes, while holding the stream's lock.
+    If this is NULL, the stream is always ready for reading and writing.
+  */
+    int (*Poll)(void* this, poll_table* pt);
+
     /** @brief Close operation.
 
       Close the stream object, deallocating any resources held by it.
@@ -156,6 +258,14 @@ int device_open(Device_type major, uint minor, void** obj, file_ops** ops);
   */
 uint device_no(Device_type major);
 
+/**
+  @brief Check if a stream is a device of a particular major number.
+
+  @param ops the @c file_ops record of the stream, as returned by @c device_open
+  @returns 1 if the stream is a device of type @c major, 0 otherwise
+  */
+int device_is(file_ops* ops, Device_type major);
+
 /** @} */
 
 #endif
@@ -0,0 +1,365 @@
+
+#include <assert.h>
+
+#include "tinyos.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+
+/*
+	Event queues.
+	-------------
+
+	Each stream of an event queue is an item, which is registered to the
+	poll queue(s) of the stream once, by its Poll method, with a poll table
+	whose wake method puts the item on the ready list of the event queue.
+	EventWait() takes items off the ready list and polls them for their
+	current events. So, the cost of a wait is proportional to the events
+	returned, and not to the number of streams.
+
+	Locking: the wake method runs with the poll queue (and the stream)
+	locked, and locks the event queue. So the event queue must not be
+	locked when a stream is polled. Instead, the items are protected from
+	EventCtl() by ctl_lock, which is held while they are polled.
+
+	The items do not hold their streams open. When the last reference to a
+	stream is dropped, event_items_drop() unregisters its items and leaves
+	them in their event queues without a stream, on the ready list, so that
+	the next wait frees them. The list of the items of a stream, and the
+	@c fcb of the items, are protected by event_items_lock.
+
+	Lock order:  ctl_lock  -->  event_items_lock  -->  poll queue lock  -->  lock
+ */
+
+#define EVENTQ_BUCKETS 64
+
+typedef struct event_queue event_queue;
+
+/* A stream registered to an event queue */
+typedef struct event_item {
+	poll_table pt;			/* The registration to the stream; must be first */
+	event_queue* eq;
+	FCB* fcb;				/* The stream, or NULL once it is closed */
+	int events;				/* The events of interest */
+	void* data;				/* The user data */
+	int ready;				/* Set while the item is in the ready list */
+	rlnode ready_node;		/* Node in the ready list */
+	rlnode hash_node;		/* Node in a bucket of the item table */
+	rlnode fcb_node;		/* Node in the event_items of the stream */
+} event_item;
+
+struct event_queue {
+	Mutex ctl_lock;			/* Protects the items, while they are used */
+	Mutex lock;				/* Protects the ready list */
+	CondVar has_events;		/* Signalled when an item becomes ready */
+	rlnode ready;			/* List of ready items */
+	rlnode items[EVENTQ_BUCKETS];	/* Items hashed by their FCB */
+	FCB* fcb;				/* The event queue's own stream */
+};
+
+file_ops eventq_fops;
+
+static Mutex event_items_lock = MUTEX_INIT;
+
+static inline rlnode* eventq_bucket(event_queue* eq, FCB* fcb)
+{
+	uintptr_t h = (uintptr_t)fcb / sizeof(FCB);
+	return & eq->items[h % EVENTQ_BUCKETS];
+}
+
+static event_item* eventq_find(event_queue* eq, FCB* fcb)
+{
+	rlnode* bucket = eventq_bucket(eq, fcb);
+	for(rlnode* n = bucket->next; n != bucket; n = n->next) {
+		event_item* item = n->obj;
+		if(__atomic_load_n(&item->fcb, __ATOMIC_RELAXED) == fcb) return item;
+	}
+	return NULL;
+}
+
+
+/* The wake method of an item's poll table: the stream may be ready */
+static void event_item_wake(poll_table* pt)
+{
+	event_item* item = (event_item*) pt;
+	event_queue* eq = item->eq;
+
+	Mutex_Lock(&eq->lock);
+	if(! item->ready) {
+		item->ready = 1;
+		rlist_push_back(&eq->ready, &item->ready_node);
+		kernel_signal(&eq->has_events);
+		poll_wakeup(&eq->fcb->pollq);
+	}
+	Mutex_Unlock(&eq->lock);
+}
+
+/* Poll the stream of an item, registering the item to it if asked */
+static int event_item_poll(event_item* item, FCB* fcb, poll_table* pt)
+{
+	return FCB_poll(fcb, pt) & (item->events | POLL_ERROR | POLL_HANGUP);
+}
+
+/* Take a reference to the stream of an item, unless the stream is being closed */
+static FCB* event_item_get(event_item* item)
+{
+	Mutex_Lock(&event_items_lock);
+	FCB* fcb = item->fcb;
+	if(fcb) {
+		uint ref = __atomic_load_n(&fcb->refcount, __ATOMIC_RELAXED);
+		do {
+			if(ref == 0) {
+				fcb = NULL;
+				break;
+			}
+		} while(! __atomic_compare_exchange_n(&fcb->refcount, &ref, ref+1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	}
+	Mutex_Unlock(&event_items_lock);
+	return fcb;
+}
+
+/* Remove an item from its event queue and its stream. ctl_lock must be held. */
+static void event_item_free(event_item* item)
+{
+	event_queue* eq = item->eq;
+
+	/* Once unregistered, the item cannot become ready */
+	Mutex_Lock(&event_items_lock);
+	if(item->fcb) {
+		poll_table_destroy(&item->pt);
+		rlist_remove(&item->fcb_node);
+		__atomic_store_n(&item->fcb, NULL, __ATOMIC_RELAXED);
+	}
+	Mutex_Unlock(&event_items_lock);
+
+	Mutex_Lock(&eq->lock);
+	if(item->ready)
+		rlist_remove(&item->ready_node);
+	Mutex_Unlock(&eq->lock);
+
+	rlist_remove(&item->hash_node);
+	free(item);
+}
+
+void event_items_drop(FCB* fcb)
+{
+	Mutex_Lock(&event_items_lock);
+	while(! is_rlist_empty(&fcb->event_items)) {
+		event_item* item = rlist_pop_front(&fcb->event_items)->obj;
+		event_queue* eq = item->eq;
+
+		poll_table_destroy(&item->pt);
+		__atomic_store_n(&item->fcb, NULL, __ATOMIC_RELAXED);
+
+		/* The next wait frees it */
+		Mutex_Lock(&eq->lock);
+		if(! item->ready) {
+			item->ready = 1;
+			rlist_push_back(&eq->ready, &item->ready_node);
+		}
+		Mutex_Unlock(&eq->lock);
+	}
+	Mutex_Unlock(&event_items_lock);
+}
+
+
+Fid_t sys_EventQueue()
+{
+	Fid_t fid;
+	FCB* fcb;
+
+	if(FCB_reserve(1, &fid, &fcb)==0)
+		return NOFILE;
+
+	event_queue* eq = xmalloc(sizeof(event_queue));
+	eq->ctl_lock = MUTEX_INIT;
+	eq->lock = MUTEX_INIT;
+	eq->has_events = COND_INIT;
+	rlnode_init(&eq->ready, NULL);
+	for(int i=0; i<EVENTQ_BUCKETS; i++)
+		rlnode_init(&eq->items[i], NULL);
+	eq->fcb = fcb;
+
+	FCB_attach(fcb, eq, &eventq_fops);
+	return fid;
+}
+
+
+int sys_EventCtl(Fid_t eqfid, eventctl_op op, Fid_t fd, int events, void* data)
+{
+	FCB* eqfcb = get_fcb(eqfid);
+	if(eqfcb==NULL)
+		return -1;
+	FCB* fcb = get_fcb(fd);
+
+	int retcode = -1;
+	if(eqfcb->streamfunc != &eventq_fops || fcb==NULL || fcb->streamfunc == &eventq_fops)
+		goto finish;
+
+	event_queue* eq = eqfcb->streamobj;
+	Mutex_Lock(&eq->ctl_lock);
+
+	event_item* item = eventq_find(eq, fcb);
+	switch(op) {
+		case EVENT_ADD:
+			if(item) break;
+			item = xmalloc(sizeof(event_item));
+			poll_table_init(&item->pt);
+			item->pt.wake = event_item_wake;
+			item->eq = eq;
+			item->fcb = fcb;
+			item->events = events;
+			item->data = data;
+			item->ready = 0;
+			rlnode_init(&item->ready_node, item);
+			rlnode_init(&item->hash_node, item);
+			rlnode_init(&item->fcb_node, item);
+			rlist_push_back(eventq_bucket(eq, fcb), &item->hash_node);
+
+			Mutex_Lock(&event_items_lock);
+			rlist_push_back(&fcb->event_items, &item->fcb_node);
+			Mutex_Unlock(&event_items_lock);
+
+			/* Register, and report the stream if it is already ready */
+			if(event_item_poll(item, fcb, &item->pt))
+				event_item_wake(&item->pt);
+			retcode = 0;
+			break;
+
+		case EVENT_MOD:
+			if(item==NULL) break;
+			item->events = events;
+			item->data = data;
+			if(event_item_poll(item, fcb, NULL))
+				event_item_wake(&item->pt);
+			retcode = 0;
+			break;
+
+		case EVENT_DEL:
+			if(item==NULL) break;
+			event_item_free(item);
+			retcode = 0;
+			break;
+
+		default:
+			break;
+	}
+
+	Mutex_Unlock(&eq->ctl_lock);
+
+finish:
+	if(fcb) FCB_decref(fcb);
+	FCB_decref(eqfcb);
+	return retcode;
+}
+
+
+int sys_EventWait(Fid_t eqfid, event_t* events, unsigned int maxevents, timeout_t timeout)
+{
+	if(events==NULL || maxevents==0)
+		return -1;
+
+	FCB* eqfcb = get_fcb(eqfid);
+	if(eqfcb==NULL)
+		return -1;
+	if(eqfcb->streamfunc != &eventq_fops) {
+		FCB_decref(eqfcb);
+		return -1;
+	}
+	event_queue* eq = eqfcb->streamobj;
+
+	TimerDuration deadline = (timeout == (timeout_t)-1) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+	unsigned int count = 0;
+
+	while(1) {
+		/* Wait for a ready item */
+		Mutex_Lock(&eq->lock);
+		while(is_rlist_empty(&eq->ready)) {
+			TimerDuration t = NO_TIMEOUT;
+			if(deadline != NO_TIMEOUT) {
+				TimerDuration now = bios_clock();
+				if(now >= deadline) break;
+				t = deadline - now;
+			}
+			kernel_timedwait(&eq->lock, &eq->has_events, SCHED_IO, t);
+		}
+		int empty = is_rlist_empty(&eq->ready);
+		Mutex_Unlock(&eq->lock);
+		if(empty) break;
+
+		/* Take ready items one by one, and poll them for their events */
+		Mutex_Lock(&eq->ctl_lock);
+		while(count < maxevents) {
+			Mutex_Lock(&eq->lock);
+			event_item* item = NULL;
+			if(! is_rlist_empty(&eq->ready)) {
+				item = rlist_pop_front(&eq->ready)->obj;
+				item->ready = 0;
+			}
+			Mutex_Unlock(&eq->lock);
+			if(item==NULL) break;
+
+			/* An item whose stream was closed is freed */
+			FCB* fcb = event_item_get(item);
+			if(fcb == NULL) {
+				if(__atomic_load_n(&item->fcb, __ATOMIC_RELAXED) == NULL)
+					event_item_free(item);
+				continue;
+			}
+
+			/* If the item is woken up again from now on, a later wait reports it again */
+			int mask = event_item_poll(item, fcb, NULL);
+			FCB_decref(fcb);
+			if(mask) {
+				events[count].events = mask;
+				events[count].data = item->data;
+				count++;
+			}
+		}
+		Mutex_Unlock(&eq->ctl_lock);
+
+		/* The items may have been ready only spuriously; then wait again */
+		if(count > 0) break;
+	}
+
+	FCB_decref(eqfcb);
+	return count;
+}
+
+
+/* The event queue is ready for reading when it has ready items */
+static int eventq_poll(void* this, poll_table* pt)
+{
+	event_queue* eq = this;
+	Mutex_Lock(&eq->lock);
+	int mask = is_rlist_empty(&eq->ready) ? 0 : POLL_READ;
+	poll_wait(pt, &eq->fcb->pollq);
+	Mutex_Unlock(&eq->lock);
+	return mask;
+}
+
+static int eventq_close(void* this)
+{
+	event_queue* eq = this;
+
+	Mutex_Lock(&eq->ctl_lock);
+	for(int i=0; i<EVENTQ_BUCKETS; i++)
+		while(! is_rlist_empty(&eq->items[i]))
+			event_item_free(eq->items[i].next->obj);
+	Mutex_Unlock(&eq->ctl_lock);
+
+	free(eq);
+	return 0;
+}
+
+static int eventq_read(void* this, char* buf, unsigned int size) { return -1; }
+static int eventq_write(void* this, const char* buf, unsigned int size) { return -1; }
+
+file_ops eventq_fops = {
+	.Open = NULL,
+	.Read = eventq_read,
+	.Write = eventq_write,
+	.Poll = eventq_poll,
+	.Close = eventq_close
+};
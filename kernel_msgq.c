@@ -0,0 +1,272 @@
+#include <string.h>
+
+#include "tinyos.h"
+#include "kernel_msgq.h"
+#include "kernel_cc.h"
+
+
+static inline char* msgq_slot(Msg_Q* msgq, uint i)
+{
+	return msgq->slots + (size_t)(i % MSGQ_SLOTS) * MAX_MESSAGE;
+}
+
+static void msgq_free(Msg_Q* msgq)
+{
+	free(msgq->slots);
+	free(msgq);
+}
+
+
+Msg_Q* msgq_alloc(FCB* reader, FCB* writer)
+{
+	Msg_Q* msgq = xmalloc(sizeof(Msg_Q));
+
+	msgq->lock = MUTEX_INIT;
+	msgq->reader = reader;
+	msgq->writer = writer;
+	msgq->has_space = COND_INIT;
+	msgq->has_data = COND_INIT;
+	msgq->head = 0;
+	msgq->count = 0;
+	msgq->slots = NULL;
+	msgq->users = 0;
+
+	return msgq;
+}
+
+
+/* 
+	Leave a queue that was entered with users++, unlocking it. A socket may be
+	shut down while a call waits in its queue; if both ends are closed, the
+	last call to leave frees the queue.
+ */
+static void msgq_leave(Msg_Q* msgq)
+{
+	msgq->users--;
+	int unused = (msgq->reader==NULL && msgq->writer==NULL && msgq->users==0);
+	Mutex_Unlock(&msgq->lock);
+	if(unused)
+		msgq_free(msgq);
+}
+
+
+/* Write one message, gathered from the buffers */
+int msgq_writev(Msg_Q* msgq, const iovec_t* iov, uint iovcnt)
+{
+	if(msgq==NULL || iov==NULL)
+		return -1;
+	uint n = iov_total(iov, iovcnt);
+	if(n < 1 || n > MAX_MESSAGE)
+		return -1;
+
+	Mutex_Lock(&msgq->lock);
+
+	if(msgq->writer==NULL || msgq->reader==NULL) {
+		Mutex_Unlock(&msgq->lock);
+		return -1;
+	}
+
+	/* Wait for a free slot, unless either end is gone or the writer does not block */
+	int nonblocking = FCB_nonblocking(msgq->writer);
+	msgq->users++;
+	while(msgq->count == MSGQ_SLOTS && msgq->reader!=NULL && msgq->writer!=NULL && !nonblocking)
+		kernel_wait(&msgq->lock, &msgq->has_space, SCHED_PIPE);
+
+	/* The writer may have been shut down while we waited */
+	int retcode;
+	if(msgq->reader==NULL || msgq->writer==NULL)
+		retcode = -1;
+	else if(msgq->count == MSGQ_SLOTS)
+		retcode = WOULD_BLOCK;
+	else {
+		if(msgq->slots == NULL)
+			msgq->slots = xmalloc(MSGQ_SLOTS * MAX_MESSAGE);
+
+		uint i = msgq->head + msgq->count;
+		char* slot = msgq_slot(msgq, i);
+		for(uint j=0; j<iovcnt; j++) {
+			memcpy(slot, iov[j].base, iov[j].len);
+			slot += iov[j].len;
+		}
+		msgq->length[i % MSGQ_SLOTS] = n;
+
+		/* Readers only wait on an empty queue */
+		if(msgq->count++ == 0) {
+			kernel_broadcast_handoff(&msgq->has_data);
+			poll_wakeup(&msgq->reader->pollq);
+		}
+		retcode = n;
+	}
+
+	msgq_leave(msgq);
+
+	return retcode;
+}
+
+/*
+	Read one message, scattered into the buffers. The part of the message
+	that does not fit is discarded.
+ */
+int msgq_readv(Msg_Q* msgq, const iovec_t* iov, uint iovcnt)
+{
+	if(msgq==NULL || iov==NULL)
+		return -1;
+	uint n = iov_total(iov, iovcnt);
+	if(n < 1)
+		return -1;
+
+	Mutex_Lock(&msgq->lock);
+
+	if(msgq->reader==NULL) {
+		Mutex_Unlock(&msgq->lock);
+		return -1;
+	}
+
+	/* Wait for a message, unless the writer is gone */
+	int nonblocking = FCB_nonblocking(msgq->reader);
+	msgq->users++;
+	while(msgq->count==0 && msgq->writer!=NULL) {
+		if(nonblocking) {
+			msgq_leave(msgq);
+			return WOULD_BLOCK;
+		}
+		kernel_wait(&msgq->lock, &msgq->has_data, SCHED_PIPE);
+
+		/* The reader may have been shut down while we waited */
+		if(msgq->reader==NULL) {
+			msgq_leave(msgq);
+			return -1;
+		}
+	}
+
+	/* If the writer is gone, and the queue is empty, this is the end of file */
+	uint count = 0;
+	if(msgq->count > 0) {
+		uint length = msgq->length[msgq->head];
+		const char* slot = msgq_slot(msgq, msgq->head);
+		count = (n < length) ? n : length;
+		uint left = count;
+		for(uint i=0; left > 0; i++) {
+			uint chunk = (iov[i].len < left) ? iov[i].len : left;
+			memcpy(iov[i].base, slot, chunk);
+			slot += chunk;
+			left -= chunk;
+		}
+
+		/* Writers only wait on a full queue */
+		if(msgq->count-- == MSGQ_SLOTS) {
+			kernel_broadcast_handoff(&msgq->has_space);
+			if(msgq->writer) poll_wakeup(&msgq->writer->pollq);
+		}
+		msgq->head = (msgq->head + 1) % MSGQ_SLOTS;
+	}
+
+	msgq_leave(msgq);
+
+	return count;
+}
+
+
+int msgq_writer_close(Msg_Q* msgq)
+{
+	if(msgq==NULL)
+		return -1;
+
+	Mutex_Lock(&msgq->lock);
+
+	/* Its already closed. */
+	if(msgq->writer==NULL) {
+		Mutex_Unlock(&msgq->lock);
+		return -1;
+	}
+
+	msgq->writer = NULL;
+
+	/* A writer waiting for a free slot gives up */
+	kernel_broadcast(&msgq->has_space);
+
+	int unused = (msgq->reader==NULL && msgq->users==0);
+	if(msgq->reader != NULL) {
+		kernel_broadcast(&msgq->has_data);
+		poll_wakeup(&msgq->reader->pollq);
+	}
+
+	Mutex_Unlock(&msgq->lock);
+
+	if(unused)
+		msgq_free(msgq);
+
+	return 0;
+}
+
+int msgq_reader_close(Msg_Q* msgq)
+{
+	if(msgq==NULL)
+		return -1;
+
+	Mutex_Lock(&msgq->lock);
+
+	/* Its already closed. */
+	if(msgq->reader==NULL) {
+		Mutex_Unlock(&msgq->lock);
+		return -1;
+	}
+
+	msgq->reader = NULL;
+
+	/* A reader waiting for a message gives up */
+	kernel_broadcast(&msgq->has_data);
+
+	int unused = (msgq->writer==NULL && msgq->users==0);
+	if(msgq->writer != NULL) {
+		kernel_broadcast(&msgq->has_space);
+		poll_wakeup(&msgq->writer->pollq);
+	}
+
+	Mutex_Unlock(&msgq->lock);
+
+	if(unused)
+		msgq_free(msgq);
+
+	return 0;
+}
+
+
+int msgq_reader_poll(Msg_Q* msgq, poll_table* pt)
+{
+	if(msgq==NULL)
+		return POLL_ERROR;
+
+	Mutex_Lock(&msgq->lock);
+	int mask = 0;
+	if(msgq->reader==NULL)
+		mask = POLL_ERROR;
+	else {
+		if(msgq->count > 0 || msgq->writer==NULL)
+			mask |= POLL_READ;
+		if(msgq->writer==NULL)
+			mask |= POLL_HANGUP;
+		poll_wait(pt, &msgq->reader->pollq);
+	}
+	Mutex_Unlock(&msgq->lock);
+
+	return mask;
+}
+
+int msgq_writer_poll(Msg_Q* msgq, poll_table* pt)
+{
+	if(msgq==NULL)
+		return POLL_ERROR;
+
+	Mutex_Lock(&msgq->lock);
+	int mask = 0;
+	if(msgq->writer==NULL || msgq->reader==NULL)
+		mask = POLL_ERROR;
+	else if(msgq->count < MSGQ_SLOTS)
+		mask |= POLL_WRITE;
+	if(msgq->writer)
+		poll_wait(pt, &msgq->writer->pollq);
+	Mutex_Unlock(&msgq->lock);
+
+	return mask;
+}
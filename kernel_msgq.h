@@ -0,0 +1,54 @@
+#ifndef __KERNEL_MSGQ_H
+#define __KERNEL_MSGQ_H
+
+
+
+#include "kernel_streams.h"
+
+/*
+ *	The number of message slots of a message queue.
+ */
+#define MSGQ_SLOTS 32
+
+
+
+/*
+ *	Message queue implementation.
+ *	A message queue carries whole messages from a writer FCB to a reader FCB,
+ *	keeping their boundaries. It is the transport of the connected sockets of
+ *	type SOCK_SEQPACKET, as a pipe is for byte stream sockets.
+ *
+ *	The queue is a ring of @c MSGQ_SLOTS slots of @c MAX_MESSAGE bytes each, allocated
+ *	on the first write. A write puts one message into the slot after the last, or
+ *	waits for a free slot; a read takes the message of the first slot.
+ */
+
+typedef struct message_queue {
+
+	Mutex lock;	/* Protects the queue */
+
+	FCB *reader, *writer;
+
+	CondVar has_space;
+
+	CondVar has_data;
+
+	uint head;			/* The slot of the oldest message */
+	uint count;			/* The messages in the queue */
+	uint length[MSGQ_SLOTS];	/* The size of the message in each slot */
+	char* slots;		/* The slots, or NULL if not allocated yet */
+	uint users;			/* Calls waiting inside the queue; it is not freed until they leave */
+
+} Msg_Q;
+
+/* Allocate and initialize a message queue between two FCBs */
+Msg_Q* msgq_alloc(FCB* reader, FCB* writer);
+
+int msgq_writev(Msg_Q* msgq, const iovec_t* iov, uint iovcnt);
+int msgq_readv(Msg_Q* msgq, const iovec_t* iov, uint iovcnt);
+int msgq_reader_poll(Msg_Q* msgq, poll_table* pt);
+int msgq_writer_poll(Msg_Q* msgq, poll_table* pt);
+int msgq_reader_close(Msg_Q* msgq);
+int msgq_writer_close(Msg_Q* msgq);
+
+#endif
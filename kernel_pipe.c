@@ -1,173 +1,585 @@
 
+#include <assert.h>
+#include <string.h>
+
 #include "tinyos.h"
 #include "kernel_pipe.h"
 
 
 #include "kernel_streams.h"
 #include "kernel_cc.h"
+#include "kernel_socket.h"
 
 
 
 
 
 
-int pipe_write(void* pipe_cb, const char* buffer, uint n)
+/*
+ *	Pipe buffers are taken from a pool shared by all pipes, which keeps up to
+ *	PIPE_POOL_LIMIT free buffers of each capacity, linked through their first word.
+ *	Pipe control blocks are pooled the same way, up to PIPE_CB_POOL_LIMIT, so that
+ *	setting up a connection (two pipes) does not go to the allocator.
+ */
+#define PIPE_POOL_CLASSES (__builtin_ctz(PIPE_MAX_CAPACITY) - __builtin_ctz(PIPE_MIN_CAPACITY) + 1)
+#define PIPE_POOL_LIMIT 16
+#define PIPE_CB_POOL_LIMIT 64
+
+static struct {
+	Mutex lock;
+	void* free[PIPE_POOL_CLASSES];
+	uint count[PIPE_POOL_CLASSES];
+	void* free_cb;
+	uint cb_count;
+} pipe_pool;
+
+static inline uint pipe_pool_class(uint capacity)
 {
-	Pipe_CB* pipCB = (Pipe_CB*)pipe_cb;
+	return __builtin_ctz(capacity) - __builtin_ctz(PIPE_MIN_CAPACITY);
+}
 
-	/* Make necessary checks before continuing*/
-	if(pipCB==NULL)
-		return -1;
-	if(n < 1)
-		return -1;
-	if(buffer==NULL)
-		return -1;
-	if(pipCB->writer==NULL)
-		return -1;
-	if(pipCB->reader==NULL)
-		return -1;
+static char* pipe_buffer_get(uint capacity)
+{
+	uint c = pipe_pool_class(capacity);
+	void* buf;
+
+	Mutex_Lock(&pipe_pool.lock);
+	buf = pipe_pool.free[c];
+	if(buf) {
+		pipe_pool.free[c] = *(void**)buf;
+		pipe_pool.count[c]--;
+	}
+	Mutex_Unlock(&pipe_pool.lock);
 
+	return buf ? buf : xmalloc(capacity);
+}
 
-	/* Good to go*/
+static void pipe_buffer_put(char* buf, uint capacity)
+{
+	if(buf==NULL) return;
+	uint c = pipe_pool_class(capacity);
+
+	Mutex_Lock(&pipe_pool.lock);
+	if(pipe_pool.count[c] < PIPE_POOL_LIMIT) {
+		*(void**)buf = pipe_pool.free[c];
+		pipe_pool.free[c] = buf;
+		pipe_pool.count[c]++;
+		buf = NULL;
+	}
+	Mutex_Unlock(&pipe_pool.lock);
 
-	
+	free(buf);
+}
 
+static void pipe_free(Pipe_CB* pipCB)
+{
+	pipe_buffer_put(pipCB->BUFFER, pipCB->capacity);
+
+	Mutex_Lock(&pipe_pool.lock);
+	if(pipe_pool.cb_count < PIPE_CB_POOL_LIMIT) {
+		*(void**)pipCB = pipe_pool.free_cb;
+		pipe_pool.free_cb = pipCB;
+		pipe_pool.cb_count++;
+		pipCB = NULL;
+	}
+	Mutex_Unlock(&pipe_pool.lock);
 
- 	/* Writing.. */
-	preempt_off;
+	free(pipCB);
+}
 
-	uint count=0;
-		// count==0   n==6000 --- PIPE_BUFFER_SIZE == 4000
-	while(count < n && pipCB->reader!=NULL)
-	{
 
-		
-		pipCB->BUFFER[pipCB->w_position%PIPE_BUFFER_SIZE] = buffer[count];
+Pipe_CB* pipe_alloc(FCB* reader, FCB* writer)
+{
+	Pipe_CB* pipe_control;
 
-		pipCB->w_position++;
-		count++;
+	Mutex_Lock(&pipe_pool.lock);
+	pipe_control = pipe_pool.free_cb;
+	if(pipe_control) {
+		pipe_pool.free_cb = *(void**)pipe_control;
+		pipe_pool.cb_count--;
+	}
+	Mutex_Unlock(&pipe_pool.lock);
 
-		if(pipCB->w_position-pipCB->r_position == n%PIPE_BUFFER_SIZE)
-			kernel_broadcast(&pipCB->has_data);
+	if(pipe_control==NULL)
+		pipe_control = xmalloc(sizeof(Pipe_CB));
 
+	/* Initialization tactics. */
+	/*--------------------------*/
+	pipe_control->lock = MUTEX_INIT;
 
-		while(pipCB->w_position - pipCB->r_position == n%PIPE_BUFFER_SIZE && pipCB->reader!=NULL && count!=n)
-		{
-			kernel_wait(&pipCB->has_space, SCHED_PIPE);
-		}
+	pipe_control->reader = reader;
+	pipe_control->writer = writer;
 
-		if(pipCB->reader==NULL)
-			{
-				preempt_on;
-				return -1;
-			}
-		
+	pipe_control->w_position=0;
+	pipe_control->r_position=0;
 
-	
+	pipe_control->BUFFER = NULL;
+	pipe_control->capacity = PIPE_BUFFER_SIZE;
+	pipe_control->min_capacity = PIPE_BUFFER_SIZE;
+	pipe_control->max_capacity = PIPE_ADAPTIVE_CAPACITY;
+	pipe_control->peak = 0;
+	pipe_control->splicing = 0;
+	pipe_control->users = 0;
+
+	pipe_control-> has_data = COND_INIT;
+	pipe_control-> has_space = COND_INIT;
+	/*--------------------------*/
+
+	return pipe_control;
+}
+
+
+/* Bytes in the buffer */
+static inline uint pipe_used(Pipe_CB* pipCB)
+{
+	return pipCB->w_position - pipCB->r_position;
+}
+
+/* Free bytes in the buffer */
+static inline uint pipe_room(Pipe_CB* pipCB)
+{
+	return pipCB->capacity - pipe_used(pipCB);
+}
+
+/* The size of atomic writes */
+static inline uint pipe_atomic_room(Pipe_CB* pipCB)
+{
+	return (pipCB->max_capacity < PIPE_ATOMIC_WRITE) ? pipCB->max_capacity : PIPE_ATOMIC_WRITE;
+}
+
+/* 
+	A pipe is writable when there is room for an atomic write, or the buffer
+	can grow (but not under a splice). Writers only wait on a pipe that is not.
+ */
+static inline int pipe_writable(Pipe_CB* pipCB)
+{
+	return pipe_room(pipCB) >= pipe_atomic_room(pipCB)
+		|| (pipCB->capacity < pipCB->max_capacity && !pipCB->splicing);
+}
 
-		
-		
+static inline void pipe_wake_writers(Pipe_CB* pipCB)
+{
+	kernel_broadcast_handoff(&pipCB->has_space);
+	if(pipCB->writer) poll_wakeup(&pipCB->writer->pollq);
+}
+
+/* Copy n bytes into the buffer, which must have room for them */
+static inline void pipe_copy_in(Pipe_CB* pipCB, const char* buffer, uint n)
+{
+	uint pos = pipCB->w_position & (pipCB->capacity-1);
+	uint chunk = (n < pipCB->capacity - pos) ? n : pipCB->capacity - pos;
+
+	/* Up to the end of the buffer, then from its start */
+	memcpy(pipCB->BUFFER + pos, buffer, chunk);
+	memcpy(pipCB->BUFFER, buffer + chunk, n - chunk);
+	pipCB->w_position += n;
+}
+
+/* Copy n bytes out of the buffer, which must hold them */
+static inline void pipe_copy_out(Pipe_CB* pipCB, char* buffer, uint n)
+{
+	uint pos = pipCB->r_position & (pipCB->capacity-1);
+	uint chunk = (n < pipCB->capacity - pos) ? n : pipCB->capacity - pos;
 
+	memcpy(buffer, pipCB->BUFFER + pos, chunk);
+	memcpy(buffer + chunk, pipCB->BUFFER, n - chunk);
+	pipCB->r_position += n;
+}
+
+
+/* 
+	Change the capacity of the buffer, keeping its contents, which must fit.
+	An empty buffer is released, to be allocated by the next write.
+ */
+static void pipe_resize(Pipe_CB* pipCB, uint capacity)
+{
+	uint used = pipe_used(pipCB);
+	assert(used <= capacity);
+
+	char* newbuf = NULL;
+	if(used > 0) {
+		newbuf = pipe_buffer_get(capacity);
+		pipe_copy_out(pipCB, newbuf, used);
 	}
+	pipe_buffer_put(pipCB->BUFFER, pipCB->capacity);
 
-	preempt_on;
-	/* End of writing.. */
+	pipCB->BUFFER = newbuf;
+	pipCB->capacity = capacity;
+	pipCB->r_position = 0;
+	pipCB->w_position = used;
+	pipCB->peak = used;
+}
 
+/* Shrink an empty buffer, if it is too large or if it was idle since the last resize */
+static void pipe_shrink(Pipe_CB* pipCB)
+{
+	uint capacity = pipCB->capacity;
+	if(capacity > pipCB->max_capacity)
+		capacity = pipCB->max_capacity;
+	else if(capacity > pipCB->min_capacity && pipCB->peak <= capacity/4)
+		capacity /= 2;
+
+	if(capacity != pipCB->capacity)
+		pipe_resize(pipCB, capacity);
+}
 
 
+void pipe_set_capacity(Pipe_CB* pipCB, uint capacity)
+{
+	uint minc, maxc;
+	if(capacity == 0) {
+		minc = PIPE_BUFFER_SIZE;
+		maxc = PIPE_ADAPTIVE_CAPACITY;
+	} else {
+		/* Round up to a power of two */
+		if(capacity < PIPE_MIN_CAPACITY) capacity = PIPE_MIN_CAPACITY;
+		if(capacity > PIPE_MAX_CAPACITY) capacity = PIPE_MAX_CAPACITY;
+		minc = maxc = 1u << (32 - __builtin_clz(capacity-1));
+	}
 
-	return count;
+	Mutex_Lock(&pipCB->lock);
+	int blocked = ! pipe_writable(pipCB);
+	pipCB->min_capacity = minc;
+	pipCB->max_capacity = maxc;
+
+	/* Resize now if the contents fit, else a shrink happens when the buffer empties */
+	uint used = pipe_used(pipCB);
+	uint target = pipCB->capacity;
+	if(target < minc) target = minc;
+	if(target > maxc) target = maxc;
+	if(target != pipCB->capacity && used <= target && !pipCB->splicing)
+		pipe_resize(pipCB, target);
+
+	if(blocked && pipe_writable(pipCB))
+		pipe_wake_writers(pipCB);
+	Mutex_Unlock(&pipCB->lock);
 }
 
-int pipe_read(void* pipe_cb, char* buffer, uint n)
+
+/* 
+	Leave a pipe that was entered with users++, unlocking it. A socket may be
+	shut down while a call sleeps in its pipe; if both ends are closed, the
+	last call to leave frees the pipe.
+ */
+static void pipe_leave(Pipe_CB* pipCB)
+{
+	pipCB->users--;
+	int unused = (pipCB->reader==NULL && pipCB->writer==NULL && pipCB->users==0);
+	Mutex_Unlock(&pipCB->lock);
+	if(unused)
+		pipe_free(pipCB);
+}
+
+
+/* The free room, and what the buffer can grow by (but not under a splice) */
+uint pipe_write_room(Pipe_CB* pipCB)
+{
+	Mutex_Lock(&pipCB->lock);
+	uint limit = pipCB->splicing ? pipCB->capacity : pipCB->max_capacity;
+	uint used = pipe_used(pipCB);
+	uint room = (used < limit) ? limit - used : 0;
+	Mutex_Unlock(&pipCB->lock);
+	return room;
+}
+
+
+int pipe_writev(void* pipe_cb, const iovec_t* iov, uint iovcnt)
 {
 	Pipe_CB* pipCB = (Pipe_CB*)pipe_cb;
 
 	/* Make necessary checks before continuing*/
 	if(pipCB==NULL)
 		return -1;
-	if(n < 1 )
-		return -1;
-	if(buffer==NULL)
+	if(iov==NULL)
 		return -1;
-	if(pipCB->reader==NULL)
+	uint n = iov_total(iov, iovcnt);
+	if(n < 1)
 		return -1;
 
+	Mutex_Lock(&pipCB->lock);
 
-	/* Good to go*/
+	if(pipCB->writer==NULL || pipCB->reader==NULL) {
+		Mutex_Unlock(&pipCB->lock);
+		return -1;
+	}
 
 
-	// Disable preemption
-	preempt_off;
+	/* Good to go*/
+	int nonblocking = FCB_nonblocking(pipCB->writer);
+	pipCB->users++;
 
+ 	/* Writing.. all the buffers go in under one lock, so they are not interleaved with other writers */
 	uint count=0;
-
-	
-	while(count<n)
+	uint i=0, pos=0;		/* The next byte to write is iov[i].base[pos] */
+	uint atomic = (n <= pipe_atomic_room(pipCB));
+	while(count < n)
 	{
-		
-		
-		if(pipCB->w_position==pipCB->r_position && pipCB->writer!=NULL)
-			kernel_broadcast(&pipCB->has_space);
-
-		while(pipCB->w_position==pipCB->r_position && pipCB->writer!=NULL && count!=n)
-		{
-			kernel_wait(&pipCB->has_data, SCHED_PIPE);
+		/* An atomic write needs room for all of it, else any room will do */
+		uint need = atomic ? n : 1;
+
+		/* 
+			Without the room, the buffer grows, if it can (but not under a splice),
+			else wait, unless either end is gone or the writer does not block
+		 */
+		while(pipe_room(pipCB) < need && pipCB->reader!=NULL && pipCB->writer!=NULL) {
+			if(pipCB->capacity < pipCB->max_capacity && !pipCB->splicing)
+				pipe_resize(pipCB, 2*pipCB->capacity);
+			else if(nonblocking)
+				break;
+			else
+				kernel_wait(&pipCB->lock, &pipCB->has_space, SCHED_PIPE);
 		}
 
-		if(pipCB->writer==NULL && pipCB->r_position==pipCB->w_position)
-		{
-			// Read what leftover data is left.
-			//return count;
-			while(pipCB->r_position!=pipCB->w_position)
-			{
-				buffer[count] = pipCB->BUFFER[pipCB->r_position++];
-				count++;
-
-			}
-			return count;
+		/* The writer may have been shut down while we waited */
+		if(pipCB->reader==NULL || pipCB->writer==NULL || pipe_room(pipCB) < need)
+			break;
+
+		if(pipCB->BUFFER == NULL)
+			pipCB->BUFFER = pipe_buffer_get(pipCB->capacity);
+
+		uint used = pipe_used(pipCB);
+		uint room = pipCB->capacity - used;
+		while(room > 0 && count < n) {
+			uint chunk = (iov[i].len - pos < room) ? iov[i].len - pos : room;
+			pipe_copy_in(pipCB, (const char*)iov[i].base + pos, chunk);
+			count += chunk;
+			room -= chunk;
+			pos += chunk;
+			if(pos == iov[i].len) { i++; pos = 0; }
 		}
+		if(pipe_used(pipCB) > pipCB->peak)
+			pipCB->peak = pipe_used(pipCB);
 
-		
-		
-		buffer[count] = pipCB->BUFFER[pipCB->r_position%PIPE_BUFFER_SIZE];
+		/* Readers only wait on an empty pipe */
+		if(used == 0) {
+			kernel_broadcast_handoff(&pipCB->has_data);
+			poll_wakeup(&pipCB->reader->pollq);
+		}
+	}
+	/* End of writing.. */
 
-		pipCB->r_position++;
-		
+	int retcode = (pipCB->reader==NULL || pipCB->writer==NULL) ? -1 : (count==0) ? WOULD_BLOCK : (int)count;
 
-		
-		
+	pipe_leave(pipCB);
+
+	return retcode;
+}
 
+int pipe_write(void* pipe_cb, const char* buffer, uint n)
+{
+	if(buffer==NULL)
+		return -1;
+	iovec_t iov = { (void*) buffer, n };
+	return pipe_writev(pipe_cb, &iov, 1);
+}
 
-		count++;
+int pipe_readv(void* pipe_cb, const iovec_t* iov, uint iovcnt)
+{
+	Pipe_CB* pipCB = (Pipe_CB*)pipe_cb;
 
+	/* Make necessary checks before continuing*/
+	if(pipCB==NULL)
+		return -1;
+	if(iov==NULL)
+		return -1;
+	uint n = iov_total(iov, iovcnt);
+	if(n < 1 )
+		return -1;
+
+	Mutex_Lock(&pipCB->lock);
+
+	if(pipCB->reader==NULL) {
+		Mutex_Unlock(&pipCB->lock);
+		return -1;
+	}
+
+
+	/* Good to go*/
+	int nonblocking = FCB_nonblocking(pipCB->reader);
+	pipCB->users++;
+
+	/* Wait for data, unless the writer is gone, and for any splice to finish */
+	while((pipe_used(pipCB)==0 && pipCB->writer!=NULL) || pipCB->splicing) {
+		if(nonblocking) {
+			pipe_leave(pipCB);
+			return WOULD_BLOCK;
+		}
+		kernel_wait(&pipCB->lock, &pipCB->has_data, SCHED_PIPE);
+
+		/* The reader may have been shut down while we waited */
+		if(pipCB->reader==NULL) {
+			pipe_leave(pipCB);
+			return -1;
+		}
+	}
+
+	/* Read what is there, filling the buffers in order; if the writer is gone, this may be 0 */
+	int blocked = ! pipe_writable(pipCB);
+	uint used = pipe_used(pipCB);
+	uint count = (n < used) ? n : used;
+	uint left = count;
+	for(uint i=0; left > 0; i++) {
+		uint chunk = (iov[i].len < left) ? iov[i].len : left;
+		pipe_copy_out(pipCB, iov[i].base, chunk);
+		left -= chunk;
 	}
 
-	preempt_on;
+	/* Writers only wait on a pipe that is not writable */
+	if(blocked && count>0)
+		pipe_wake_writers(pipCB);
 
+	if(count == used)
+		pipe_shrink(pipCB);
+
+	pipe_leave(pipCB);
 
 	return count;
 }
 
+int pipe_read(void* pipe_cb, char* buffer, uint n)
+{
+	if(buffer==NULL)
+		return -1;
+	iovec_t iov = { buffer, n };
+	return pipe_readv(pipe_cb, &iov, 1);
+}
+
+/*
+	Splicing writes the data directly from the buffer to the output stream. 
+	The output may block, so the pipe is unlocked meanwhile (else, two splices
+	in opposite directions could deadlock). While @c splicing is set, the data
+	being written out is left in place: readers wait, and the buffer is not
+	resized. Writers only append to the free part of the buffer.
+
+	A socket input may be shut down meanwhile. The splice counts as a user of
+	the pipe, so that the pipe is not freed under it; if both ends were closed,
+	the splice frees the pipe when it leaves.
+ */
+int pipe_splice(Pipe_CB* pipCB, FCB* out, uint n)
+{
+	if(pipCB==NULL || n < 1)
+		return -1;
+
+	Mutex_Lock(&pipCB->lock);
+
+	if(pipCB->reader==NULL) {
+		Mutex_Unlock(&pipCB->lock);
+		return -1;
+	}
+
+	/* Wait for data, unless the writer is gone, and for any other splice to finish */
+	int nonblocking = FCB_nonblocking(pipCB->reader);
+	int error = 0;
+	pipCB->users++;
+	while((pipe_used(pipCB)==0 && pipCB->writer!=NULL) || pipCB->splicing) {
+		if(nonblocking) {
+			error = WOULD_BLOCK;
+			break;
+		}
+		kernel_wait(&pipCB->lock, &pipCB->has_data, SCHED_PIPE);
+		if(pipCB->reader==NULL) {
+			error = -1;
+			break;
+		}
+	}
+	if(error) {
+		pipe_leave(pipCB);
+		return error;
+	}
+
+	pipCB->splicing = 1;
+
+	/* Write out what is there, a contiguous span at a time */
+	uint count = 0;
+	while(count < n && pipe_used(pipCB) > 0) {
+		uint used = pipe_used(pipCB);
+		uint pos = pipCB->r_position & (pipCB->capacity-1);
+		uint chunk = pipCB->capacity - pos;
+		if(chunk > used) chunk = used;
+		if(chunk > n - count) chunk = n - count;
+
+		Mutex_Unlock(&pipCB->lock);
+		int rc = out->streamfunc->Write(out->streamobj, pipCB->BUFFER + pos, chunk);
+		Mutex_Lock(&pipCB->lock);
+
+		/* The input was shut down meanwhile; what was written is still counted */
+		if(pipCB->reader==NULL) {
+			if(rc > 0)
+				count += rc;
+			else if(count == 0)
+				error = -1;
+			break;
+		}
+
+		if(rc <= 0) {
+			if(count == 0)
+				error = (rc == WOULD_BLOCK) ? WOULD_BLOCK : -1;
+			break;
+		}
+
+		/* Writers may have filled the pipe while it was unlocked */
+		int blocked = ! pipe_writable(pipCB);
+		pipCB->r_position += rc;
+		count += rc;
+		if(blocked)
+			pipe_wake_writers(pipCB);
+		if((uint)rc < chunk) 
+			break;
+	}
+
+	/* Writers may be waiting for the splice to finish, to grow the buffer */
+	int blocked = ! pipe_writable(pipCB);
+	pipCB->splicing = 0;
+
+	if(pipCB->reader != NULL) {
+		if(blocked && pipe_writable(pipCB))
+			pipe_wake_writers(pipCB);
+
+		/* Readers may be waiting for the splice to finish */
+		if(pipe_used(pipCB) > 0) {
+			kernel_broadcast(&pipCB->has_data);
+			poll_wakeup(&pipCB->reader->pollq);
+		}
+		else
+			pipe_shrink(pipCB);
+	}
+
+	pipe_leave(pipCB);
+
+	return error ? error : (int)count;
+}
+
+
 int pipe_writer_close(void* pipe_cb)
 {
 	Pipe_CB* pipCB = (Pipe_CB*)pipe_cb;
 	
 	if(pipCB==NULL)
 		return -1;
+
+	Mutex_Lock(&pipCB->lock);
+
 	/* Its already closed. */
-	if(pipCB->writer==NULL)
+	if(pipCB->writer==NULL) {
+		Mutex_Unlock(&pipCB->lock);
 		return -1;
+	}
 
 	pipCB->writer=NULL;
 
+	/* A writer waiting for room gives up */
+	kernel_broadcast(&pipCB->has_space);
 
-	if(pipCB->reader==NULL)
-		free(pipCB);
-	else
+	int unused = (pipCB->reader==NULL && pipCB->users==0);
+	if(pipCB->reader != NULL) {
 		kernel_broadcast(&pipCB->has_data);
+		poll_wakeup(&pipCB->reader->pollq);
+	}
 
+	Mutex_Unlock(&pipCB->lock);
 
+	if(unused)
+		pipe_free(pipCB);
 
 	return 0;
 }
@@ -178,23 +590,79 @@ int pipe_reader_close(void* pipe_cb)
 	
 	if(pipCB==NULL)
 		return -1;
+
+	Mutex_Lock(&pipCB->lock);
+
 	/* Its already closed. */
-	if(pipCB->reader==NULL)
+	if(pipCB->reader==NULL) {
+		Mutex_Unlock(&pipCB->lock);
 		return -1;
+	}
 
 	pipCB->reader=NULL;
 
-	if(pipCB->writer==NULL)
-		free(pipCB);
-	else
+	/* A splice waiting for data gives up */
+	kernel_broadcast(&pipCB->has_data);
+
+	int unused = (pipCB->writer==NULL && pipCB->users==0);
+	if(pipCB->writer != NULL) {
 		kernel_broadcast(&pipCB->has_space);
+		poll_wakeup(&pipCB->writer->pollq);
+	}
 
-	
+	Mutex_Unlock(&pipCB->lock);
+
+	if(unused)
+		pipe_free(pipCB);
 
 	return 0;
 }
 
 
+int pipe_reader_poll(void* pipe_cb, poll_table* pt)
+{
+	Pipe_CB* pipCB = (Pipe_CB*)pipe_cb;
+	if(pipCB==NULL)
+		return POLL_ERROR;
+
+	Mutex_Lock(&pipCB->lock);
+	int mask = 0;
+	if(pipCB->reader==NULL)
+		mask = POLL_ERROR;
+	else {
+		if(pipe_used(pipCB) > 0 || pipCB->writer==NULL)
+			mask |= POLL_READ;
+		if(pipCB->writer==NULL)
+			mask |= POLL_HANGUP;
+		poll_wait(pt, &pipCB->reader->pollq);
+	}
+	Mutex_Unlock(&pipCB->lock);
+
+	return mask;
+}
+
+int pipe_writer_poll(void* pipe_cb, poll_table* pt)
+{
+	Pipe_CB* pipCB = (Pipe_CB*)pipe_cb;
+	if(pipCB==NULL)
+		return POLL_ERROR;
+
+	Mutex_Lock(&pipCB->lock);
+	int mask = 0;
+	if(pipCB->writer==NULL || pipCB->reader==NULL)
+		mask = POLL_ERROR;
+	else {
+		if(pipe_writable(pipCB))
+			mask |= POLL_WRITE;
+	}
+	if(pipCB->writer)
+		poll_wait(pt, &pipCB->writer->pollq);
+	Mutex_Unlock(&pipCB->lock);
+
+	return mask;
+}
+
+
 /*
  *	Dummy function that will simply return -1 indicating that it should not have been called.
  */
@@ -216,6 +684,8 @@ file_ops pipe_writer_fops = {
 	.Open = NULL,
 	.Read = foo_func,
 	.Write = pipe_write,
+	.WriteV = pipe_writev,
+	.Poll = pipe_writer_poll,
 	.Close = pipe_writer_close
 };
 
@@ -232,12 +702,22 @@ file_ops pipe_reader_fops = {
 	.Open = NULL,
 	.Read = pipe_read,
 	.Write = foo_func,
+	.ReadV = pipe_readv,
+	.Poll = pipe_reader_poll,
 	.Close = pipe_reader_close
 };
 
 /* System call to assemble a new Pipe. Pipe Control Block*/
 int sys_Pipe(pipe_t* pipe)
 {
+	return sys_PipeWithFlags(pipe, 0);
+}
+
+int sys_PipeWithFlags(pipe_t* pipe, int flags)
+{
+	if(flags & ~FID_NONBLOCK)
+		return -1;
+
 	/* A Pipe requires two 'file descriptors'. One to the read end and one to the write end.*/
 	Fid_t pipe_Fid[2];
 	/* Each of those file descriptors is associated to a specific FCB (it is going to be reserved).*/
@@ -256,40 +736,57 @@ int sys_Pipe(pipe_t* pipe)
 
 
 	/* Give birth to the Pipe. */
-	Pipe_CB* pipe_control = xmalloc(sizeof(Pipe_CB));
+	Pipe_CB* pipe_control = pipe_alloc(pipe_fcb[0], pipe_fcb[1]);
 
 
-	/* Initialization tactics. */
-	/*--------------------------*/
-	pipe_control->reader = pipe_fcb[0];
-	pipe_control->writer = pipe_fcb[1];
-
-	pipe_control->w_position=0;
-	pipe_control->r_position=0;
-
-	pipe_control-> has_data = COND_INIT;
-	pipe_control-> has_space = COND_INIT;
-	/*--------------------------*/
-
+	/* Establish the Pipe_Control_Block as the Streaming Object of the the files reserved(before).
+	 * Set stream_func Stream Functions referred to each file accordingly. Distinguish Reader from Writer. Associate the first FCB as a read and the second FCB as a Writer.
+	 * file_ops set of functions will be linked to.
+	 */
+	pipe_fcb[0]->flags = pipe_fcb[1]->flags = flags;
+	FCB_attach(pipe_fcb[0], pipe_control, &pipe_reader_fops);
+	FCB_attach(pipe_fcb[1], pipe_control, &pipe_writer_fops);
 
 
+	return 0;
+}
 
 
+Pipe_CB* fcb_read_pipe(FCB* fcb)
+{
+	if(fcb->streamfunc == &pipe_reader_fops)
+		return fcb->streamobj;
+	return socket_read_pipe(fcb);
+}
 
-	/* Establish the Pipe_Control_Block as the Streaming Object of the the files reserved(before) */
-	pipe_fcb[0]->streamobj = pipe_control;
-	pipe_fcb[1]->streamobj = pipe_control;
+Pipe_CB* fcb_write_pipe(FCB* fcb)
+{
+	if(fcb->streamfunc == &pipe_writer_fops)
+		return fcb->streamobj;
+	return socket_write_pipe(fcb);
+}
 
-	/* Set stream_func Stream Functions referred to each file accordingly. Distinguish Reader from Writer. Associate the first FCB as a read and the second FCB as a Writer.
-	 * file_ops set of functions will be linked to.
-	 */
-	pipe_fcb[0]->streamfunc = &pipe_reader_fops;
-	pipe_fcb[1]->streamfunc = &pipe_writer_fops;
+uint fcb_write_room(FCB* fcb)
+{
+	if(fcb->streamfunc == &pipe_writer_fops)
+		return pipe_write_room(fcb->streamobj);
+	return socket_write_room(fcb);
+}
 
 
+int sys_SetPipeCapacity(Fid_t fid, unsigned int capacity)
+{
+	FCB* fcb = get_fcb(fid);
+	if(fcb==NULL)
+		return -1;
 
+	Pipe_CB* pipCB = (fcb->streamfunc == &pipe_writer_fops) ? fcb->streamobj : fcb_read_pipe(fcb);
+	int ret = -1;
+	if(pipCB) {
+		pipe_set_capacity(pipCB, capacity);
+		ret = 0;
+	}
 
-	return 0;
+	FCB_decref(fcb);
+	return ret;
 }
-
-
@@ -1,11 +1,33 @@
+#ifndef __KERNEL_PIPE_H
 #define __KERNEL_PIPE_H
 
 
 
 #include "kernel_streams.h"
 
-/* BUFFER SIZE OF THE PIPE*/
-#define PIPE_BUFFER_SIZE 4000
+/* 
+ *	Pipe capacities. They must be powers of two. 
+ *
+ *	PIPE_BUFFER_SIZE is the initial capacity of a pipe, and the smallest capacity of an adaptive pipe.
+ *	An adaptive pipe grows up to PIPE_ADAPTIVE_CAPACITY. A fixed capacity, set by SetPipeCapacity,
+ *	is between PIPE_MIN_CAPACITY and PIPE_MAX_CAPACITY.
+ */
+#define PIPE_BUFFER_SIZE 4096
+#define PIPE_ADAPTIVE_CAPACITY (256*1024)
+#define PIPE_MIN_CAPACITY 512
+#define PIPE_MAX_CAPACITY (1024*1024)
+
+/*
+ *	Writes of up to PIPE_ATOMIC_WRITE bytes (or up to the largest capacity of the pipe, if it is
+ *	smaller) are atomic: they wait for room for all their data, so they are not interleaved with 
+ *	other writes. Larger writes may be split, when they find the pipe full.
+ */
+#define PIPE_ATOMIC_WRITE PIPE_BUFFER_SIZE
+
+_Static_assert((PIPE_BUFFER_SIZE & (PIPE_BUFFER_SIZE-1)) == 0, "PIPE_BUFFER_SIZE must be a power of two");
+_Static_assert((PIPE_ADAPTIVE_CAPACITY & (PIPE_ADAPTIVE_CAPACITY-1)) == 0, "PIPE_ADAPTIVE_CAPACITY must be a power of two");
+_Static_assert((PIPE_MIN_CAPACITY & (PIPE_MIN_CAPACITY-1)) == 0, "PIPE_MIN_CAPACITY must be a power of two");
+_Static_assert((PIPE_MAX_CAPACITY & (PIPE_MAX_CAPACITY-1)) == 0, "PIPE_MAX_CAPACITY must be a power of two");
 
 
 
@@ -18,11 +40,18 @@
  *	Condition Variable mechanicm is used in order to control any synchronization problems that might occur.
  *
  *	Integer variables @c w_position and @c r_position are accountable for keeping track of where reading and writing is happening 
- *	every moment at the Buffer.
+ *	every moment at the Buffer. They count the bytes written and read, and wrap around freely; their difference is the
+ *	number of bytes in the buffer, and their value modulo @c capacity is the position in the buffer.
+ *
+ *	The buffer is allocated on the first write. It is resized between @c min_capacity and @c max_capacity:
+ *	it doubles when a writer finds it full, and it halves when a reader empties it, if it was never more
+ *	than a quarter full since the last resize. For a fixed capacity, the two are equal.
  */
 
 typedef struct pipe_control_block {
 
+	Mutex lock;	/* Protects the pipe */
+
 	FCB *reader, *writer;
 
 
@@ -31,17 +60,45 @@ typedef struct pipe_control_block {
 	CondVar has_data;
 
 
-	int w_position, r_position;
+	uint w_position, r_position;
 
-	char BUFFER[PIPE_BUFFER_SIZE];
+	char* BUFFER;		/* The buffer, or NULL if not allocated yet */
+	uint capacity;		/* The size of the buffer */
+	uint min_capacity, max_capacity;	/* The range of capacity */
+	uint peak;			/* The most bytes in the buffer since the last resize */
+	int splicing;		/* Set while pipe_splice() writes out of the buffer, unlocked */
+	uint users;			/* Calls that may unlock the pipe inside it; it is not freed until they leave */
 
 } Pipe_CB;
 
+/* Allocate and initialize a pipe between two FCBs */
+Pipe_CB* pipe_alloc(FCB* reader, FCB* writer);
+
+/* Set the capacity of a pipe; 0 makes it adaptive. */
+void pipe_set_capacity(Pipe_CB* pipe_cb, uint capacity);
+
+/* The pipe a stream reads from (a pipe read end or a connected socket), or NULL */
+Pipe_CB* fcb_read_pipe(FCB* fcb);
+
+/* The pipe a stream writes to (a pipe write end or a connected socket), or NULL */
+Pipe_CB* fcb_write_pipe(FCB* fcb);
+
+/* How many bytes a stream takes in a write without waiting; streams that never wait take any number */
+uint fcb_write_room(FCB* fcb);
+
+/* How many bytes a write to the pipe takes without waiting */
+uint pipe_write_room(Pipe_CB* pipe_cb);
+
+/* Read up to n bytes from a pipe, writing them directly to a stream; like pipe_read, it blocks until data is available */
+int pipe_splice(Pipe_CB* pipe_cb, FCB* out, uint n);
+
 int pipe_write(void* pipe_cb, const char* buffer, uint n);
 int pipe_read(void* pipe_cb, char* buffer, uint n);
+int pipe_writev(void* pipe_cb, const iovec_t* iov, uint iovcnt);
+int pipe_readv(void* pipe_cb, const iovec_t* iov, uint iovcnt);
+int pipe_reader_poll(void* pipe_cb, poll_table* pt);
+int pipe_writer_poll(void* pipe_cb, poll_table* pt);
 int pipe_reader_close(void* pipe_cb);
 int pipe_writer_close(void* pipe_cb);
 
-
-
-
+#endif
@@ -13,6 +13,7 @@
  - WaitPid
  - GetPid
  - GetPPid
+ - SetExitHook
 
  */
 
@@ -33,12 +34,13 @@ Pid_t get_pid(PCB* pcb)
 /* Initialize a PCB */
 static inline void initialize_PCB(PCB* pcb)
 {
+  pcb->lock = MUTEX_INIT;
   pcb->pstate = FREE;
   pcb->argl = 0;
   pcb->args = NULL;
+  pcb->exit_hook = NULL;
 
-  for(int i=0;i<MAX_FILEID;i++)
-    pcb->FIDT[i] = NULL;
+  fidt_init(&pcb->FIDT);
 
   rlnode_init(& pcb->children_list, NULL);
   rlnode_init(& pcb->exited_list, NULL);
@@ -61,6 +63,7 @@ static inline void initialize_PCB(PCB* pcb)
 
 
 static PCB* pcb_freelist;
+static Mutex pcb_freelist_lock = MUTEX_INIT;
 
 void initialize_processes()
 {
@@ -86,32 +89,30 @@ void initialize_processes()
 }
 
 
-/*
-  Must be called with kernel_mutex held
-*/
 PCB* acquire_PCB()
 {
   PCB* pcb = NULL;
 
+  Mutex_Lock(&pcb_freelist_lock);
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
+  Mutex_Unlock(&pcb_freelist_lock);
 
   return pcb;
 }
 
-/*
-  Must be called with kernel_mutex held
-*/
 void release_PCB(PCB* pcb)
 {
+  Mutex_Lock(&pcb_freelist_lock);
   pcb->pstate = FREE;
   pcb->parent = pcb_freelist;
   pcb_freelist = pcb;
   process_count--;
+  Mutex_Unlock(&pcb_freelist_lock);
 }
 
 
@@ -176,22 +177,22 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   {
     /* Inherit parent */
     curproc = CURPROC;
+    Mutex_Lock(& curproc->lock);
 
     /* Add new process to the parent's child list */
     newproc->parent = curproc;
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
-    for(int i=0; i<MAX_FILEID; i++) {
-       newproc->FIDT[i] = curproc->FIDT[i];
-       if(newproc->FIDT[i])
-          FCB_incref(newproc->FIDT[i]);
-    }
+    fidt_inherit(&newproc->FIDT, &curproc->FIDT);
+
+    Mutex_Unlock(& curproc->lock);
   }
 
 
   /* Set the main thread's function */
   newproc->main_task = call;
+  newproc->exit_hook = NULL;
 
   /* Copy the arguments to new storage, owned by the new process */
   newproc->argl = argl;
@@ -210,7 +211,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
   if(call != NULL) {
 
     // Create a new thread. --> Main Thread.
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, 0);
 
     //spawn_process_thread(newproc->main_thread, call, argl, args);
 
@@ -245,9 +246,11 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlnode_init(&ptcb->ptcb_list_node, ptcb);
 
     // Insert ptcb to the PCB list of PTCBs
+    Mutex_Lock(&newproc->lock);
     rlist_push_back(&newproc->PTCB_list, &ptcb->ptcb_list_node);
     // Increment the counter that counts active threads.
     newproc->thread_count++;
+    Mutex_Unlock(&newproc->lock);
 
     //--
 
@@ -283,6 +286,17 @@ Pid_t sys_GetPPid()
 }
 
 
+ExitHook sys_SetExitHook(ExitHook hook)
+{
+  PCB* curproc = CURPROC;
+  Mutex_Lock(& curproc->lock);
+  ExitHook old = curproc->exit_hook;
+  curproc->exit_hook = hook;
+  Mutex_Unlock(& curproc->lock);
+  return old;
+}
+
+
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
@@ -300,11 +314,12 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Legality checks */
   if((cpid<0) || (cpid>=MAX_PROC)) {
-    cpid = NOPROC;
-    goto finish;
+    return NOPROC;
   }
 
   PCB* parent = CURPROC;
+  Mutex_Lock(& parent->lock);
+
   PCB* child = get_pcb(cpid);
   if( child == NULL || child->parent != parent)
   {
@@ -313,12 +328,19 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
   }
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
-  while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+  while(child->parent == parent && child->pstate == ALIVE)
+    kernel_wait(& parent->lock, & parent->child_exit, SCHED_USER);
+
+  /* Another thread of mine may have cleaned it up meanwhile */
+  if(child->parent != parent || child->pstate != ZOMBIE) {
+    cpid = NOPROC;
+    goto finish;
+  }
   
   cleanup_zombie(child, status);
   
 finish:
+  Mutex_Unlock(& parent->lock);
   return cpid;
 }
 
@@ -328,6 +350,7 @@ static Pid_t wait_for_any_child(int* status)
   Pid_t cpid;
 
   PCB* parent = CURPROC;
+  Mutex_Lock(& parent->lock);
 
   /* Make sure I have children! */
   int no_children, has_exited;
@@ -338,17 +361,20 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(& parent->lock, & parent->child_exit, SCHED_USER);    
   }
 
-  if(no_children)
+  if(no_children) {
+    Mutex_Unlock(& parent->lock);
     return NOPROC;
+  }
 
   PCB* child = parent->exited_list.next->pcb;
   assert(child->pstate == ZOMBIE);
   cpid = get_pid(child);
   cleanup_zombie(child, status);
 
+  Mutex_Unlock(& parent->lock);
   return cpid;
 }
 
@@ -410,6 +436,7 @@ int procinfo_read(void* pinfo, char* buf, uint size)
 
   int count=get_pid(cur);
 
+  Mutex_Lock(& cur->lock);
 
   pinfoCB->procinfo.pid =  get_pid(cur);
   pinfoCB->procinfo.ppid= get_pid(cur->parent);
@@ -426,6 +453,8 @@ int procinfo_read(void* pinfo, char* buf, uint size)
     else
       memcpy(pinfoCB->procinfo.args, cur->args, cur->argl);
   }
+
+  Mutex_Unlock(& cur->lock);
     
   memcpy(buf, (char*)&pinfoCB->procinfo, sizeof(procinfo));
 
@@ -482,8 +511,7 @@ Fid_t sys_OpenInfo()
 
   pinfoCB->cursor=&PT[0];
 
-  pinfo_fcb->streamfunc = &procinfo_fops;
-  pinfo_fcb->streamobj = pinfoCB; 
+  FCB_attach(pinfo_fcb, pinfoCB, &procinfo_fops);
 
   return pinfo_fid;
 }
@@ -17,6 +17,7 @@
 
 #include "tinyos.h"
 #include "kernel_sched.h"
+#include "kernel_streams.h"
 
 /**
   @brief PID state
@@ -36,6 +37,14 @@ typedef enum pid_state_e {
   This structure holds all information pertaining to a process.
  */
 typedef struct process_control_block {
+  Mutex lock;             /**< @brief Protects the PCB.
+
+                             This protects the lists of children and threads, the 
+                             fileid table and the thread counters. The @c parent
+                             field of a child, and its @c pstate, are protected by
+                             the lock of the parent. Reparenting to init also holds 
+                             the lock of init. */
+
   pid_state  pstate;      /**< @brief The pid state for this PCB */
 
   PCB* parent;            /**< @brief Parent's pcb. */
@@ -58,7 +67,9 @@ typedef struct process_control_block {
                              process terminates. It is used in the implementation of
                              @c WaitChild() */
 
-  FCB* FIDT[MAX_FILEID];  /**< @brief The fileid table of the process */
+  fid_table FIDT;         /**< @brief The fileid table of the process */
+
+  ExitHook exit_hook;     /**< @brief Called by the last thread as it exits, or NULL */
 
   rlnode PTCB_list;     // ;)
   int thread_count;       // ;)
@@ -0,0 +1,303 @@
+#include <string.h>
+
+#include "tinyos.h"
+#include "kernel_ring.h"
+#include "kernel_cc.h"
+
+
+/*
+	The bytes in ring i. The loads are sequentially consistent, so that an
+	end which sets its waiting flag and then finds the ring empty (or full)
+	cannot miss the progress of the other end (which advances its counter
+	and then checks the flag). Counters that the program has moved too far
+	apart are taken as a full ring.
+ */
+static inline uint ring_used(Ring_Pair* rp, int i)
+{
+	socket_ring* r = &rp->ring[i];
+	uint used = __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) - __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+	return (used < rp->size) ? used : rp->size;
+}
+
+/* Copy count bytes between ring i, from position pos, and the buffers */
+static void ring_copy(Ring_Pair* rp, int i, uint pos, const iovec_t* iov, uint count, int to_ring)
+{
+	uint size = rp->size;
+	char* data = rp->data[i];
+	for(uint k=0; count > 0; k++) {
+		char* base = iov[k].base;
+		uint len = (iov[k].len < count) ? iov[k].len : count;
+		count -= len;
+		while(len > 0) {
+			uint off = pos & (size - 1);
+			uint chunk = (size - off < len) ? size - off : len;
+			if(to_ring)
+				memcpy(data + off, base, chunk);
+			else
+				memcpy(base, data + off, chunk);
+			base += chunk;
+			pos += chunk;
+			len -= chunk;
+		}
+	}
+}
+
+
+Ring_Pair* ring_alloc(FCB* fcb0, FCB* fcb1)
+{
+	/* The data of the two rings follow the pair */
+	Ring_Pair* rp = xmalloc(sizeof(Ring_Pair) + 2*SOCKET_RING_SIZE);
+
+	rp->lock = MUTEX_INIT;
+	rp->fcb[0] = fcb0;
+	rp->fcb[1] = fcb1;
+	rp->size = SOCKET_RING_SIZE;
+	for(int i=0; i<2; i++) {
+		rp->has_data[i] = COND_INIT;
+		rp->has_space[i] = COND_INIT;
+		rp->data[i] = (char*)(rp+1) + i*SOCKET_RING_SIZE;
+		rp->ring[i] = (socket_ring) {
+			.head = 0, .tail = 0, .size = rp->size,
+			.reader_waiting = 0, .writer_waiting = 0,
+			.reader_closed = 0, .writer_closed = 0,
+			.data = rp->data[i]
+		};
+	}
+
+	return rp;
+}
+
+
+/* Wake up the other side, with the lock held */
+static void ring_wake_locked(Ring_Pair* rp, int side)
+{
+	socket_ring* tx = &rp->ring[side];
+	socket_ring* rx = &rp->ring[1-side];
+	int woken = 0;
+
+	if(__atomic_exchange_n(&tx->reader_waiting, 0, __ATOMIC_SEQ_CST)) {
+		kernel_broadcast(&rp->has_data[side]);
+		woken = 1;
+	}
+	if(__atomic_exchange_n(&rx->writer_waiting, 0, __ATOMIC_SEQ_CST)) {
+		kernel_broadcast(&rp->has_space[1-side]);
+		woken = 1;
+	}
+	if(woken && rp->fcb[1-side])
+		poll_wakeup(&rp->fcb[1-side]->pollq);
+}
+
+void ring_wake(Ring_Pair* rp, int side)
+{
+	Mutex_Lock(&rp->lock);
+	ring_wake_locked(rp, side);
+	Mutex_Unlock(&rp->lock);
+}
+
+
+uint ring_room(Ring_Pair* rp, int side)
+{
+	return rp->size - ring_used(rp, side);
+}
+
+
+/* Write as much of the buffers as fits in the ring of the side */
+int ring_writev(Ring_Pair* rp, int side, const iovec_t* iov, uint iovcnt)
+{
+	if(rp==NULL || iov==NULL)
+		return -1;
+	uint n = iov_total(iov, iovcnt);
+	if(n < 1)
+		return -1;
+
+	socket_ring* tx = &rp->ring[side];
+
+	Mutex_Lock(&rp->lock);
+
+	/* Wait for space, unless the reader is gone */
+	int retcode = 0;
+	while(! tx->writer_closed && ! tx->reader_closed && ring_used(rp, side) == rp->size) {
+		if(FCB_nonblocking(rp->fcb[side])) {
+			retcode = WOULD_BLOCK;
+			break;
+		}
+		__atomic_store_n(&tx->writer_waiting, 1, __ATOMIC_SEQ_CST);
+		if(ring_used(rp, side) == rp->size && ! tx->reader_closed)
+			kernel_wait(&rp->lock, &rp->has_space[side], SCHED_PIPE);
+	}
+
+	if(tx->writer_closed || tx->reader_closed)
+		retcode = -1;
+	else if(retcode == 0) {
+		uint room = rp->size - ring_used(rp, side);
+		uint count = (n < room) ? n : room;
+		ring_copy(rp, side, tx->tail, iov, count, 1);
+		__atomic_store_n(&tx->tail, tx->tail + count, __ATOMIC_SEQ_CST);
+		ring_wake_locked(rp, side);
+		retcode = count;
+	}
+
+	Mutex_Unlock(&rp->lock);
+
+	return retcode;
+}
+
+/* Read what is available in the ring to the side, up to the size of the buffers */
+int ring_readv(Ring_Pair* rp, int side, const iovec_t* iov, uint iovcnt)
+{
+	if(rp==NULL || iov==NULL)
+		return -1;
+	uint n = iov_total(iov, iovcnt);
+	if(n < 1)
+		return -1;
+
+	socket_ring* rx = &rp->ring[1-side];
+
+	Mutex_Lock(&rp->lock);
+
+	/* Wait for data, unless the writer is gone */
+	int retcode = 0;
+	while(! rx->reader_closed && ! rx->writer_closed && ring_used(rp, 1-side) == 0) {
+		if(FCB_nonblocking(rp->fcb[side])) {
+			retcode = WOULD_BLOCK;
+			break;
+		}
+		__atomic_store_n(&rx->reader_waiting, 1, __ATOMIC_SEQ_CST);
+		if(ring_used(rp, 1-side) == 0 && ! rx->writer_closed)
+			kernel_wait(&rp->lock, &rp->has_data[1-side], SCHED_PIPE);
+	}
+
+	/* If the writer is gone, and the ring is empty, this is the end of file */
+	if(rx->reader_closed)
+		retcode = -1;
+	else if(retcode == 0) {
+		uint used = ring_used(rp, 1-side);
+		uint count = (n < used) ? n : used;
+		ring_copy(rp, 1-side, rx->head, iov, count, 0);
+		__atomic_store_n(&rx->head, rx->head + count, __ATOMIC_SEQ_CST);
+		ring_wake_locked(rp, side);
+		retcode = count;
+	}
+
+	Mutex_Unlock(&rp->lock);
+
+	return retcode;
+}
+
+
+/* The events of a side, with the lock held */
+static int ring_mask(Ring_Pair* rp, int side)
+{
+	socket_ring* tx = &rp->ring[side];
+	socket_ring* rx = &rp->ring[1-side];
+	int mask = 0;
+
+	if(rx->reader_closed)
+		mask |= POLL_HANGUP;
+	else {
+		if(ring_used(rp, 1-side) > 0 || rx->writer_closed)
+			mask |= POLL_READ;
+		if(rx->writer_closed)
+			mask |= POLL_HANGUP;
+	}
+
+	if(tx->writer_closed || tx->reader_closed)
+		mask |= POLL_ERROR;
+	else if(ring_used(rp, side) < rp->size)
+		mask |= POLL_WRITE;
+
+	return mask;
+}
+
+/*
+	Polling is how a program sleeps on the rings: a side that is not
+	readable (or writable) is marked as waiting, so that the other side
+	wakes it up after it makes progress.
+ */
+int ring_poll(Ring_Pair* rp, int side, poll_table* pt)
+{
+	if(rp==NULL)
+		return POLL_ERROR | POLL_HANGUP;
+
+	Mutex_Lock(&rp->lock);
+
+	int mask = POLL_ERROR | POLL_HANGUP;
+	if(rp->fcb[side]) {
+		poll_wait(pt, &rp->fcb[side]->pollq);
+
+		mask = ring_mask(rp, side);
+		int waiting = 0;
+		if(! (mask & (POLL_READ | POLL_HANGUP))) {
+			__atomic_store_n(&rp->ring[1-side].reader_waiting, 1, __ATOMIC_SEQ_CST);
+			waiting = 1;
+		}
+		if(! (mask & (POLL_WRITE | POLL_ERROR))) {
+			__atomic_store_n(&rp->ring[side].writer_waiting, 1, __ATOMIC_SEQ_CST);
+			waiting = 1;
+		}
+		/* Look again, in case the other side made progress before it saw the flags */
+		if(waiting)
+			mask = ring_mask(rp, side);
+	}
+
+	Mutex_Unlock(&rp->lock);
+
+	return mask;
+}
+
+
+static void ring_reader_close_locked(Ring_Pair* rp, int side)
+{
+	socket_ring* rx = &rp->ring[1-side];
+
+	if(rx->reader_closed)
+		return;
+	rx->reader_closed = 1;
+
+	kernel_broadcast(&rp->has_space[1-side]);
+	if(rp->fcb[1-side])
+		poll_wakeup(&rp->fcb[1-side]->pollq);
+}
+
+static void ring_writer_close_locked(Ring_Pair* rp, int side)
+{
+	socket_ring* tx = &rp->ring[side];
+
+	if(tx->writer_closed)
+		return;
+	tx->writer_closed = 1;
+
+	kernel_broadcast(&rp->has_data[side]);
+	if(rp->fcb[1-side])
+		poll_wakeup(&rp->fcb[1-side]->pollq);
+}
+
+void ring_reader_close(Ring_Pair* rp, int side)
+{
+	Mutex_Lock(&rp->lock);
+	ring_reader_close_locked(rp, side);
+	Mutex_Unlock(&rp->lock);
+}
+
+void ring_writer_close(Ring_Pair* rp, int side)
+{
+	Mutex_Lock(&rp->lock);
+	ring_writer_close_locked(rp, side);
+	Mutex_Unlock(&rp->lock);
+}
+
+void ring_detach(Ring_Pair* rp, int side)
+{
+	Mutex_Lock(&rp->lock);
+
+	ring_reader_close_locked(rp, side);
+	ring_writer_close_locked(rp, side);
+	rp->fcb[side] = NULL;
+
+	int unused = (rp->fcb[1-side]==NULL);
+
+	Mutex_Unlock(&rp->lock);
+
+	if(unused)
+		free(rp);
+}
@@ -0,0 +1,67 @@
+#ifndef __KERNEL_RING_H
+#define __KERNEL_RING_H
+
+
+
+#include "kernel_streams.h"
+
+
+
+/*
+ *	Shared ring implementation.
+ *	A ring pair carries the data of two connected sockets of type SOCK_RING, as
+ *	a pair of pipes does for byte stream sockets. Unlike pipes, the rings are
+ *	shared with the program (see SocketRing), which moves data through them
+ *	without calling the kernel; the kernel only puts the readers and writers
+ *	to sleep and wakes them up, and serves Read and Write on the sockets.
+ *
+ *	Side i of the pair is the socket @c fcb[i]; it writes @c ring[i] and reads
+ *	@c ring[1-i]. The counters of a ring are advanced without the lock, by
+ *	its single reader and writer; the lock serializes sleeping and waking up,
+ *	and the closing of the ends. Each end announces that it may sleep by the
+ *	@c reader_waiting and @c writer_waiting flags of the ring, and the other end
+ *	wakes it up (see ring_wake) after it makes progress.
+ *
+ *	The program can write anything to the rings, so the kernel never uses
+ *	their @c size and @c data; it keeps its own copies in the pair, and
+ *	bounds the counters by them.
+ */
+
+typedef struct ring_pair {
+
+	Mutex lock;		/* Protects sleeping, waking up and closing */
+
+	FCB* fcb[2];	/* The two sockets, or NULL once closed */
+
+	CondVar has_data[2];	/* The reader of ring[i] waits here */
+
+	CondVar has_space[2];	/* The writer of ring[i] waits here */
+
+	socket_ring ring[2];	/* ring[i] is written by side i */
+
+	uint size;		/* The size of each ring */
+
+	char* data[2];	/* The buffer of ring[i] */
+
+} Ring_Pair;
+
+/* Allocate and initialize the rings between two FCBs */
+Ring_Pair* ring_alloc(FCB* fcb0, FCB* fcb1);
+
+int ring_writev(Ring_Pair* rp, int side, const iovec_t* iov, uint iovcnt);
+int ring_readv(Ring_Pair* rp, int side, const iovec_t* iov, uint iovcnt);
+int ring_poll(Ring_Pair* rp, int side, poll_table* pt);
+
+/* The free room in the ring of the side */
+uint ring_room(Ring_Pair* rp, int side);
+
+/* Wake up the other side, if it waits on the progress of this side */
+void ring_wake(Ring_Pair* rp, int side);
+
+void ring_reader_close(Ring_Pair* rp, int side);
+void ring_writer_close(Ring_Pair* rp, int side);
+
+/* Close both ends of a side; the pair is freed when both sides are detached */
+void ring_detach(Ring_Pair* rp, int side);
+
+#endif
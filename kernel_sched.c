@@ -54,27 +54,32 @@ TCB* cur_thread()
    The thread layout.
   --------------------
 
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. We allocate the TCB
+  at the top of the memory block used as the stack, and a guard page at
+  the bottom.
 
-  +-------------+
+  +-------------+  <- block + THREAD_GUARD_SIZE + stack_size + THREAD_TCB_SIZE
   |   TCB       |
+  +-------------+  <- the TCB pointer, and the top of the stack
+  | first frame |
   +-------------+
-  |             |
+  |      |      |
+  |      v      |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
-  +-------------+
-  | first frame |
-  +-------------+
+  +-------------+  <- block + THREAD_GUARD_SIZE
+  | guard page  |
+  +-------------+  <- block
+
+  Advantages: (a) unified memory area for stack and TCB (b) a stack
+  overrun runs into the guard page (which is not accessible) and crashes
+  its own thread, instead of corrupting memory.
 
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Disadvantages: The stack cannot grow. Of course, we do not support stack
+  growth anyway! However, pages of the stack are only committed by the
+  OS when first touched, so a large stack costs little unless it is used.
 
-  Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
-  we do not support stack growth anyway!
+  The stack size of each thread is stored in its TCB.
  */
 
 /*
@@ -91,43 +96,131 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
-
-//#define MMAPPED_THREAD_MEM
+#define MMAPPED_THREAD_MEM
 #ifdef MMAPPED_THREAD_MEM
 
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+  Use mmap to allocate a thread. The guard page is made inaccessible,
+  so that a stack overflow is detected as seg.fault.
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
+void free_thread(void* tcb, size_t stack_size)
+{
+	CHECK(munmap(tcb - stack_size - THREAD_GUARD_SIZE,
+		THREAD_GUARD_SIZE + stack_size + THREAD_TCB_SIZE));
+}
 
-void* allocate_thread(size_t size)
+void* allocate_thread(size_t stack_size)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	void* ptr = mmap(NULL, THREAD_GUARD_SIZE + stack_size + THREAD_TCB_SIZE,
+		PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE | MAP_STACK, -1, 0);
 
 	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
 
-	return ptr;
+	return ptr + THREAD_GUARD_SIZE + stack_size;
 }
 #else
+
+#define THREAD_GUARD_SIZE 0
+
 /*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
+  Use malloc to allocate a thread. This does not detect stack overflow,
+  and commits the whole block.
  */
-void free_thread(void* ptr, size_t size) { free(ptr); }
+void free_thread(void* tcb, size_t stack_size) { free(tcb - stack_size); }
 
-void* allocate_thread(size_t size)
+void* allocate_thread(size_t stack_size)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
+	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, stack_size + THREAD_TCB_SIZE);
 	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	return ptr + stack_size;
 }
 #endif
 
 
+/*
+  Thread blocks are recycled through a cache on each core, so that
+  creating and destroying threads does not go through mmap/munmap
+  every time. Only blocks with the default stack size are cached.
+
+  The cache of the core the caller runs on is used. Since the caller
+  may be preempted and resume on a different core, each cache has its
+  own spinlock.
+ */
+static volatile uint thread_cache_limit = THREAD_CACHE_LIMIT;
+
+static void* thread_cache_get()
+{
+	thread_cache* tc = &cctx[cpu_core_id].tcache;
+	void* block = NULL;
+
+	Mutex_Lock(&tc->spinlock);
+	if (tc->count > 0) {
+		block = rlist_pop_front(&tc->blocks)->tcb;
+		tc->count--;
+		tc->hits++;
+	} else {
+		tc->misses++;
+	}
+	Mutex_Unlock(&tc->spinlock);
+
+	return (block != NULL) ? block : allocate_thread(THREAD_STACK_SIZE);
+}
+
+static void thread_cache_put(TCB* tcb)
+{
+	thread_cache* tc = &cctx[cpu_core_id].tcache;
+	int keep;
+
+	Mutex_Lock(&tc->spinlock);
+	keep = tc->count < thread_cache_limit;
+	if (keep) {
+		rlnode_init(&tcb->sched_node, tcb);
+		rlist_push_front(&tc->blocks, &tcb->sched_node);
+		tc->count++;
+		tc->recycled++;
+	} else {
+		tc->freed++;
+	}
+	Mutex_Unlock(&tc->spinlock);
+
+	if (!keep)
+		free_thread(tcb, THREAD_STACK_SIZE);
+}
+
+/* Free all the blocks of a cache */
+static void thread_cache_drain(thread_cache* tc)
+{
+	Mutex_Lock(&tc->spinlock);
+	while (tc->count > 0) {
+		free_thread(rlist_pop_front(&tc->blocks)->tcb, THREAD_STACK_SIZE);
+		tc->count--;
+	}
+	Mutex_Unlock(&tc->spinlock);
+}
+
+uint set_thread_cache_limit(uint limit)
+{
+	uint old = thread_cache_limit;
+	thread_cache_limit = limit;
+	return old;
+}
+
+void get_thread_cache_stats(thread_cache_stats* stats)
+{
+	*stats = (thread_cache_stats) { 0 };
+	for (uint c = 0; c < MAX_CORES; c++) {
+		thread_cache* tc = &cctx[c].tcache;
+		stats->hits += tc->hits;
+		stats->misses += tc->misses;
+		stats->recycled += tc->recycled;
+		stats->freed += tc->freed;
+		stats->cached += tc->count;
+	}
+}
 
 
 /*
@@ -152,16 +245,29 @@ static void thread_start()
   Initialize and return a new TCB
 */
 
-TCB* spawn_thread(PCB* pcb, void (*func)())
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	/* The stack size must be a multiple of page size */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	else if (stack_size < THREAD_STACK_MIN)
+		stack_size = THREAD_STACK_MIN;
+	else if (stack_size > THREAD_STACK_MAX)
+		stack_size = THREAD_STACK_MAX;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	TCB* tcb = (stack_size == THREAD_STACK_SIZE)
+		? (TCB*)thread_cache_get()
+		: (TCB*)allocate_thread(stack_size);
+	tcb->stack_size = stack_size;
 
 	/* Set the owner */
 	tcb->owner_pcb = pcb;
 
 	tcb->priority=PRIORITY_QUEUES-1;
 	assert(tcb->priority==PRIORITY_QUEUES-1);
+	tcb->inherited_priority = -1;
+	tcb->pi_mutexes = 0;
 
 	/* Initialize the other attributes */
 	tcb->type = NORMAL_THREAD;
@@ -176,14 +282,17 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 	tcb->last_cause = SCHED_IDLE;
 	tcb->curr_cause = SCHED_IDLE;
 
+	tcb->state_spinlock = MUTEX_INIT;
+	tcb->core = 0;
+
 	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	void* sp = ((void*)tcb) - stack_size;
 
 	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+	cpu_initialize_context(&tcb->context, sp, stack_size, thread_start);
 
 #ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + stack_size);
 #endif
 
 	/* increase the count of active threads */
@@ -195,7 +304,8 @@ TCB* spawn_thread(PCB* pcb, void (*func)())
 }
 
 /*
-  This is called with sched_spinlock locked !
+  This is called by the scheduler, after the thread has been switched out
+  for the last time. No scheduler lock is held.
  */
 void release_TCB(TCB* tcb)
 {
@@ -203,7 +313,10 @@ void release_TCB(TCB* tcb)
 	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
 #endif
 
-	free_thread(tcb, THREAD_SIZE);
+	if (tcb->stack_size == THREAD_STACK_SIZE)
+		thread_cache_put(tcb);
+	else
+		free_thread(tcb, tcb->stack_size);
 
 	Mutex_Lock(&active_threads_spinlock);
 	active_threads--;
@@ -221,19 +334,29 @@ void release_TCB(TCB* tcb)
  */
 
 /*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-
-  Both of these structures are protected by @c sched_spinlock.
+  Each core owns a multilevel run queue, stored in its CCB and protected
+  by the core's own @c sched_spinlock. A thread is queued on the core
+  recorded in @c tcb->core, which is the core it last ran on (or the least
+  loaded core, for a new thread). Cores that run out of work steal from the
+  busiest core, and every BALANCE_YIELD_CALLS yields each core pulls half of
+  the excess from the busiest core.
+
+  The state of a thread (state, phase and wakeup_time) is protected by the
+  thread's own @c state_spinlock.
+
+  Each core also contains a timer wheel of the threads that went to sleep
+  on it with a timeout, protected by the wheel's own spinlock.
+
+  Lock order:  tcb->state_spinlock  -->  ccb->sched_spinlock
+               tcb->state_spinlock  -->  ccb->timeouts.spinlock
+
+  Two run-queue locks are held together only to move threads between
+  cores (see @c sched_balance()), and are then locked in the order of
+  the core ids. A run-queue lock is never held together with a timer
+  wheel lock. Since @c sched_wakeup_expired_timeouts() must find a
+  thread before locking it, it only tries to lock it.
 */
 
-//rlnode SCHED; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
-
 /* Interrupt handler for ALARM */
 void yield_handler() { yield(SCHED_QUANTUM); }
 
@@ -243,111 +366,443 @@ void ici_handler()
 }
 
 /*
-  Possibly add TCB to the scheduler timeout list.
+  Hash a thread into the timer wheel, according to its wakeup_time.
+  A thread already due goes to the next tick.
+
+  *** MUST BE CALLED WITH tw->spinlock HELD ***
+*/
+static void timer_wheel_insert(timer_wheel* tw, TCB* tcb)
+{
+	TimerDuration expires = (tcb->wakeup_time + TIMER_TICK - 1) / TIMER_TICK;
+	if (expires <= tw->tick)
+		expires = tw->tick + 1;
+
+	/* Find the level whose range covers the delay; clamp very long delays */
+	TimerDuration delta = expires - tw->tick;
+	int level = 0;
+	while (level < TIMER_WHEEL_LEVELS - 1 && delta >= ((TimerDuration)1 << (TIMER_WHEEL_BITS * (level + 1))))
+		level++;
+	if (delta >= ((TimerDuration)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+		expires = tw->tick + ((TimerDuration)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+
+	uint index = (expires >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SIZE - 1);
+	rlist_push_back(&tw->slot[level][index], &tcb->sched_node);
+}
+
+/*
+  Turn the wheel up to the current time. Threads that expire and can
+  be locked are moved to @c expired, locked and with no wakeup_time.
+
+  *** MUST BE CALLED WITH tw->spinlock HELD ***
+*/
+static void timer_wheel_advance(timer_wheel* tw, rlnode* expired)
+{
+	TimerDuration now = bios_clock() / TIMER_TICK;
+
+	while (tw->tick < now) {
+		if (tw->pending == 0) {
+			tw->tick = now;
+			break;
+		}
+
+		tw->tick++;
+
+		/* Cascade the higher levels whose slot comes around */
+		for (int level = TIMER_WHEEL_LEVELS - 1; level > 0; level--) {
+			if ((tw->tick & (((TimerDuration)1 << (TIMER_WHEEL_BITS * level)) - 1)) != 0)
+				continue;
+			rlnode* slot = &tw->slot[level][(tw->tick >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SIZE - 1)];
+			rlnode cascade;
+			rlnode_init(&cascade, NULL);
+			rlist_append(&cascade, slot);
+			while (!is_rlist_empty(&cascade))
+				timer_wheel_insert(tw, rlist_pop_front(&cascade)->tcb);
+		}
+
+		/* Expire level 0 */
+		rlnode* slot = &tw->slot[0][tw->tick & (TIMER_WHEEL_SIZE - 1)];
+		rlnode busy;
+		rlnode_init(&busy, NULL);
+		while (!is_rlist_empty(slot)) {
+			TCB* tcb = rlist_pop_front(slot)->tcb;
+			if (Mutex_TryLock(&tcb->state_spinlock)) {
+				tcb->wakeup_time = NO_TIMEOUT;
+				tw->pending--;
+				rlist_push_back(expired, &tcb->sched_node);
+			} else {
+				/* Whoever holds the lock may be removing it; retry on the next tick */
+				rlist_push_back(&busy, &tcb->sched_node);
+			}
+		}
+		while (!is_rlist_empty(&busy))
+			timer_wheel_insert(tw, rlist_pop_front(&busy)->tcb);
+	}
+}
+
+/*
+  Possibly add TCB to the timer wheel of its core.
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
 */
 static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
 {
 	if (timeout != NO_TIMEOUT) {
+		timer_wheel* tw = &cctx[tcb->core].timeouts;
+		Mutex_Lock(&tw->spinlock);
+
 		/* set the wakeup time */
 		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+		tcb->wakeup_time = curtime + timeout;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+		timer_wheel_insert(tw, tcb);
+		tw->pending++;
+
+		Mutex_Unlock(&tw->spinlock);
+	}
+}
+
+/*
+  Return the core with the fewest queued threads, preferring the
+  current core. The counters are read without locking, this is
+  only a heuristic.
+*/
+static uint sched_least_loaded_core()
+{
+	uint best = cpu_core_id;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if (cctx[c].ready_count < cctx[best].ready_count)
+			best = c;
+	return best;
+}
+
+/*
+  Return the core with the most queued threads, other than @c ccb,
+  or NULL if every other core has an empty run queue.
+*/
+static CCB* sched_busiest_core(CCB* ccb)
+{
+	CCB* busiest = NULL;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* other = &cctx[c];
+		if (other != ccb && other->ready_count > 0
+			&& (busiest == NULL || other->ready_count > busiest->ready_count))
+			busiest = other;
 	}
+	return busiest;
+}
+
+/*
+  The run queue of a core is indexed by a bitmap of its non-empty
+  priority levels, so that the highest priority thread is found by
+  a single find-last-set.
+
+  Boosting raises every queued thread by one level. Instead of relinking
+  every thread, the queues of levels 0..PRIORITY_QUEUES-2 form a ring
+  that is rotated by one (@c boost_offset), after appending the queue of
+  level PRIORITY_QUEUES-2 to the top level. The @c priority of a queued
+  thread is brought up to date when it leaves the queue, from the number
+  of boosts that happened meanwhile (@c boost_epoch).
+*/
+
+_Static_assert(PRIORITY_QUEUES <= 32, "ready_bitmap must have a bit per priority level");
+
+#define TOP_PRIORITY (PRIORITY_QUEUES - 1)
+#define READY_BITMAP_MASK ((uint)(((uint64_t)1 << PRIORITY_QUEUES) - 1))
+
+/* Return the queue of a priority level */
+static inline rlnode* sched_level_queue(CCB* ccb, int level)
+{
+	if (level == TOP_PRIORITY)
+		return &ccb->ready_queue[TOP_PRIORITY];
+	return &ccb->ready_queue[(level + ccb->boost_offset) % TOP_PRIORITY];
 }
 
 /*
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+  Push a thread to the run queue of a core.
+
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
 */
-static void sched_queue_add(TCB* tcb)
+static inline void sched_queue_push(CCB* ccb, TCB* tcb)
 {
 	/* Insert at the end of the the specific scheduling list according to Thread Priority. */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	tcb->core = ccb->id;
+	tcb->boost_epoch = ccb->boost_epoch;
+	int level = thread_priority(tcb);
+	rlist_push_back(sched_level_queue(ccb, level), &tcb->sched_node);
+	ccb->ready_bitmap |= 1u << level;
+	ccb->ready_count++;
+}
+
+/* Apply to a thread leaving the run queue the boosts that happened while it was queued */
+static inline void sched_apply_boosts(CCB* ccb, TCB* tcb)
+{
+	uint boosts = ccb->boost_epoch - tcb->boost_epoch;
+	tcb->priority = (boosts >= (uint)(TOP_PRIORITY - tcb->priority)) ? TOP_PRIORITY : tcb->priority + (int)boosts;
+}
+
+/*
+  Remove the head of a core's run queue, if any, and return it.
+  Return NULL if the queue is empty.
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static inline TCB* sched_queue_pop(CCB* ccb)
+{
+	if (ccb->ready_bitmap == 0)
+		return NULL;
+
+	/* The highest non-empty priority level */
+	int level = 31 - __builtin_clz(ccb->ready_bitmap);
+	rlnode* queue = sched_level_queue(ccb, level);
+
+	TCB* tcb = rlist_pop_front(queue)->tcb;
+	assert(tcb != NULL);
+	if (ccb->handoff == tcb)
+		ccb->handoff = NULL;
+	if (is_rlist_empty(queue))
+		ccb->ready_bitmap &= ~(1u << level);
+	ccb->ready_count--;
+
+	sched_apply_boosts(ccb, tcb);
+	return tcb;
 }
 
 /*
-	Adjust the state of a thread to make it READY.
+  Remove a queued thread from the run queue of a core.
 
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
+  *** MUST BE CALLED WITH ccb->sched_spinlock HELD ***
+*/
+static inline void sched_queue_remove(CCB* ccb, TCB* tcb)
+{
+	/* The level it was pushed at, raised by the boosts since */
+	uint boosts = ccb->boost_epoch - tcb->boost_epoch;
+	int level = thread_priority(tcb);
+	level = (boosts >= (uint)(TOP_PRIORITY - level)) ? TOP_PRIORITY : level + (int)boosts;
+
+	rlist_remove(&tcb->sched_node);
+	if (ccb->handoff == tcb)
+		ccb->handoff = NULL;
+	if (is_rlist_empty(sched_level_queue(ccb, level)))
+		ccb->ready_bitmap &= ~(1u << level);
+	ccb->ready_count--;
+
+	sched_apply_boosts(ccb, tcb);
+}
+
+/*
+  Add a READY, CTX_CLEAN thread to the run queue of its core. With
+  handoff, the thread also becomes the handoff hint of its core.
+
+  *** MUST BE CALLED WITH tcb->state_spinlock HELD ***
+*/
+static void sched_queue_add(TCB* tcb, int handoff)
+{
+	CCB* ccb = &cctx[tcb->core];
+
+	Mutex_Lock(&ccb->sched_spinlock);
+	sched_queue_push(ccb, tcb);
+	if (handoff)
+		ccb->handoff = tcb;
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	/* Restart the core if it is halted, else some other core that may steal the thread */
+	if (ccb == &CURCORE || !cpu_core_restart(ccb->id))
+		cpu_core_restart_one();
+}
+
+/*
+	Adjust the state of a thread to make it READY. With handoff, a 
+	stopped thread is moved to the current core, as its handoff hint.
+
+	*** MUST BE CALLED WITH tcb->state_spinlock HELD ***
  */
-static void sched_make_ready(TCB* tcb)
+static void sched_make_ready(TCB* tcb, int handoff)
 {
 	assert(tcb->state == STOPPED || tcb->state == INIT);
 
-	/* Possibly remove from TIMEOUT_LIST */
+	/* Possibly remove from the timer wheel */
 	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
+		/* tcb is in the timer wheel of its core, fix it */
 		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
+		timer_wheel* tw = &cctx[tcb->core].timeouts;
+		Mutex_Lock(&tw->spinlock);
 		rlist_remove(&tcb->sched_node);
 		tcb->wakeup_time = NO_TIMEOUT;
+		tw->pending--;
+		Mutex_Unlock(&tw->spinlock);
 	}
 
+	/* A new thread starts at the least loaded core */
+	if (tcb->state == INIT)
+		tcb->core = sched_least_loaded_core();
+	else if (handoff)
+		tcb->core = cpu_core_id;
+
 	/* Mark as ready */
 	tcb->state = READY;
 
 	/* Possibly add to the scheduler queue */
 	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+		sched_queue_add(tcb, handoff);
 }
 
 /*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
+  Turn the timer wheel of this core, and wake up in one batch the
+  threads whose timeout has expired.
+
+  A thread whose lock is busy is left in the wheel, to be woken up by
+  a later call (or by whoever is holding its lock).
+*/
+static void sched_wakeup_expired_timeouts(CCB* ccb)
+{
+	timer_wheel* tw = &ccb->timeouts;
+	rlnode expired;
+	rlnode_init(&expired, NULL);
+
+	Mutex_Lock(&tw->spinlock);
+	timer_wheel_advance(tw, &expired);
+	Mutex_Unlock(&tw->spinlock);
+
+	/* The expired threads are locked by timer_wheel_advance() */
+	while (!is_rlist_empty(&expired)) {
+		TCB* tcb = rlist_pop_front(&expired)->tcb;
+		sched_make_ready(tcb, 0);
+		Mutex_Unlock(&tcb->state_spinlock);
+	}
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Take a thread from the run queue of another core, or return NULL.
 */
-static void sched_wakeup_expired_timeouts()
+static TCB* sched_steal(CCB* ccb)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	CCB* victim = sched_busiest_core(ccb);
+	if (victim == NULL)
+		return NULL;
+
+	Mutex_Lock(&victim->sched_spinlock);
+	TCB* tcb = sched_queue_pop(victim);
+	Mutex_Unlock(&victim->sched_spinlock);
+
+	return tcb;
+}
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
+/*
+  Even out the run queue of this core with the busiest core,
+  by moving half the difference here.
+*/
+static void sched_balance(CCB* ccb)
+{
+	CCB* busiest = sched_busiest_core(ccb);
+	if (busiest == NULL)
+		return;
+
+	/* 
+	   Threads are moved holding both locks (in core order), so that a
+	   queued thread is always found at the queue of its tcb->core.
+	 */
+	CCB* first = (busiest->id < ccb->id) ? busiest : ccb;
+	CCB* second = (busiest->id < ccb->id) ? ccb : busiest;
+
+	int excess = ((int)busiest->ready_count - (int)ccb->ready_count) / 2;
+	while (excess-- > 0) {
+		Mutex_Lock(&first->sched_spinlock);
+		Mutex_Lock(&second->sched_spinlock);
+		TCB* tcb = sched_queue_pop(busiest);
+		if (tcb != NULL)
+			sched_queue_push(ccb, tcb);
+		Mutex_Unlock(&second->sched_spinlock);
+		Mutex_Unlock(&first->sched_spinlock);
+
+		if (tcb == NULL)
 			break;
-		sched_make_ready(tcb);
 	}
 }
 
 /*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
+  Boost every thread queued at this core by one priority level, in
+  order to prevent starvation.
+*/
+static void sched_boost(CCB* ccb)
+{
+	Mutex_Lock(&ccb->sched_spinlock);
+
+	/* The level below the top merges into the top... */
+	rlist_append(&ccb->ready_queue[TOP_PRIORITY], sched_level_queue(ccb, TOP_PRIORITY - 1));
+
+	/* ...and its (now empty) queue becomes the new level 0 */
+	ccb->boost_offset = (ccb->boost_offset + TOP_PRIORITY - 1) % TOP_PRIORITY;
+	ccb->ready_bitmap = ((ccb->ready_bitmap << 1) | (ccb->ready_bitmap & (1u << TOP_PRIORITY))) & READY_BITMAP_MASK;
+	ccb->boost_epoch++;
+
+	Mutex_Unlock(&ccb->sched_spinlock);
+}
+
+void set_inherited_priority(TCB* tcb, int priority)
+{
+	int preempt = preempt_off;
+	Mutex_Lock(&tcb->state_spinlock);
+
+	if (tcb->state == READY && tcb->phase == CTX_CLEAN) {
+		/* Lock the run queue of the thread's core; the core may change meanwhile */
+		CCB* ccb;
+		for (;;) {
+			ccb = &cctx[tcb->core];
+			Mutex_Lock(&ccb->sched_spinlock);
+			if (ccb == &cctx[tcb->core])
+				break;
+			Mutex_Unlock(&ccb->sched_spinlock);
+		}
+
+		/* Requeue, unless it was just taken out of the queue to run */
+		if (tcb->sched_node.next != &tcb->sched_node) {
+			sched_queue_remove(ccb, tcb);
+			tcb->inherited_priority = priority;
+			sched_queue_push(ccb, tcb);
+		} else
+			tcb->inherited_priority = priority;
+
+		Mutex_Unlock(&ccb->sched_spinlock);
+	} else
+		tcb->inherited_priority = priority;
+
+	Mutex_Unlock(&tcb->state_spinlock);
+	if (preempt)
+		preempt_on;
+}
 
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
+/*
+  Select the next thread to run on this core: the head of the local
+  run queue, else a thread stolen from the busiest core, else the
+  current thread if still READY, else the idle thread.
 */
 static TCB* sched_queue_select(TCB* current)
 {
-	/* Get the head of the SCHED list */
-	//rlnode* sel = rlist_pop_front(&SCHED);
+	CCB* ccb = &CURCORE;
 
-	int priority_selection=0;
-	rlnode* sel;
+	Mutex_Lock(&ccb->sched_spinlock);
+	TCB* next_thread = NULL;
 
-	TCB* next_thread;
-	// Search for the the first available Thread to be scheduled.
-	// Search takes place from the highest priority queue to the lowest.
+	/* If the current thread blocks, switch to the thread it handed the core to */
+	if (ccb->handoff != NULL) {
+		if (current->state != READY) {
+			next_thread = ccb->handoff;
+			sched_queue_remove(ccb, next_thread);
+		}
+		ccb->handoff = NULL;
+	}
 
-	 do{
-        sel = rlist_pop_front(&SCHED[priority_selection++]);
-        next_thread = sel->tcb;
-    }while((next_thread == NULL) && priority_selection < PRIORITY_QUEUES);
+	if (next_thread == NULL)
+		next_thread = sched_queue_pop(ccb);
+	Mutex_Unlock(&ccb->sched_spinlock);
+
+	if (next_thread == NULL)
+		next_thread = sched_steal(ccb);
 
-	 /* When the list is empty, this is NULL */
+	/* When the queues are empty, this is NULL */
 
 	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+		next_thread = (current->state == READY) ? current : &ccb->idle_thread;
 
 	next_thread->its = QUANTUM;
 
@@ -357,7 +812,7 @@ static TCB* sched_queue_select(TCB* current)
 /*
   Make the process ready.
  */
-int wakeup(TCB* tcb)
+static int sched_wakeup(TCB* tcb, int handoff)
 {
 	int ret = 0;
 
@@ -365,14 +820,14 @@ int wakeup(TCB* tcb)
 	int oldpre = preempt_off;
 
 	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
+		sched_make_ready(tcb, handoff);
 		ret = 1;
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	Mutex_Unlock(&tcb->state_spinlock);
 
 	/* Restore preemption state */
 	if (oldpre)
@@ -381,6 +836,16 @@ int wakeup(TCB* tcb)
 	return ret;
 }
 
+int wakeup(TCB* tcb)
+{
+	return sched_wakeup(tcb, 0);
+}
+
+int wakeup_handoff(TCB* tcb)
+{
+	return sched_wakeup(tcb, 1);
+}
+
 /*
   Atomically put the current process to sleep, after unlocking mx.
  */
@@ -392,7 +857,7 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 	int preempt = preempt_off;
 	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	Mutex_Lock(&tcb->state_spinlock);
 
 	/* mark the thread as stopped or exited */
 	tcb->state = state;
@@ -401,13 +866,12 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 	if (state != EXITED)
 		sched_register_timeout(tcb, timeout);
 
-	/* Release mx */
+	Mutex_Unlock(&tcb->state_spinlock);
+
+	/* Release mx. From now on, a wakeup() will find the thread STOPPED. */
 	if (mx != NULL)
 		Mutex_Unlock(mx);
 
-	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
-
 	/* call this to schedule someone else */
 	yield(cause);
 
@@ -418,9 +882,6 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 /* This function is the entry point to the scheduler's context switching */
 
-int yield_calls=0;
-
-
 void yield(enum SCHED_CAUSE cause)
 {
 	/* Reset the timer, so that we are not interrupted by ALARM */
@@ -429,32 +890,10 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	yield_calls++;
-
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
-
-
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread; /* Make a local copy of current process, for speed */
 
-
-
-	Mutex_Lock(&sched_spinlock);
-
-
-		// BOOSTING FEATURE in order to prevent starvation.
-
-	rlnode* pop_n;
-
-	if(yield_calls== MAX_YIELD_CALLS){
-		for(int i = PRIORITY_QUEUES -2;i>=0;i--){
-			while(!is_rlist_empty(&SCHED[i])){
-				pop_n = rlist_pop_front(&SCHED[i]);
-				pop_n->tcb->priority++;
-				rlist_push_back(&SCHED[i+1],pop_n);
-			}
-		}
-		yield_calls=0;
-	}
-	
+	Mutex_Lock(&current->state_spinlock);
 
 	/* Update CURTHREAD state */
 	if (current->state == RUNNING)
@@ -489,31 +928,34 @@ void yield(enum SCHED_CAUSE cause)
 		default:
 			break;
 	}
-	
 
+	Mutex_Unlock(&current->state_spinlock);
 
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
+	sched_wakeup_expired_timeouts(ccb);
 
+	// BOOSTING FEATURE in order to prevent starvation.
+	if (++ccb->yield_calls >= MAX_YIELD_CALLS) {
+		sched_boost(ccb);
+		ccb->yield_calls = 0;
+	}
 
-	
+	/* Pull work from overloaded cores */
+	if (++ccb->balance_calls >= BALANCE_YIELD_CALLS) {
+		sched_balance(ccb);
+		ccb->balance_calls = 0;
+	}
 
 	/* Get next */
 	TCB* next = sched_queue_select(current);
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
-
-	Mutex_Unlock(&sched_spinlock);
-
-
-
-
+	ccb->previous_thread = current;
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		ccb->current_thread = next;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
@@ -537,35 +979,44 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread;
 
-	TCB* current = CURTHREAD;
+	Mutex_Lock(&current->state_spinlock);
 
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	current->core = ccb->id;
+
+	Mutex_Unlock(&current->state_spinlock);
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = ccb->previous_thread;
 	if (current != prev) {
+		int exited = 0;
+
+		Mutex_Lock(&prev->state_spinlock);
 		prev->phase = CTX_CLEAN;
 		switch (prev->state) {
 		case READY:
 			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+				sched_queue_add(prev, 0);
 			break;
 		case EXITED:
-			release_TCB(prev);
+			exited = 1;
 			break;
 		case STOPPED:
 			break;
 		default:
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
-	}
+		Mutex_Unlock(&prev->state_spinlock);
 
-	Mutex_Unlock(&sched_spinlock);
+		if (exited)
+			release_TCB(prev);
+	}
 
 	/* Reset preemption as needed */
 	if (preempt)
@@ -592,17 +1043,35 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues
  */
 void initialize_scheduler()
 {
-	int i;
-	//rlnode_init(&SCHED, NULL);
-	rlnode_init(&TIMEOUT_LIST, NULL);
-
-	for(i=0; i<PRIORITY_QUEUES; i++)
-	{
-		rlnode_init(&SCHED[i], NULL);
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		ccb->id = c;
+		ccb->sched_spinlock = MUTEX_INIT;
+		for (int i = 0; i < PRIORITY_QUEUES; i++)
+			rlnode_init(&ccb->ready_queue[i], NULL);
+		ccb->ready_count = 0;
+		ccb->ready_bitmap = 0;
+		ccb->handoff = NULL;
+		ccb->boost_offset = 0;
+		ccb->boost_epoch = 0;
+		ccb->yield_calls = 0;
+		ccb->balance_calls = 0;
+
+		timer_wheel* tw = &ccb->timeouts;
+		tw->spinlock = MUTEX_INIT;
+		for (int l = 0; l < TIMER_WHEEL_LEVELS; l++)
+			for (int i = 0; i < TIMER_WHEEL_SIZE; i++)
+				rlnode_init(&tw->slot[l][i], NULL);
+		tw->tick = bios_clock() / TIMER_TICK;
+		tw->pending = 0;
+
+		thread_cache* tc = &ccb->tcache;
+		*tc = (thread_cache) { .spinlock = MUTEX_INIT };
+		rlnode_init(&tc->blocks, NULL);
 	}
 }
 
@@ -617,6 +1086,7 @@ void run_scheduler()
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
+	curcore->idle_thread.inherited_priority = -1;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
@@ -628,6 +1098,9 @@ void run_scheduler()
 	curcore->idle_thread.curr_cause = SCHED_IDLE;
 	curcore->idle_thread.last_cause = SCHED_IDLE;
 
+	curcore->idle_thread.state_spinlock = MUTEX_INIT;
+	curcore->idle_thread.core = cpu_core_id;
+
 	/* Initialize interrupt handler */
 	cpu_interrupt_handler(ALARM, yield_handler);
 	cpu_interrupt_handler(ICI, ici_handler);
@@ -640,4 +1113,7 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* Return the cached thread blocks to the allocator */
+	thread_cache_drain(&curcore->tcache);
 }
@@ -104,6 +104,8 @@ typedef struct thread_control_block {
 
 
   int priority;
+	int inherited_priority; /**< @brief Priority inherited from threads blocked on mutexes held by this thread, or -1 */
+	int pi_mutexes; /**< @brief Number of contended mutexes held by this thread (see kernel_cc.c) */
 
 	cpu_context_t context; /**< @brief The thread context */
 	Thread_type type; /**< @brief The type of thread */
@@ -121,6 +123,13 @@ typedef struct thread_control_block {
 	enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
 	enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
 
+	uint boost_epoch; /**< @brief The boost epoch of the core when this thread was queued */
+
+	Mutex state_spinlock; /**< @brief Protects @c state, @c phase and @c wakeup_time */
+	uint core; /**< @brief The core whose run queue (or timer wheel) this thread is associated with */
+
+	size_t stack_size; /**< @brief The size of the thread stack, in bytes */
+
 #ifndef NVALGRIND
 	unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
 
@@ -136,9 +145,8 @@ typedef struct thread_control_block {
 
 
 #define PRIORITY_QUEUES 10 // Number of Queues that we are going to have.
-#define MAX_YIELD_CALLS 1000 // Boosting threshpoint. Every MAX_YIELD_CALLS yield calls, priority of every Thread will be boosted by 1.
-
-rlnode SCHED[PRIORITY_QUEUES];
+#define MAX_YIELD_CALLS 1000 // Boosting threshpoint. Every MAX_YIELD_CALLS yield calls on a core, priority of every Thread queued there will be boosted by 1.
+#define BALANCE_YIELD_CALLS 64 // Every BALANCE_YIELD_CALLS yield calls on a core, it pulls work from the busiest core.
 
 /** @brief Thread stack size.
 
@@ -146,12 +154,63 @@ rlnode SCHED[PRIORITY_QUEUES];
  */
 #define THREAD_STACK_SIZE (128 * 1024)
 
+/** @brief The smallest thread stack size that can be requested. */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief The largest thread stack size that can be requested. */
+#define THREAD_STACK_MAX (8 * 1024 * 1024)
+
 /************************
  *
  *      Scheduler
  *
  ************************/
 
+/** @brief Timer wheel resolution, in microseconds */
+#define TIMER_TICK 1000
+
+#define TIMER_WHEEL_BITS 6 /**< @brief log2 of the slots per wheel level */
+#define TIMER_WHEEL_SIZE (1 << TIMER_WHEEL_BITS) /**< @brief Slots per wheel level */
+#define TIMER_WHEEL_LEVELS 4 /**< @brief Levels of the timer wheel */
+
+/** @brief A hierarchical timer wheel.
+
+  Sleeping threads with a timeout are kept in a timer wheel of the core
+  they went to sleep on. Level @c l holds the threads due in less than
+  @c TIMER_WHEEL_SIZE^(l+1) ticks, hashed on their expiration tick. As
+  the wheel turns, the slots of the higher levels are cascaded down.
+  Insertion and removal take constant time.
+ */
+typedef struct timer_wheel {
+	Mutex spinlock; /**< @brief Protects the wheel */
+	rlnode slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SIZE]; /**< @brief The wheel slots */
+	TimerDuration tick; /**< @brief The last tick processed */
+	uint pending; /**< @brief Number of threads in the wheel */
+} timer_wheel;
+
+/** @brief Default number of free thread blocks kept by each core.
+
+  A thread block holds the TCB and the stack of a thread. See
+  @c set_thread_cache_limit().
+ */
+#define THREAD_CACHE_LIMIT 16
+
+/** @brief A per-core cache of free thread blocks.
+
+  Released thread blocks are kept here (linked through their
+  @c sched_node), up to a high-water mark, and reused by
+  @c spawn_thread(), instead of going back to the allocator.
+ */
+typedef struct thread_cache {
+	Mutex spinlock; /**< @brief Protects the cache */
+	rlnode blocks; /**< @brief The free thread blocks */
+	uint count; /**< @brief Number of blocks in @c blocks */
+	unsigned long hits; /**< @brief Threads spawned from a cached block */
+	unsigned long misses; /**< @brief Threads spawned from a new block */
+	unsigned long recycled; /**< @brief Released blocks kept in the cache */
+	unsigned long freed; /**< @brief Released blocks freed because the cache was full */
+} thread_cache;
+
 /** @brief Core control block.
 
   Per-core info in memory (basically scheduler-related). 
@@ -163,6 +222,21 @@ typedef struct core_control_block {
 	TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
 	TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
 
+	Mutex sched_spinlock; /**< @brief Protects the run queue of this core */
+	rlnode ready_queue[PRIORITY_QUEUES]; /**< @brief The multilevel run queue of this core */
+	volatile uint ready_count; /**< @brief Number of threads in @c ready_queue */
+	uint ready_bitmap; /**< @brief Bit @c p is set iff priority level @c p is non-empty */
+	uint boost_offset; /**< @brief Rotation of the lower levels in @c ready_queue */
+	uint boost_epoch; /**< @brief Number of boosts performed on this core */
+	TCB* handoff; /**< @brief A thread in @c ready_queue to switch to, if the current thread blocks */
+
+	timer_wheel timeouts; /**< @brief Threads sleeping with a timeout on this core */
+
+	thread_cache tcache; /**< @brief Free thread blocks of this core */
+
+	uint yield_calls; /**< @brief Yield calls since the last boost */
+	uint balance_calls; /**< @brief Yield calls since the last load balancing */
+
 } CCB;
 
 /** @brief the array of Core Control Blocks (CCB) for the kernel */
@@ -210,9 +284,43 @@ PTCB* spawn_process_thread(TCB* tcb, Task call, int argl, void* args);
                 otherwise ignores it
 
     @param func The function to execute in the new thread.
+    @param stack_size The size of the thread stack, or 0 for @c THREAD_STACK_SIZE.
+                It is clamped to [ @c THREAD_STACK_MIN , @c THREAD_STACK_MAX ] and
+                rounded up to a multiple of the page size.
     @returns  A pointer to the TCB of the new thread, in the @c INIT state.
 */
-TCB* spawn_thread(PCB* pcb, void (*func)());
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/** @brief Statistics of the thread block caches, summed over all cores. */
+typedef struct thread_cache_stats {
+	unsigned long hits; /**< @brief Threads spawned from a cached block */
+	unsigned long misses; /**< @brief Threads spawned from a new block */
+	unsigned long recycled; /**< @brief Released blocks kept in a cache */
+	unsigned long freed; /**< @brief Released blocks freed because the cache was full */
+	unsigned long cached; /**< @brief Blocks currently in the caches */
+} thread_cache_stats;
+
+/**
+  @brief Set the high-water mark of the per-core thread block caches.
+
+  Each core keeps up to @c limit released thread blocks for reuse by
+  @c spawn_thread(). A limit of 0 disables caching. Caches over the new
+  limit shrink as threads are released. The default is @c THREAD_CACHE_LIMIT.
+
+  @param limit the new number of blocks each core may keep
+  @returns the previous limit
+ */
+uint set_thread_cache_limit(uint limit);
+
+/**
+  @brief Get the statistics of the thread block caches.
+
+  The counters are read without locking, so they are only approximate
+  while threads are being created.
+
+  @param stats the structure to fill in
+ */
+void get_thread_cache_stats(thread_cache_stats* stats);
 
 /**
   @brief Wakeup a blocked thread.
@@ -226,6 +334,20 @@ TCB* spawn_thread(PCB* pcb, void (*func)());
 */
 int wakeup(TCB* tcb);
 
+/**
+  @brief Wakeup a blocked thread, handing it the current core.
+
+  This is like @c wakeup(), but a @c STOPPED thread is queued at the current
+  core. If the current thread then blocks, before it is preempted, the
+  core switches directly to the woken thread, regardless of priorities.
+  This is meant for producer/consumer pairs, where the waker is about to
+  block waiting for the woken thread.
+
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+*/
+int wakeup_handoff(TCB* tcb);
+
 /** 
   @brief Block the current thread.
 
@@ -258,6 +380,28 @@ int wakeup(TCB* tcb);
    */
 void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
 
+/**
+  @brief Set the priority a thread inherits from the threads it blocks.
+
+  The thread is scheduled at the higher of its own priority and the
+  inherited one. If it is in a run queue, it is moved to the queue of its
+  new priority.
+
+  @param tcb the thread
+  @param priority the inherited priority, or -1 to drop the inherited priority
+ */
+void set_inherited_priority(TCB* tcb, int priority);
+
+/**
+  @brief The priority at which a thread is scheduled.
+
+  This is the higher of its own and its inherited priority.
+ */
+static inline int thread_priority(TCB* tcb)
+{
+	return (tcb->priority > tcb->inherited_priority) ? tcb->priority : tcb->inherited_priority;
+}
+
 /**
   @brief Give up the CPU.
 
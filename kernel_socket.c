@@ -10,8 +10,168 @@
 
 
 
-/* The port map table */
-SCB* PORT_MAP[MAX_PORT+1];
+/* 
+	The port map table. A port has either a single listener, or any number
+	of shared listeners (see ListenShared), among which connection requests
+	are spread. Each port has its own lock, so that ports do not contend.
+ */
+typedef struct port_entry {
+	Mutex lock;			/* Protects the listeners of the port (their request queue
+						   and reference count) and the connection requests to it */
+	rlnode listeners;	/* The listener sockets of the port */
+	int shared;			/* The listeners were made by ListenShared */
+} port_entry;
+
+static port_entry PORT_MAP[MAX_PORT+1];
+
+void initialize_sockets()
+{
+	for(int p=0; p<=MAX_PORT; p++) {
+		PORT_MAP[p].lock = MUTEX_INIT;
+		rlnode_init(&PORT_MAP[p].listeners, NULL);
+		PORT_MAP[p].shared = 0;
+	}
+}
+
+file_ops socket_file_ops;
+
+/* Return the socket of an FCB, or NULL if it is not a socket */
+static inline SCB* fcb_socket(FCB* fcb)
+{
+	return (fcb->streamfunc == &socket_file_ops) ? fcb->streamobj : NULL;
+}
+
+/* 
+	The request ring of a listener. The caller holds the lock of the port.
+ */
+
+/* Queue a request at the back of the ring; return 0 if the ring is full */
+static int listener_push(SCB* lscb, con_req* req)
+{
+	listener_socket* ls = &lscb->listener_s;
+	if(ls->count == ls->backlog)
+		return 0;
+	ls->queue[(ls->head + ls->count) % ls->backlog] = req;
+	ls->count++;
+	req->listener = lscb;
+	return 1;
+}
+
+/* Take the oldest request off a non-empty ring */
+static con_req* listener_pop(listener_socket* ls)
+{
+	con_req* req = ls->queue[ls->head];
+	ls->head = (ls->head + 1) % ls->backlog;
+	ls->count--;
+	req->listener = NULL;
+	return req;
+}
+
+/* Remove a queued request, keeping the order of the rest */
+static void listener_remove(listener_socket* ls, con_req* req)
+{
+	uint i = 0;
+	while(ls->queue[(ls->head + i) % ls->backlog] != req)
+		i++;
+	for(; i+1 < ls->count; i++)
+		ls->queue[(ls->head + i) % ls->backlog] = ls->queue[(ls->head + i + 1) % ls->backlog];
+	ls->count--;
+	req->listener = NULL;
+}
+
+/* 
+	The listener of a port to queue a request to: the one with the fewest
+	pending requests, taking turns among equals. NULL if all are full.
+ */
+static SCB* port_listener(port_entry* pe)
+{
+	SCB* best = NULL;
+	for(rlnode* n = pe->listeners.next; n != &pe->listeners; n = n->next) {
+		listener_socket* ls = &((SCB*)n->obj)->listener_s;
+		if(ls->count < ls->backlog && (best==NULL || ls->count < best->listener_s.count))
+			best = n->obj;
+	}
+
+	if(best) {
+		rlist_remove(&best->listener_s.port_node);
+		rlist_push_back(&pe->listeners, &best->listener_s.port_node);
+	}
+	return best;
+}
+
+/* The type of the sockets a port with listeners connects */
+static inline sock_type port_kind(port_entry* pe)
+{
+	return ((SCB*)pe->listeners.next->obj)->kind;
+}
+
+/* Connect two unbound sockets of the same type to each other */
+static void socket_join(SCB* scb1, SCB* scb2)
+{
+	if(scb1->kind == SOCK_SEQPACKET) {
+		scb1->msg_s.peer = scb2;
+		scb2->msg_s.peer = scb1;
+
+		/* Two message queues, one in each direction */
+		Msg_Q* q1 = msgq_alloc(scb1->fcb, scb2->fcb);
+		Msg_Q* q2 = msgq_alloc(scb2->fcb, scb1->fcb);
+
+		scb1->msg_s.write_q = q2;
+		scb1->msg_s.read_q = q1;
+		scb2->msg_s.write_q = q1;
+		scb2->msg_s.read_q = q2;
+
+		scb1->type = SOCKET_MSG_PEER;
+		scb2->type = SOCKET_MSG_PEER;
+		return;
+	}
+
+	if(scb1->kind == SOCK_RING) {
+		scb1->ring_s.peer = scb2;
+		scb2->ring_s.peer = scb1;
+
+		/* One pair of rings, shared by the two sides */
+		Ring_Pair* rp = ring_alloc(scb1->fcb, scb2->fcb);
+		scb1->ring_s.rings = rp;
+		scb1->ring_s.side = 0;
+		scb2->ring_s.rings = rp;
+		scb2->ring_s.side = 1;
+
+		scb1->type = SOCKET_RING_PEER;
+		scb2->type = SOCKET_RING_PEER;
+		return;
+	}
+
+	/* Connect the peer sockets to each other. */
+	scb1->peer_s.peer = scb2;
+	scb2->peer_s.peer = scb1;
+
+	/* Peer sockets need a set of 2 pipes to be connected.*/
+	/* Create 2 Pipe control blocks and connect them appropriately on the two peer sockets.*/
+	Pipe_CB* pipe1 = pipe_alloc(scb1->fcb, scb2->fcb);
+	Pipe_CB* pipe2 = pipe_alloc(scb2->fcb, scb1->fcb);
+
+	scb1->peer_s.write_pipe = pipe2;
+	scb1->peer_s.read_pipe = pipe1;
+	scb2->peer_s.write_pipe = pipe1;
+	scb2->peer_s.read_pipe = pipe2;
+
+	scb1->type = SOCKET_PEER;
+	scb2->type = SOCKET_PEER;
+}
+
+/* Queue a request to a listener of a port, and wake it up; return 0 if all are full */
+static int port_queue_request(port_entry* pe, con_req* req)
+{
+	SCB* lscb = port_listener(pe);
+	if(lscb==NULL || ! listener_push(lscb, req))
+		return 0;
+
+	/* Signal that there is a request in order to retrace @accept and assemble the connection. */
+	kernel_signal(&lscb->listener_s.req_available);
+	poll_wakeup(&lscb->fcb->pollq);
+	return 1;
+}
 
 /* Associated with the Write end of the argument socket.*/
 int socket_write(void* socket_cb, const char* buffer, uint n)
@@ -24,9 +184,17 @@ int socket_write(void* socket_cb, const char* buffer, uint n)
 		return -1;
 	if(buffer==NULL)
 		return -1;
-	if(scb->fcb==NULL)
+	if(scb->fcb!=NULL && scb->type == SOCKET_MSG_PEER) {
+		iovec_t iov = { (void*) buffer, n };
+		return msgq_writev(scb->msg_s.write_q, &iov, 1);
+	}
+	if(scb->fcb!=NULL && scb->type == SOCKET_RING_PEER) {
+		iovec_t iov = { (void*) buffer, n };
+		return ring_writev(scb->ring_s.rings, scb->ring_s.side, &iov, 1);
+	}
+	if(scb->fcb==NULL || scb->type != SOCKET_PEER)
 		return -1;
-	if(scb->peer_s.write_pipe==NULL || scb->peer_s.peer->peer_s.read_pipe==NULL)
+	if(scb->peer_s.write_pipe==NULL)
 		return -1;
 
 	int r;
@@ -38,6 +206,59 @@ int socket_write(void* socket_cb, const char* buffer, uint n)
 	return r;
 }
 
+/* Vectored write, in one pipe operation (or as one message) */
+int socket_writev(void* socket_cb, const iovec_t* iov, uint iovcnt)
+{
+	SCB* scb = (SCB*)socket_cb;
+
+	if(scb==NULL)
+		return -1;
+	if(scb->fcb!=NULL && scb->type == SOCKET_MSG_PEER)
+		return msgq_writev(scb->msg_s.write_q, iov, iovcnt);
+	if(scb->fcb!=NULL && scb->type == SOCKET_RING_PEER)
+		return ring_writev(scb->ring_s.rings, scb->ring_s.side, iov, iovcnt);
+	if(scb->fcb==NULL || scb->type != SOCKET_PEER)
+		return -1;
+	if(scb->peer_s.write_pipe==NULL)
+		return -1;
+
+	return pipe_writev(scb->peer_s.write_pipe, iov, iovcnt);
+}
+
+Pipe_CB* socket_read_pipe(FCB* fcb)
+{
+	SCB* scb = fcb_socket(fcb);
+
+	if(scb==NULL || scb->type != SOCKET_PEER)
+		return NULL;
+	return scb->peer_s.read_pipe;
+}
+
+Pipe_CB* socket_write_pipe(FCB* fcb)
+{
+	SCB* scb = fcb_socket(fcb);
+
+	if(scb==NULL || scb->type != SOCKET_PEER)
+		return NULL;
+	return scb->peer_s.write_pipe;
+}
+
+/* A message is written whole, into a free slot, or not at all */
+uint socket_write_room(FCB* fcb)
+{
+	SCB* scb = fcb_socket(fcb);
+
+	if(scb==NULL || scb->fcb==NULL)
+		return (uint)-1;
+	if(scb->type == SOCKET_MSG_PEER)
+		return MAX_MESSAGE;
+	if(scb->type == SOCKET_RING_PEER)
+		return ring_room(scb->ring_s.rings, scb->ring_s.side);
+	if(scb->type == SOCKET_PEER && scb->peer_s.write_pipe!=NULL)
+		return pipe_write_room(scb->peer_s.write_pipe);
+	return (uint)-1;
+}
+
 /* Associated with the Read end of the argument socket.*/
 int socket_read(void* socket_cb, char* buffer, uint n)
 {
@@ -49,7 +270,15 @@ int socket_read(void* socket_cb, char* buffer, uint n)
 		return -1;
 	if(buffer==NULL)
 		return -1;
-	if(scb->fcb==NULL)
+	if(scb->fcb!=NULL && scb->type == SOCKET_MSG_PEER) {
+		iovec_t iov = { buffer, n };
+		return msgq_readv(scb->msg_s.read_q, &iov, 1);
+	}
+	if(scb->fcb!=NULL && scb->type == SOCKET_RING_PEER) {
+		iovec_t iov = { buffer, n };
+		return ring_readv(scb->ring_s.rings, scb->ring_s.side, &iov, 1);
+	}
+	if(scb->fcb==NULL || scb->type != SOCKET_PEER)
 		return -1;
 	if(scb->peer_s.read_pipe==NULL)
 		return -1;
@@ -63,6 +292,76 @@ int socket_read(void* socket_cb, char* buffer, uint n)
 	return r;
 }
 
+/* Vectored read, in one pipe operation (or of one message) */
+int socket_readv(void* socket_cb, const iovec_t* iov, uint iovcnt)
+{
+	SCB* scb = (SCB*)socket_cb;
+
+	if(scb==NULL)
+		return -1;
+	if(scb->fcb!=NULL && scb->type == SOCKET_MSG_PEER)
+		return msgq_readv(scb->msg_s.read_q, iov, iovcnt);
+	if(scb->fcb!=NULL && scb->type == SOCKET_RING_PEER)
+		return ring_readv(scb->ring_s.rings, scb->ring_s.side, iov, iovcnt);
+	if(scb->fcb==NULL || scb->type != SOCKET_PEER)
+		return -1;
+	if(scb->peer_s.read_pipe==NULL)
+		return -1;
+
+	return pipe_readv(scb->peer_s.read_pipe, iov, iovcnt);
+}
+
+/* 
+	A listener is readable when a connection request is queued; a peer
+	combines the read end of one pipe with the write end of the other.
+ */
+int socket_poll(void* socket_cb, poll_table* pt)
+{
+	SCB* scb = (SCB*)socket_cb;
+	int mask = 0;
+
+	if(scb==NULL || scb->fcb==NULL)
+		return POLL_ERROR | POLL_HANGUP;
+
+	switch(scb->type) {
+		case SOCKET_LISTENER:
+			Mutex_Lock(&PORT_MAP[scb->port].lock);
+			if(scb->listener_s.count > 0)
+				mask |= POLL_READ;
+			poll_wait(pt, &scb->fcb->pollq);
+			Mutex_Unlock(&PORT_MAP[scb->port].lock);
+			break;
+		case SOCKET_PEER:
+			if(scb->peer_s.read_pipe)
+				mask |= pipe_reader_poll(scb->peer_s.read_pipe, pt) & (POLL_READ | POLL_HANGUP);
+			else
+				mask |= POLL_HANGUP;
+			if(scb->peer_s.write_pipe)
+				mask |= pipe_writer_poll(scb->peer_s.write_pipe, pt) & (POLL_WRITE | POLL_ERROR);
+			else
+				mask |= POLL_ERROR;
+			break;
+		case SOCKET_MSG_PEER:
+			if(scb->msg_s.read_q)
+				mask |= msgq_reader_poll(scb->msg_s.read_q, pt) & (POLL_READ | POLL_HANGUP);
+			else
+				mask |= POLL_HANGUP;
+			if(scb->msg_s.write_q)
+				mask |= msgq_writer_poll(scb->msg_s.write_q, pt) & (POLL_WRITE | POLL_ERROR);
+			else
+				mask |= POLL_ERROR;
+			break;
+		case SOCKET_RING_PEER:
+			mask = ring_poll(scb->ring_s.rings, scb->ring_s.side, pt);
+			break;
+		default:
+			/* Not connected */
+			mask = POLL_HANGUP;
+	}
+
+	return mask;
+}
+
 /* Closing a socket holds a particularity depending on the socket type.*/
 int socket_close(void* socket_cb)
 {
@@ -76,27 +375,52 @@ int socket_close(void* socket_cb)
 		pipe_writer_close(scb->peer_s.write_pipe);
 		pipe_reader_close(scb->peer_s.read_pipe);
 	}
+	if(scb->type == SOCKET_MSG_PEER)
+	{
+		msgq_writer_close(scb->msg_s.write_q);
+		msgq_reader_close(scb->msg_s.read_q);
+	}
+	if(scb->type == SOCKET_RING_PEER)
+		ring_detach(scb->ring_s.rings, scb->ring_s.side);
 
 	/* A listener has to clear its queue list and also signal/broadcast when its closed. @dependancies.*/
 	if(scb->type == SOCKET_LISTENER)
 	{
+		port_entry* pe = &PORT_MAP[scb->port];
+		Mutex_Lock(&pe->lock);
 
-
-		while(!is_rlist_empty(&scb->listener_s.queue))
+		/* RESETING PORT MAP.*/
+		rlist_remove(&scb->listener_s.port_node);
+		if(is_rlist_empty(&pe->listeners))
+			pe->shared = 0;
+		scb->listener_s.closed = 1;
+
+		/* 
+			The pending requests move to the other listeners of the port, if 
+			they have room, else they fail; each belongs to its connecting thread. 
+		 */
+		while(scb->listener_s.count > 0)
 		{
-			rlnode* node = rlist_pop_front(&scb->listener_s.queue);
-			free(node->cr);
+			con_req* req = listener_pop(&scb->listener_s);
+			if(! port_queue_request(pe, req))
+				kernel_signal(&req->connected_cv);
 		}
+		free(scb->listener_s.queue);
+		scb->listener_s.queue = NULL;
 
-		/* RESETING PORT MAP.*/
-		PORT_MAP[scb->port]=NULL;
 		kernel_broadcast(&scb->listener_s.req_available);
 
+		/* A thread in Accept will free it */
+		int in_use = scb->refcount>0;
+
+		Mutex_Unlock(&pe->lock);
+
+		if(in_use)
+			return 0;
 	}
 
 	/* In every case when closing a socket if its reference count is zero. It can be freed.*/
-	if(scb->refcount<=0)
-		free(scb);
+	free(scb);
 
 	return 0;
 }
@@ -107,12 +431,69 @@ file_ops socket_file_ops = {
 	.Open = NULL,
 	.Read = socket_read,
 	.Write = socket_write,
+	.ReadV = socket_readv,
+	.WriteV = socket_writev,
+	.Poll = socket_poll,
 	.Close = socket_close
 };
 
 
 
 
+/* Make the control block of a new unbound socket of a type, for an FCB */
+static SCB* socket_alloc(FCB* socket_fcb, port_t port, sock_type kind)
+{
+	/* Create a Socket Control Block*/
+	SCB* scb = (SCB*)xmalloc(sizeof(SCB));
+
+	/* Initialization  of the Socket. */ 
+
+	/*Connect to the FCB.*/
+	scb->fcb = socket_fcb;
+	scb->refcount=0; 
+
+	/* Attach the new socket to the wanted port. If it is 0 then NOPORT.*/
+	if(port == 0)
+		scb->port = NOPORT;
+	else
+		scb->port = port;
+
+	/* A new socket is to be unbound. */
+	scb->type = SOCKET_UNBOUND;
+	scb->kind = kind;
+	rlnode_init(&scb->unbound_s.unbound_socket, NULL); /* propably useless */
+
+	return scb;
+}
+
+/* Make a new unbound socket of a type */
+static Fid_t socket_open(port_t port, sock_type kind, int flags)
+{
+	/*
+	Check port validity.
+	*/
+	if(port < 0 || port > MAX_PORT)
+		return NOFILE;
+
+	if(flags & ~FID_NONBLOCK)
+		return NOFILE;
+
+	Fid_t socket_Fid;
+	FCB* socket_fcb;
+
+	/* Reserve one FCB for a socket.*/
+	if(FCB_reserve(1, &socket_Fid, &socket_fcb)==0)
+		return NOFILE; /* no fid available */
+
+	SCB* scb = socket_alloc(socket_fcb, port, kind);
+
+	/* Make connections between the socket and the matching FCB.*/
+	socket_fcb->flags = flags;
+	FCB_attach(socket_fcb, scb, &socket_file_ops);
+
+	return socket_Fid;
+}
+
 /**
 	@brief Return a new socket bound on a port.
 
@@ -129,48 +510,144 @@ file_ops socket_file_ops = {
 */
 Fid_t sys_Socket(port_t port)
 {
-	
-	/*
-	Check port validity.
-	*/
-	if(port < 0 || port > MAX_PORT)
+	return sys_SocketWithFlags(port, 0);
+}
+
+Fid_t sys_SocketWithFlags(port_t port, int flags)
+{
+	return socket_open(port, SOCK_STREAM, flags);
+}
+
+Fid_t sys_SocketWithType(port_t port, sock_type type)
+{
+	if(type != SOCK_STREAM && type != SOCK_SEQPACKET && type != SOCK_RING)
 		return NOFILE;
+	return socket_open(port, type, 0);
+}
 
-	Fid_t socket_Fid;
-	FCB* socket_fcb;
+/* Two sockets, connected to each other without a listener */
+int sys_SocketPair(sock_type type, Fid_t pair[2])
+{
+	if(type != SOCK_STREAM && type != SOCK_SEQPACKET && type != SOCK_RING)
+		return -1;
+	if(pair==NULL)
+		return -1;
 
-	/* Reserve one FCB for a socket.*/
-	if(FCB_reserve(1, &socket_Fid, &socket_fcb)==0)
-		return NOFILE; /* no fid available */
+	FCB* fcb[2];
+	if(FCB_reserve(2, pair, fcb)==0)
+		return -1;
 
-	/* Create a Socket Control Block*/
-	SCB* scb = (SCB*)xmalloc(sizeof(SCB));
+	SCB* scb1 = socket_alloc(fcb[0], NOPORT, type);
+	SCB* scb2 = socket_alloc(fcb[1], NOPORT, type);
+	socket_join(scb1, scb2);
 
-	/* Make connections between the socket and the matching FCB.*/
-	socket_fcb->streamfunc=&socket_file_ops;
-	socket_fcb->streamobj=scb;
+	FCB_attach(fcb[0], scb1, &socket_file_ops);
+	FCB_attach(fcb[1], scb2, &socket_file_ops);
 
-	
+	return 0;
+}
 
-	/* Initialization  of the Socket. */ 
+/* The connected ring socket of a fid, or NULL; the FCB is referenced on success */
+static SCB* ring_socket(Fid_t sock, FCB** fcbp)
+{
+	FCB* fcb = get_fcb(sock);
+	if(fcb==NULL)
+		return NULL;
+
+	SCB* scb = fcb_socket(fcb);
+	if(scb==NULL || scb->fcb==NULL || scb->type != SOCKET_RING_PEER) {
+		FCB_decref(fcb);
+		return NULL;
+	}
 
-	/*Connect to the FCB.*/
-	scb->fcb = socket_fcb;
-	scb->refcount=0; 
+	*fcbp = fcb;
+	return scb;
+}
 
-	/* Attach the new socket to the wanted port. If it is 0 then NOPORT.*/
-	if(port == 0)
-		scb->port = NOPORT;
-	else
-		scb->port = port;
+/* 
+	The rings live in kernel memory; since all processes share the address
+	space, the program addresses them directly.
+ */
+int sys_SocketRing(Fid_t sock, socket_ring** send, socket_ring** recv)
+{
+	if(send==NULL || recv==NULL)
+		return -1;
 
-	/* A new socket is to be unbound. */
-	scb->type = SOCKET_UNBOUND;
-	rlnode_init(&scb->unbound_s.unbound_socket, NULL); /* propably useless */
+	FCB* fcb;
+	SCB* scb = ring_socket(sock, &fcb);
+	if(scb==NULL)
+		return -1;
 
+	Ring_Pair* rp = scb->ring_s.rings;
+	*send = &rp->ring[scb->ring_s.side];
+	*recv = &rp->ring[1 - scb->ring_s.side];
 
+	FCB_decref(fcb);
+	return 0;
+}
 
-	return socket_Fid;
+int sys_RingWake(Fid_t sock)
+{
+	FCB* fcb;
+	SCB* scb = ring_socket(sock, &fcb);
+	if(scb==NULL)
+		return -1;
+
+	ring_wake(scb->ring_s.rings, scb->ring_s.side);
+
+	FCB_decref(fcb);
+	return 0;
+}
+
+/* Make a socket a listener, which may share its port with other shared listeners */
+static int socket_listen(Fid_t sock, unsigned int backlog, int shared)
+{
+	if(backlog < 1 || backlog > MAX_BACKLOG)
+		return -1;
+
+	/* Make necessary checks. */
+	/* fid valid*/
+	FCB* curFCB = get_fcb(sock);
+	/* FCB valid*/
+	if(curFCB==NULL)
+		return -1;
+
+	int retcode = -1;
+	SCB* scb = fcb_socket(curFCB);
+
+	if(scb==NULL || scb->port==NOPORT) {
+		FCB_decref(curFCB);
+		return -1;
+	}
+
+	port_entry* pe = &PORT_MAP[scb->port];
+	Mutex_Lock(&pe->lock);
+
+	if(! is_rlist_empty(&pe->listeners) && !(shared && pe->shared && port_kind(pe)==scb->kind))
+		goto finish;
+	if(scb->type != SOCKET_UNBOUND)
+		goto finish;
+
+	/* Make the socket a Listener*/
+	scb->type=SOCKET_LISTENER;
+	/* Initialize it. */
+	scb->listener_s.queue = xmalloc(backlog*sizeof(con_req*));
+	scb->listener_s.backlog = backlog;
+	scb->listener_s.head = 0;
+	scb->listener_s.count = 0;
+	scb->listener_s.req_available=COND_INIT;
+	scb->listener_s.closed = 0;
+	rlnode_init(&scb->listener_s.port_node, scb);
+
+	/* Hold the PortMap port.*/
+	rlist_push_back(&pe->listeners, &scb->listener_s.port_node);
+	pe->shared = shared;
+	retcode = 0;
+
+finish:
+	Mutex_Unlock(&pe->lock);
+	FCB_decref(curFCB);
+	return retcode;
 }
 
 /**
@@ -183,7 +660,8 @@ Fid_t sys_Socket(port_t port)
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless the listeners of the port
+	are made by @c ListenShared().
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
@@ -195,36 +673,17 @@ Fid_t sys_Socket(port_t port)
  */
 int sys_Listen(Fid_t sock)
 {
-	/* Make necessary checks. */
-	/* fid valid*/
-	if(sock<0 || sock>MAX_FILEID)
-		return -1;
-	PCB* curp = CURPROC;
-	assert(curp!=NULL);
-	FCB* curFCB = curp->FIDT[sock];
-	/* FCB valid*/
-	if(curFCB==NULL)
-		return -1;
-	SCB* scb = curFCB->streamobj;
-	if(scb==NULL)
-		return -1;
-	if(scb->port==NOPORT)
-		return -1;
-	if(PORT_MAP[scb->port]!= NULL)
-		return -1;
-	if(scb->type==SOCKET_LISTENER || scb->type==SOCKET_PEER)
-		return -1;
-
-	/* Make the socket a Listener*/
-	scb->type=SOCKET_LISTENER;
-	/* Initialize it. */
-	rlnode_init(&scb->listener_s.queue, NULL); 
-	scb->listener_s.req_available=COND_INIT;
+	return sys_ListenWithBacklog(sock, DEFAULT_BACKLOG);
+}
 
-	/* Hold the PortMap port.*/
-	PORT_MAP[scb->port] = scb;
+int sys_ListenWithBacklog(Fid_t sock, unsigned int backlog)
+{
+	return socket_listen(sock, backlog, 0);
+}
 
-	return 0;
+int sys_ListenShared(Fid_t sock, unsigned int backlog)
+{
+	return socket_listen(sock, backlog, 1);
 }
 
 
@@ -255,52 +714,65 @@ Fid_t sys_Accept(Fid_t lsock)
 {
 
 	/* Make the necessary checks before continuing.*/
-	if(lsock<0 || lsock>MAX_FILEID)
-		return -1;
-
-	if(CURPROC->FIDT[lsock]==NULL || CURPROC->FIDT[lsock]->streamobj==NULL)
-		return -1;
-
-	SCB* lscb = CURPROC->FIDT[lsock]->streamobj;
-
-	if(PORT_MAP[lscb->port]==NULL)
-		return -1;
+	FCB* lfcb = get_fcb(lsock);
+	if(lfcb==NULL)
+		return NOFILE;
 
-	if(lscb==NULL || lscb->type != SOCKET_LISTENER)
-		return -1;
+	SCB* lscb = fcb_socket(lfcb);
 
-	for(int i=0; i< MAX_FILEID; i++)
-	{
-		if(CURPROC->FIDT[i]==NULL)
-			break;
-		if(i==MAX_FILEID-1 && CURPROC->FIDT[i]!=NULL)
-			return -1;
+	if(lscb==NULL || lscb->type != SOCKET_LISTENER) {
+		FCB_decref(lfcb);
+		return NOFILE;
 	}
 
+	port_entry* pe = &PORT_MAP[lscb->port];
+	Mutex_Lock(&pe->lock);
 
+	/* 
+		Hold the listener by its reference count instead of its FCB, so that
+		closing it wakes us up.
+	 */
+	lscb->refcount++;
+	Mutex_Unlock(&pe->lock);
+	int nonblock = FCB_nonblocking(lfcb);
+	FCB_decref(lfcb);
 
+	Fid_t fid2 = NOFILE;
+	Mutex_Lock(&pe->lock);
 
 	/* Stasis on the listener until a new request is made or the listener is closed.*/
-	lscb->refcount++;
-
-	while(is_rlist_empty(&lscb->listener_s.queue) && PORT_MAP[lscb->port]!=NULL)
+	while(lscb->listener_s.count==0 && ! lscb->listener_s.closed)
 	{
-		kernel_wait(&lscb->listener_s.req_available, SCHED_PIPE);
+		if(nonblock) {
+			fid2 = WOULD_BLOCK;
+			goto finish;
+		}
+		kernel_wait(&pe->lock, &lscb->listener_s.req_available, SCHED_PIPE);
 	}
 	/* Waking up... A new request has been made.*/
 
 	/* Check if listener has been closed after waking up. */
-	if(PORT_MAP[lscb->port]==NULL)
-		return -1;
-
+	if(lscb->listener_s.closed)
+		goto finish;
+
+	/* Reserve the fid of the new (peer)socket for the connection*/
+	FCB* fcb2;
+	if(FCB_reserve(1, &fid2, &fcb2)==0) {
+		fid2 = NOFILE;
+		goto finish;
+	}
 
 	/* Extract the request fromt he listener's queue and honor it.*/
-	rlnode* popped_req;
-	popped_req = rlist_pop_front(&lscb->listener_s.queue);
+	con_req* req = listener_pop(&lscb->listener_s);
 
-	con_req* req;
-	req = popped_req->cr;
+	/* socket that made the connection request */
+	SCB* scb1 = req->peer;
+	/* secondary socket to which connection is made.*/
+	SCB* scb2 = socket_alloc(fcb2, lscb->port, lscb->kind);
 
+	/* Connect them before the new socket is published to the process */
+	socket_join(scb1, scb2);
+	FCB_attach(fcb2, scb2, &socket_file_ops);
 
 	/* Mark request as admitted.*/
 	req->admitted=1;
@@ -308,49 +780,16 @@ Fid_t sys_Accept(Fid_t lsock)
 	/* Signal the socket that made the request to let it know connection will be established.*/
 	kernel_signal(&req->connected_cv);
 
-	/* socket that made the connection request */
-	SCB* scb1 = req->peer;
-	/* Create the new (peer)socket for the connection*/
-	Fid_t fid2 = sys_Socket(lscb->port);
-	/* secondary socket to which connection is made.*/
-	SCB* scb2 = CURPROC->FIDT[fid2]->streamobj;
-
-	/* Mark refcount.*/
-	scb2->refcount++;
-
-	/* Connect the peer sockets to each other. */
-	scb1->peer_s.peer = scb2;
-	scb2->peer_s.peer = scb1;
-
-
-	/* Peer sockets need a set of 2 pipes to be connected.*/
-	Pipe_CB* pipe1;
-	Pipe_CB* pipe2;
-
-
-	/* Create 2 Pipe control blocks and connect them appropriately on the two peer sockets.*/
-	pipe1 = xmalloc(sizeof(Pipe_CB));
-	pipe2 = xmalloc(sizeof(Pipe_CB));
-
-	pipe1->reader=scb1->fcb;
-	pipe1->writer=scb2->fcb;
-	pipe2->reader=scb2->fcb;
-	pipe2->writer=scb1->fcb;
-
-	scb1->type = SOCKET_PEER;
-	scb2->type = SOCKET_PEER;
-
-	scb1->peer_s.write_pipe = pipe2;
-	scb1->peer_s.read_pipe = pipe1;
-	scb2->peer_s.write_pipe = pipe1;
-	scb2->peer_s.read_pipe = pipe2;
-
-
-
+finish:
 	lscb->refcount--;
 
-	scb2->refcount--;
+	/* The last thread to leave a closed listener frees it */
+	int unused = (lscb->listener_s.closed && lscb->refcount==0);
+
+	Mutex_Unlock(&pe->lock);
 
+	if(unused)
+		free(lscb);
 
 	return fid2;
 }
@@ -369,7 +808,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	The connect call will block for approximately the specified amount of time.
 	The resolution of this timeout is implementation specific, but should be
 	in the order of 100's of msec. Therefore, a timeout of at least 500 msec is
-	reasonable. If a negative timeout is given, it means, "infinite timeout".
+	reasonable. A timeout of @c (timeout_t)-1 means "infinite timeout".
 
 	@params sock the socket to connect to the other end
 	@params port the port on which to seek a listening socket
@@ -379,65 +818,98 @@ Fid_t sys_Accept(Fid_t lsock)
 	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
+	   - the listening socket is of another type (see @c SocketWithType).
+	   - the backlog of the listening socket is full.
 	   - the timeout has expired without a successful connection.
 */
 int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 {
 
 	/* Make the necessary checks before continuing... */
-	if(sock<0 || sock>MAX_FILEID)
+	if(port==NOPORT || port<= 0 || port > MAX_PORT)
 		return -1;
 
-	if(PORT_MAP[port] == NULL || port==NOPORT || port<= 0 || port > MAX_PORT)
+	FCB* fcb = get_fcb(sock);
+	if(fcb==NULL)
 		return -1;
 
-	SCB* scb = CURPROC->FIDT[sock]->streamobj;
+	SCB* scb = fcb_socket(fcb);
+	int retcode = -1;
 
-	if(scb==NULL)
-		return -1;
-
-	if(scb->type != SOCKET_UNBOUND)
-		return -1;
+	port_entry* pe = &PORT_MAP[port];
+	Mutex_Lock(&pe->lock);
 
+	if(scb==NULL || scb->type != SOCKET_UNBOUND || is_rlist_empty(&pe->listeners)
+		|| port_kind(pe) != scb->kind)
+		goto finish;
 
 
 	/* A connection to be done. on @port at socket @sock with the socket that syscall @ACCEPT will handle.*/
-	/* reference count on this calling socket to be increased.*/
-	scb->refcount++;
 
-	/* build and initialize a connection requst.*/
-	con_req* req = (con_req*)xmalloc(sizeof(con_req));
+	/* build and initialize a connection requst. It lives until we return.*/
+	con_req request;
+	con_req* req = &request;
 	req->admitted=0;
 	req->peer=scb;
+	req->listener=NULL;
 	req->connected_cv=COND_INIT;
 
-	rlnode_init(&req->queue_node, req);
+	/* Input it in the back of the queue of a listener socket; fail at once if the backlogs are full.*/
+	if(! port_queue_request(pe, req))
+		goto finish;
 
 
-	/* Input it in the back of the queue of the listener socket.*/
-	rlist_push_back(&PORT_MAP[port]->listener_s.queue, &req->queue_node);
-	assert(is_rlist_empty(&PORT_MAP[port]->listener_s.queue)==0);
-
-	/* Signal that there is a request in order to retrace @accept and assemble the connection. */
-	kernel_signal(&PORT_MAP[port]->listener_s.req_available);
-
-
-	/* Wait until connection is made. TIMEOUT assigned. Exit if timeout exceeds.*/
-	while(req->admitted==0)
+	/* Wait until connection is made. TIMEOUT assigned (in msec). Exit if timeout exceeds,
+	   or if the request left the queue without being admitted (the listener closed).*/
+	TimerDuration t = (timeout == (timeout_t)-1) ? NO_TIMEOUT : timeout*1000ul;
+	while(req->admitted==0 && req->listener)
 	{
-		if(kernel_timedwait(&req->connected_cv, SCHED_PIPE, timeout)==0)
-			return -1;
+		if(kernel_timedwait(&pe->lock, &req->connected_cv, SCHED_PIPE, t)==0)
+			break;
 	}
 
-	// Request has been handled at this point.
+	// Request has been handled at this point, or it failed.
+	if(req->admitted)
+		retcode = 0;
+	else if(req->listener)
+		/* Still queued, on timeout */
+		listener_remove(&req->listener->listener_s, req);
 
+finish:
+	Mutex_Unlock(&pe->lock);
+	FCB_decref(fcb);
 
-	/* Decrease reference count after everything is done.*/
-	scb->refcount--;
+	/* Return 0 since everything went smoothly~ :D*/
+	return retcode;
+}
 
 
-	/* Return 0 since everything went smoothly~ :D*/
-	return 0;
+/* Close the read direction of a connected socket */
+static void socket_shutdown_read(SCB* scb)
+{
+	if(scb->type == SOCKET_MSG_PEER) {
+		msgq_reader_close(scb->msg_s.read_q);
+		scb->msg_s.read_q=NULL;
+	} else if(scb->type == SOCKET_RING_PEER) {
+		ring_reader_close(scb->ring_s.rings, scb->ring_s.side);
+	} else {
+		pipe_reader_close(scb->peer_s.read_pipe);
+		scb->peer_s.read_pipe=NULL;
+	}
+}
+
+/* Close the write direction of a connected socket */
+static void socket_shutdown_write(SCB* scb)
+{
+	if(scb->type == SOCKET_MSG_PEER) {
+		msgq_writer_close(scb->msg_s.write_q);
+		scb->msg_s.write_q=NULL;
+	} else if(scb->type == SOCKET_RING_PEER) {
+		ring_writer_close(scb->ring_s.rings, scb->ring_s.side);
+	} else {
+		pipe_writer_close(scb->peer_s.write_pipe);
+		scb->peer_s.write_pipe=NULL;
+	}
 }
 
 
@@ -470,38 +942,41 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 int sys_ShutDown(Fid_t sock, shutdown_mode how)
 {
 	/* Check the usuals.*/
-	if(sock<0 || sock>MAX_FILEID)
+	FCB* fcb = get_fcb(sock);
+	if(fcb==NULL)
 		return -1;
 
-	SCB* scb = CURPROC->FIDT[sock]->streamobj;
+	SCB* scb = fcb_socket(fcb);
 
 	// Shutdown allowed only at peer sockets
-	if(scb->type != SOCKET_PEER)
+	if(scb==NULL || (scb->type != SOCKET_PEER && scb->type != SOCKET_MSG_PEER
+		&& scb->type != SOCKET_RING_PEER)) {
+		FCB_decref(fcb);
 		return -1;
+	}
 
 	/* Shuting down cases. Pipe system calls closing funcs are called.*/
 	switch(how)
 	{
 		case SHUTDOWN_READ:
-			pipe_reader_close(scb->peer_s.read_pipe);
-			scb->peer_s.read_pipe=NULL;
-
+			socket_shutdown_read(scb);
 			break;
 		case SHUTDOWN_WRITE:
-			pipe_writer_close(scb->peer_s.write_pipe);
-			scb->peer_s.write_pipe=NULL;
+			socket_shutdown_write(scb);
 			break;
 		case SHUTDOWN_BOTH:
-			pipe_reader_close(scb->peer_s.read_pipe);
-			scb->peer_s.read_pipe=NULL;
-			pipe_writer_close(scb->peer_s.write_pipe);
-			scb->peer_s.write_pipe=NULL;
+			socket_shutdown_read(scb);
+			socket_shutdown_write(scb);
 			scb->fcb=NULL;
 			break;
 		default:
 			break;
 	}
 
+	/* Pollers see the closed directions */
+	poll_wakeup(&fcb->pollq);
+
+	FCB_decref(fcb);
 	return 0;
 }
 
@@ -1,3 +1,4 @@
+#ifndef __KERNEL_SOCKET_H
 #define __KERNEL_SOCKET_H
 
 
@@ -5,19 +6,32 @@
 #include "util.h"
 #include "kernel_streams.h"
 #include "kernel_pipe.h"
+#include "kernel_msgq.h"
+#include "kernel_ring.h"
 
 typedef enum {
 	SOCKET_LISTENER,
 	SOCKET_UNBOUND,
-	SOCKET_PEER
+	SOCKET_PEER,
+	SOCKET_MSG_PEER,	/* A connected socket of type SOCK_SEQPACKET */
+	SOCKET_RING_PEER	/* A connected socket of type SOCK_RING */
 } socket_type;
 
 typedef struct Socket_Control_Block SCB; 
 
+/* 
+	A listener queues connection requests in a ring of @c backlog slots,
+	allocated by Listen, so a full listener turns Connect away at once.
+ */
 typedef struct Listener_Socket {
 	
-	rlnode queue;
+	con_req** queue;	/* The ring of pending requests */
+	uint backlog;		/* The slots of the ring */
+	uint head;			/* The oldest request */
+	uint count;			/* The pending requests */
 	CondVar req_available;
+	int closed;			/* Set when the listener is closed */
+	rlnode port_node;	/* Node in the listeners of the port */
 
 } listener_socket;
 
@@ -41,12 +55,33 @@ typedef struct Peer_Socket {
 
 
 
+typedef struct Message_Peer_Socket {
+
+	SCB* peer;
+	Msg_Q* write_q;
+	Msg_Q* read_q;
+
+} message_peer_socket;
+
+
+
+typedef struct Ring_Peer_Socket {
+
+	SCB* peer;
+	Ring_Pair* rings;
+	int side;			/* The side of the pair this socket is */
+
+} ring_peer_socket;
+
+
+
 typedef struct Socket_Control_Block {
 
 	uint refcount;
 	FCB* fcb;
 
 	socket_type type;
+	sock_type kind;		/* The type given to SocketWithType */
 
 	port_t port;
 
@@ -54,19 +89,32 @@ typedef struct Socket_Control_Block {
 		listener_socket listener_s;
 		unbound_socket unbound_s;
 		peer_socket peer_s;
+		message_peer_socket msg_s;
+		ring_peer_socket ring_s;
 	};
 
 } SCB;
 
-typedef struct connection_request {
+struct connection_request {
 
 	int admitted;
 	SCB* peer;
+	SCB* listener;		/* The listener whose ring holds the request, or NULL */
 
 	CondVar connected_cv;
-	rlnode queue_node;
-} con_req;
+};
+
+
+/* Initialize the port table; called at kernel startup */
+void initialize_sockets();
 
+/* The pipe a connected socket receives from, or NULL if fcb is not a connected socket */
+Pipe_CB* socket_read_pipe(FCB* fcb);
 
+/* The pipe a connected socket sends to, or NULL if fcb is not a connected socket */
+Pipe_CB* socket_write_pipe(FCB* fcb);
 
+/* How many bytes a write to a connected socket takes without waiting; other streams take any number */
+uint socket_write_room(FCB* fcb);
 
+#endif
@@ -1,15 +1,39 @@
 
+#include <limits.h>
+
 #include "util.h"
 #include "tinyos.h"
 #include "kernel_cc.h"
 #include "kernel_streams.h"
 #include "kernel_sched.h"
 #include "kernel_proc.h"
+#include "kernel_pipe.h"
 
 #define MAX_FILES MAX_PROC
 
 FCB FT[MAX_FILES];
 rlnode FCB_freelist;
+Mutex FCB_freelist_lock = MUTEX_INIT;
+
+
+/*
+  Free FCBs are kept in a cache on each core, which is refilled from
+  (and spills over to) the global freelist a batch at a time, so that 
+  creating and closing streams rarely touches the global lock.
+
+  As with the thread cache, the caller may be preempted and resume on a 
+  different core, so each cache has its own spinlock.
+ */
+#define FCB_CACHE_LIMIT 64	/* The most free FCBs kept by a core */
+#define FCB_CACHE_BATCH 16	/* FCBs moved to or from the global freelist at once */
+
+typedef struct fcb_cache {
+  Mutex spinlock;         /* Protects the cache */
+  rlnode fcbs;            /* The free FCBs */
+  uint count;             /* Number of FCBs in @c fcbs */
+} fcb_cache;
+
+static fcb_cache FCB_cache[MAX_CORES];
 
 
 void initialize_files()
@@ -19,39 +43,116 @@ void initialize_files()
 
     FT[i].refcount = 0;
     rlnode_init(& FT[i].freelist_node, &FT[i]);
+    poll_queue_init(& FT[i].pollq);
+    rlnode_init(& FT[i].event_items, NULL);
     rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
   }
+
+  for(int c=0; c<MAX_CORES; c++) {
+    FCB_cache[c].spinlock = MUTEX_INIT;
+    rlnode_init(& FCB_cache[c].fcbs, NULL);
+    FCB_cache[c].count = 0;
+  }
+}
+
+
+/* Move n FCBs, the least recently used, from a cache to the global freelist; the cache is locked */
+static void fcb_cache_spill(fcb_cache* fc, uint n)
+{
+  Mutex_Lock(&FCB_freelist_lock);
+  for(uint i=0; i<n; i++)
+    rlist_push_front(& FCB_freelist, rlist_pop_back(& fc->fcbs));
+  Mutex_Unlock(&FCB_freelist_lock);
+  fc->count -= n;
 }
 
+/* Take an FCB from a cache, refilling it from the global freelist if empty */
+static FCB* fcb_cache_get(fcb_cache* fc)
+{
+  FCB* fcb = NULL;
+
+  Mutex_Lock(&fc->spinlock);
+  if(fc->count == 0) {
+    /* Refill */
+    Mutex_Lock(&FCB_freelist_lock);
+    while(fc->count < FCB_CACHE_BATCH && ! is_rlist_empty(& FCB_freelist)) {
+      rlist_push_front(& fc->fcbs, rlist_pop_front(& FCB_freelist));
+      fc->count++;
+    }
+    Mutex_Unlock(&FCB_freelist_lock);
+  }
+  if(fc->count > 0) {
+    fcb = rlist_pop_front(& fc->fcbs)->fcb;
+    fc->count--;
+  }
+  Mutex_Unlock(&fc->spinlock);
+
+  return fcb;
+}
 
 FCB* acquire_FCB()
 {
-  if(! is_rlist_empty(& FCB_freelist)) {
-    FCB* fcb = rlist_pop_front(& FCB_freelist)->fcb;
+  uint core = cpu_core_id;
+  FCB* fcb = fcb_cache_get(&FCB_cache[core]);
+
+  /* 
+    When the freelist is empty too, the free FCBs are in the caches of other
+    cores; they give up half of them to the freelist.
+   */
+  if(fcb == NULL) {
+    for(uint c=0; c < MAX_CORES; c++) {
+      if(c == core) continue;
+      fcb_cache* oc = &FCB_cache[c];
+      Mutex_Lock(&oc->spinlock);
+      if(oc->count > 0)
+        fcb_cache_spill(oc, (oc->count+1)/2);
+      Mutex_Unlock(&oc->spinlock);
+    }
+    fcb = fcb_cache_get(&FCB_cache[core]);
+  }
+
+  if(fcb) {
     fcb->refcount = 0;
-    return fcb;
+    fcb->streamobj = NULL;
+    fcb->streamfunc = NULL;
+    fcb->flags = 0;
   }
-  else
-    return NULL;
+  return fcb;
 }
 
 void release_FCB(FCB* fcb)
 {
-  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  fcb_cache* fc = &FCB_cache[cpu_core_id];
+
+  Mutex_Lock(&fc->spinlock);
+  rlist_push_front(& fc->fcbs, & fcb->freelist_node);
+  fc->count++;
+  if(fc->count > FCB_CACHE_LIMIT)
+    fcb_cache_spill(fc, FCB_CACHE_BATCH);
+  Mutex_Unlock(&fc->spinlock);
 }
 
 
+/*
+  The reference count is atomic. A new reference is taken only from an 
+  existing one (e.g., the one held by a fid table), so it cannot drop to 
+  zero meanwhile.
+ */
 void FCB_incref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount++;
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
 }
 
 int FCB_decref(FCB* fcb)
 {
   assert(fcb);
-  fcb->refcount --;
-  if(fcb->refcount==0) {
+  uint refcount = __atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL);
+
+  if(refcount==0) {
+    /* Event queues only add a stream while they hold a reference to it */
+    if(__atomic_load_n(&fcb->event_items.next, __ATOMIC_ACQUIRE) != &fcb->event_items)
+      event_items_drop(fcb);
     int retval = fcb->streamfunc->Close(fcb->streamobj);
     release_FCB(fcb);
     return retval;
@@ -61,21 +162,180 @@ int FCB_decref(FCB* fcb)
 }
 
 
+void FCB_attach(FCB* fcb, void* streamobj, file_ops* streamfunc)
+{
+  /* The stream is published by its methods, to get_fcb() */
+  fcb->streamobj = streamobj;
+  __atomic_store_n(&fcb->streamfunc, streamfunc, __ATOMIC_RELEASE);
+}
+
+
+/*
+ *
+ *   File id tables
+ *
+ */
+
+/* The number of 64-bit words for a bitmap of n bits */
+#define BITMAP_WORDS(n) (((n)+63)/64)
+
+void fidt_init(fid_table* fidt)
+{
+  fidt->fcb = fidt->small_fcb;
+  fidt->used = &fidt->small_used;
+  fidt->full = &fidt->small_full;
+  fidt->capacity = MAX_FILEID;
+  fidt->limit = MAX_FILEID;
+
+  for(int i=0; i<MAX_FILEID; i++)
+    fidt->small_fcb[i] = NULL;
+  fidt->small_used = 0;
+  fidt->small_full = 0;
+}
+
+/* Grow the table, so that it has an entry for fid */
+static void fidt_grow(fid_table* fidt, uint fid)
+{
+  uint capacity = fidt->capacity;
+  while(capacity <= fid) capacity *= 2;
+  capacity = BITMAP_WORDS(capacity)*64;
+
+  uint words = BITMAP_WORDS(capacity), old_words = BITMAP_WORDS(fidt->capacity);
+  uint full_words = BITMAP_WORDS(words), old_full_words = BITMAP_WORDS(old_words);
+
+  FCB** fcb = xmalloc(capacity*sizeof(FCB*));
+  uint64_t* used = xmalloc(words*sizeof(uint64_t));
+  uint64_t* full = xmalloc(full_words*sizeof(uint64_t));
+
+  memcpy(fcb, fidt->fcb, fidt->capacity*sizeof(FCB*));
+  memset(fcb+fidt->capacity, 0, (capacity-fidt->capacity)*sizeof(FCB*));
+  memcpy(used, fidt->used, old_words*sizeof(uint64_t));
+  memset(used+old_words, 0, (words-old_words)*sizeof(uint64_t));
+  memcpy(full, fidt->full, old_full_words*sizeof(uint64_t));
+  memset(full+old_full_words, 0, (full_words-old_full_words)*sizeof(uint64_t));
+
+  if(fidt->fcb != fidt->small_fcb) {
+    free(fidt->fcb);
+    free(fidt->used);
+    free(fidt->full);
+  }
+
+  fidt->fcb = fcb;
+  fidt->used = used;
+  fidt->full = full;
+  fidt->capacity = capacity;
+}
+
+/* 
+  The FCB of an open fid, or NULL. A reserved FCB is not open until it is 
+  attached: its fid is taken, but only its reserver may use it.
+ */
+static inline FCB* fidt_get(fid_table* fidt, int fid)
+{
+  FCB* fcb = ((uint)fid < fidt->capacity) ? fidt->fcb[fid] : NULL;
+  if(fcb && __atomic_load_n(&fcb->streamfunc, __ATOMIC_ACQUIRE) == NULL)
+    return NULL;
+  return fcb;
+}
+
+/* Mark a fid in use, growing the table if needed */
+static void fidt_mark(fid_table* fidt, uint fid)
+{
+  if(fid >= fidt->capacity)
+    fidt_grow(fidt, fid);
+
+  uint w = fid/64;
+  fidt->used[w] |= 1ull << (fid%64);
+  if(fidt->used[w] == ~0ull)
+    fidt->full[w/64] |= 1ull << (w%64);
+}
+
+/* Mark a fid free */
+static void fidt_unmark(fid_table* fidt, uint fid)
+{
+  uint w = fid/64;
+  fidt->used[w] &= ~(1ull << (fid%64));
+  fidt->full[w/64] &= ~(1ull << (w%64));
+}
+
+/* Mark the lowest free fid in use, returning it, or NOFILE if the limit is reached */
+static Fid_t fidt_alloc(fid_table* fidt)
+{
+  uint words = BITMAP_WORDS(fidt->capacity);
+
+  /* The first word that is not full; if there is none, the first fid past the table */
+  uint fid = words*64;
+  for(uint s=0; s < BITMAP_WORDS(words); s++) {
+    if(~fidt->full[s]) {
+      uint w = s*64 + __builtin_ctzll(~fidt->full[s]);
+      if(w < words)
+        fid = w*64 + __builtin_ctzll(~fidt->used[w]);
+      break;
+    }
+  }
+
+  if(fid >= fidt->limit)
+    return NOFILE;
+  fidt_mark(fidt, fid);
+  return fid;
+}
+
+void fidt_inherit(fid_table* fidt, fid_table* src)
+{
+  fidt->limit = src->limit;
+
+  /* Visit the fids in use only */
+  for(uint w=0; w < BITMAP_WORDS(src->capacity); w++)
+    for(uint64_t bits = src->used[w]; bits; bits &= bits-1) {
+      uint fid = w*64 + __builtin_ctzll(bits);
+      FCB* fcb = fidt_get(src, fid);
+      if(fcb) {
+        fidt_mark(fidt, fid);
+        fidt->fcb[fid] = fcb;
+        FCB_incref(fcb);
+      }
+    }
+}
+
+void fidt_close_all(fid_table* fidt)
+{
+  for(uint w=0; w < BITMAP_WORDS(fidt->capacity); w++)
+    for(uint64_t bits = fidt->used[w]; bits; bits &= bits-1) {
+      uint fid = w*64 + __builtin_ctzll(bits);
+      FCB* fcb = fidt->fcb[fid];
+      fidt->fcb[fid] = NULL;
+      if(fcb) FCB_decref(fcb);
+    }
+
+  if(fidt->fcb != fidt->small_fcb) {
+    free(fidt->fcb);
+    free(fidt->used);
+    free(fidt->full);
+  }
+  fidt_init(fidt);
+}
+
 
 int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
-    size_t f=0;
     uint i;
+    int ok = 0;
 
-    /* Find distinct fids */
-    for(i=0; i<num; i++) {
-	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
-	    f++;
-	if(f==MAX_FILEID) break;
-	fid[i] = f; f++;
+    Mutex_Lock(&cur->lock);
+
+    /* Find distinct fids, the lowest free ones */
+    for(i=0; i<num; i++)
+	if((fid[i] = fidt_alloc(&cur->FIDT)) == NOFILE)
+	    break;
+    if(i<num) {
+	/* Roll back */
+	while(i>0) {
+	    fidt_unmark(&cur->FIDT, fid[i-1]);
+	    i--;
+	}
+	goto finish;
     }
-    if(i<num) return 0;
     /* Allocate FCBs */
     for(i=0;i<num;i++)
 	if((fcb[i] = acquire_FCB()) == NULL)
@@ -86,14 +346,20 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 	    release_FCB(fcb[i-1]);
 	    i--;
 	}
-	return 0;
+	for(i=0; i<num; i++)
+	    fidt_unmark(&cur->FIDT, fid[i]);
+	goto finish;
     }
     /* Found all */
     for(i=0;i<num;i++) {
-	cur->FIDT[fid[i]]=fcb[i];
-	FCB_incref(fcb[i]);
+	cur->FIDT.fcb[fid[i]]=fcb[i];
+	fcb[i]->refcount = 1;
     }
-    return 1;
+    ok = 1;
+
+finish:
+    Mutex_Unlock(&cur->lock);
+    return ok;
 }
 
 
@@ -101,11 +367,14 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 {
     PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
     for(size_t i=0; i<num ; i++) {
-	assert(cur->FIDT[fid[i]]==fcb[i]);
-	cur->FIDT[fid[i]] = NULL;
+	assert(cur->FIDT.fcb[fid[i]]==fcb[i]);
+	cur->FIDT.fcb[fid[i]] = NULL;
+	fidt_unmark(&cur->FIDT, fid[i]);
 	release_FCB(fcb[i]);
     }
+    Mutex_Unlock(&cur->lock);
 }
 
 
@@ -122,39 +391,47 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
 
 FCB* get_fcb(Fid_t fid)
 {
-  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+  if(fid < 0) return NULL;
 
-  return CURPROC->FIDT[fid];
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = fidt_get(&cur->FIDT, fid);
+  if(fcb)
+    FCB_incref(fcb);
+  Mutex_Unlock(&cur->lock);
+  return fcb;
+}
+
+
+/*
+  On a non-blocking stream, check that an operation would not block.
+  Pipes and sockets check again under their lock, where the check is
+  exact; for other streams (e.g., terminals), this is the only check.
+ */
+static int would_block(FCB* fcb, int events)
+{
+  return FCB_nonblocking(fcb) 
+    && (FCB_poll(fcb, NULL) & (events | POLL_ERROR | POLL_HANGUP)) == 0;
 }
 
 
 int sys_Read(Fid_t fd, char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devread)(void*,char*,uint);
-  void* sobj;
 
-  
-  /* Get the fields from the stream */
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
-    sobj = fcb->streamobj;
-    devread = fcb->streamfunc->Read;
-
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
-    if(devread)
-      retcode = devread(sobj, buf, size);
+    if(would_block(fcb, POLL_READ))
+      retcode = WOULD_BLOCK;
+    else if(fcb->streamfunc->Read)
+      retcode = fcb->streamfunc->Read(fcb->streamobj, buf, size);
 
     /* Need to decrease the reference to FCB */
     FCB_decref(fcb);
   }
-  
-  /* We must not go into non-preemptive domain with kernel_mutex locked */
-
 
   return retcode;
 }
@@ -163,46 +440,296 @@ int sys_Read(Fid_t fd, char *buf, unsigned int size)
 int sys_Write(Fid_t fd, const char *buf, unsigned int size)
 {
   int retcode = -1;
-  int (*devwrite)(void*, const char*, uint) = NULL;
-  void* sobj = NULL;
 
-  
-  /* Get the fields from the stream */
+  /* Get the stream, making sure that it will not be closed 
+     (by another thread) while we are using it! */
   FCB* fcb = get_fcb(fd);
 
   if(fcb) {
+    if(would_block(fcb, POLL_WRITE))
+      retcode = WOULD_BLOCK;
+    else if(fcb->streamfunc->Write)
+      retcode = fcb->streamfunc->Write(fcb->streamobj, buf, size);
 
-    sobj = fcb->streamobj;
-    devwrite = fcb->streamfunc->Write;
+    /* Need to decrease the reference to FCB */
+    FCB_decref(fcb);
+  }
 
-    /* make sure that the stream will not be closed (by another thread) 
-       while we are using it! */
-    FCB_incref(fcb);
-  
+  return retcode;
+}
 
-    if(devwrite)
-      retcode = devwrite(sobj, buf, size);
 
-    /* Need to decrease the reference to FCB */
+/* 
+  Check a vector of buffers, returning its total size, or -1 if it 
+  is too long. 
+ */
+static int iov_check(const iovec_t* iov, unsigned int iovcnt)
+{
+  if(iovcnt > MAX_IOV || (iov==NULL && iovcnt>0))
+    return -1;
+
+  unsigned long total = 0;
+  for(unsigned int i=0; i<iovcnt; i++) {
+    total += iov[i].len;
+    if(total > INT_MAX) return -1;
+  }
+  return (int) total;
+}
+
+
+int sys_ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int total = iov_check(iov, iovcnt);
+  if(total < 0) return -1;
+
+  int retcode = -1;
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb) {
+    if(would_block(fcb, POLL_READ))
+      retcode = WOULD_BLOCK;
+    else if(total == 0) {
+      /* Behave like an empty Read */
+      if(fcb->streamfunc->Read)
+        retcode = fcb->streamfunc->Read(fcb->streamobj, NULL, 0);
+    }
+    else if(fcb->streamfunc->ReadV)
+      retcode = fcb->streamfunc->ReadV(fcb->streamobj, iov, iovcnt);
+    else if(fcb->streamfunc->Read) {
+      /* A single Read may block, so only the first buffer is filled */
+      unsigned int i = 0;
+      while(iov[i].len == 0) i++;
+      retcode = fcb->streamfunc->Read(fcb->streamobj, iov[i].base, iov[i].len);
+    }
+
     FCB_decref(fcb);
+  }
+
+  return retcode;
+}
+
+
+int sys_WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt)
+{
+  int total = iov_check(iov, iovcnt);
+  if(total < 0) return -1;
+
+  int retcode = -1;
+  FCB* fcb = get_fcb(fd);
+
+  if(fcb) {
+    if(would_block(fcb, POLL_WRITE))
+      retcode = WOULD_BLOCK;
+    else if(total == 0) {
+      /* Behave like an empty Write */
+      if(fcb->streamfunc->Write)
+        retcode = fcb->streamfunc->Write(fcb->streamobj, NULL, 0);
+    }
+    else if(fcb->streamfunc->WriteV)
+      retcode = fcb->streamfunc->WriteV(fcb->streamobj, iov, iovcnt);
+    else if(fcb->streamfunc->Write) {
+      /* Write the buffers one at a time, stopping at a short write */
+      int count = 0;
+      for(unsigned int i=0; i<iovcnt; i++) {
+        if(iov[i].len == 0) continue;
+        int rc = fcb->streamfunc->Write(fcb->streamobj, iov[i].base, iov[i].len);
+        if(rc < 0) { 
+          if(count == 0) count = rc;
+          break;
+        }
+        count += rc;
+        if((unsigned int)rc < iov[i].len) break;
+      }
+      retcode = count;
+    }
 
+    FCB_decref(fcb);
   }
 
+  return retcode;
+}
+
+
+int FCB_poll(FCB* fcb, poll_table* pt)
+{
+  if(fcb->streamfunc->Poll)
+    return fcb->streamfunc->Poll(fcb->streamobj, pt);
+  return POLL_READ | POLL_WRITE;
+}
+
+int sys_Poll(pollfd_t* fds, unsigned int nfds, timeout_t timeout)
+{
+  if(fds==NULL && nfds>0)
+    return -1;
+
+  /* Bound the allocation below; more entries than fids are not needed */
+  if(nfds > __atomic_load_n(&CURPROC->FIDT.limit, __ATOMIC_RELAXED))
+    return -1;
+
+  /* Hold the streams, so that their poll queues remain while we are registered */
+  FCB** fcb = (nfds>0) ? xmalloc(nfds*sizeof(FCB*)) : NULL;
+  for(unsigned int i=0; i<nfds; i++)
+    fcb[i] = (fds[i].fd == NOFILE) ? NULL : get_fcb(fds[i].fd);
+
+  TimerDuration deadline = (timeout == (timeout_t)-1) ? NO_TIMEOUT : bios_clock() + timeout*1000ul;
+
+  poll_table table;
+  poll_table_init(&table);
+
+  /* Register on the first scan only; the entries remain until we return */
+  poll_table* pt = (timeout==0) ? NULL : &table;
+  int count;
+  int expired = (timeout==0);
+
+  while(1) {
+    count = 0;
+    for(unsigned int i=0; i<nfds; i++) {
+      int revents;
+      if(fds[i].fd == NOFILE)
+        revents = 0;
+      else if(fcb[i] == NULL)
+        revents = POLL_INVALID;
+      else
+        revents = FCB_poll(fcb[i], pt) & (fds[i].events | POLL_ERROR | POLL_HANGUP);
+      fds[i].revents = revents;
+      if(revents) count++;
+    }
+    pt = NULL;
+
+    if(count > 0 || expired) 
+      break;
+
+    /* Sleep until some stream changes, then scan again */
+    TimerDuration t = NO_TIMEOUT;
+    if(deadline != NO_TIMEOUT) {
+      TimerDuration now = bios_clock();
+      t = (deadline > now) ? deadline - now : 0;
+    }
+    if(t == 0 || ! poll_table_wait(&table, t))
+      expired = 1;
+  }
+
+  poll_table_destroy(&table);
+
+  for(unsigned int i=0; i<nfds; i++)
+    if(fcb[i]) FCB_decref(fcb[i]);
+  free(fcb);
+
+  return count;
+}
+
+
+/* Streams that are not pipes are spliced through a kernel buffer of this size */
+#define SPLICE_BUFFER_SIZE 4096
+
+int sys_Splice(Fid_t fid_in, Fid_t fid_out, unsigned int len)
+{
+  int retcode = -1;
 
+  FCB* in = get_fcb(fid_in);
+  FCB* out = get_fcb(fid_out);
+
+  if(in==NULL || out==NULL || len==0 || out->streamfunc->Write==NULL)
+    goto finish;
+
+  if(would_block(in, POLL_READ) || would_block(out, POLL_WRITE)) {
+    retcode = WOULD_BLOCK;
+    goto finish;
+  }
+
+  Pipe_CB* pipe = fcb_read_pipe(in);
+  if(pipe) {
+    /* 
+      Copy straight out of the pipe buffer, but not into the pipe itself
+      (through its write end, or the peer of its socket), which would wait 
+      for ever for the splice to make room
+     */
+    if(fcb_write_pipe(out) != pipe)
+      retcode = pipe_splice(pipe, out, len);
+  } 
+  else if(in->streamfunc->Read) {
+    /* 
+      The data is lost if it is not written, so a non-blocking output
+      bounds the read by what it takes without waiting
+     */
+    uint max = (len < SPLICE_BUFFER_SIZE) ? len : SPLICE_BUFFER_SIZE;
+    if(FCB_nonblocking(out)) {
+      uint room = fcb_write_room(out);
+      if(room < max) max = room;
+    }
+    if(max == 0) {
+      retcode = WOULD_BLOCK;
+      goto finish;
+    }
+
+    char buffer[SPLICE_BUFFER_SIZE];
+    int n = in->streamfunc->Read(in->streamobj, buffer, max);
+
+    /* Write out everything that was read, unless another writer took the room */
+    retcode = n;
+    for(int done = 0; done < n; ) {
+      int rc = out->streamfunc->Write(out->streamobj, buffer+done, n-done);
+      if(rc <= 0) {
+        retcode = (done > 0) ? done : (rc == WOULD_BLOCK) ? WOULD_BLOCK : -1;
+        break;
+      }
+      done += rc;
+    }
+  }
+
+finish:
+  if(in) FCB_decref(in);
+  if(out) FCB_decref(out);
   return retcode;
 }
 
 
-int sys_Close(int fd)
+int sys_GetFidFlags(Fid_t fd)
 {
-  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+  FCB* fcb = get_fcb(fd);
+  if(fcb==NULL)
+    return -1;
+
+  int flags = fcb->flags;
+  FCB_decref(fcb);
+  return flags;
+}
+
+
+int sys_SetFidFlags(Fid_t fd, int flags)
+{
+  if(flags & ~FID_NONBLOCK)
+    return -1;
 
   FCB* fcb = get_fcb(fd);
+  if(fcb==NULL)
+    return -1;
+
+  /* Streams read the flags without locking; a call in progress sees either value */
+  __atomic_store_n(&fcb->flags, flags, __ATOMIC_RELAXED);
+
+  FCB_decref(fcb);
+  return 0;
+}
+
+
+int sys_Close(int fd)
+{
+  if(fd<0) return -1;
 
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  int retcode = ((uint)fd < cur->FIDT.limit) ? 0 : -1;  /* Closing a closed fd is legal! */
+  FCB* fcb = fidt_get(&cur->FIDT, fd);
   if(fcb) {
-    CURPROC->FIDT[fd] = NULL;
-    retcode = FCB_decref(fcb);    
+    cur->FIDT.fcb[fd] = NULL;
+    fidt_unmark(&cur->FIDT, fd);
   }
+  Mutex_Unlock(&cur->lock);
+
+  /* The stream may be closed, so the PCB must not be locked */
+  if(fcb)
+    retcode = FCB_decref(fcb);    
 
   return retcode;
 }
@@ -218,26 +745,65 @@ int sys_Close(int fd)
 int sys_Dup2(int oldfd, int newfd)
 {
   int retcode=0;
-  if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
+  if(oldfd<0 || newfd<0)
     return -1;
 
-  FCB* old = get_fcb(oldfd);
-  FCB* new = get_fcb(newfd);
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+
+  fid_table* fidt = &cur->FIDT;
+  FCB* old = fidt_get(fidt, oldfd);
+  FCB* new = fidt_get(fidt, newfd);
 
-  if(old==NULL) {
+  /* A fid reserved by another call (see FCB_reserve) cannot be replaced */
+  if(old==NULL || (uint)newfd >= fidt->limit || (new==NULL && 
+      (uint)newfd < fidt->capacity && fidt->fcb[newfd]!=NULL)) {
     retcode = -1;
+    new = NULL;
   }
   else if(old!=new) {
-    if(new)
-      FCB_decref(new);
     FCB_incref(old);
-    CURPROC->FIDT[newfd] = old;
+    fidt_mark(fidt, newfd);
+    fidt->fcb[newfd] = old;
   }
+  else
+    new = NULL;
+
+  Mutex_Unlock(&cur->lock);
+
+  /* Close the replaced stream, with the PCB unlocked */
+  if(new)
+    FCB_decref(new);
 
   return retcode;
 }
 
 
+int sys_SetFidLimit(unsigned int limit)
+{
+  if(limit < 1 || limit > MAX_FID_LIMIT)
+    return -1;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  fid_table* fidt = &cur->FIDT;
+
+  /* No fid may be in use at or above the new limit */
+  int retcode = 0;
+  for(uint fid = limit; fid < fidt->capacity; fid = (fid/64+1)*64) {
+    if(fidt->used[fid/64] >> (fid%64)) {
+      retcode = -1;
+      break;
+    }
+  }
+  if(retcode==0)
+    fidt->limit = limit;
+
+  Mutex_Unlock(&cur->lock);
+  return retcode;
+}
+
+
 
 unsigned int sys_GetTerminalDevices()
 {
@@ -254,13 +820,17 @@ Fid_t open_stream(Device_type major, unsigned int minor)
   FCB* fcb;
 
 
+  void* streamobj;
+  file_ops* streamfunc;
+
   if(! FCB_reserve(1, &fid, &fcb))
       goto finerr;
   
-  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+  if(device_open(major, minor, &streamobj, &streamfunc)) {
       FCB_unreserve(1, &fid, &fcb);
       goto finerr;
   }
+  FCB_attach(fcb, streamobj, streamfunc);
   
   goto finok;
 finerr:
@@ -281,3 +851,15 @@ Fid_t sys_OpenTerminal(unsigned int termno)
   return open_stream(DEV_SERIAL, termno);
 }
 
+
+int sys_IsTerminal(Fid_t fd)
+{
+  FCB* fcb = get_fcb(fd);
+  if(fcb==NULL)
+    return -1;
+
+  int retcode = device_is(fcb->streamfunc, DEV_SERIAL);
+  FCB_decref(fcb);
+  return retcode;
+}
+
@@ -40,13 +40,58 @@
  */
 typedef struct file_control_block
 {
-  uint refcount;  			/**< @brief Reference counter. */
+  uint refcount;  			/**< @brief Reference counter, updated atomically. */
   void* streamobj;			/**< @brief The stream object (e.g., a device) */
   file_ops* streamfunc;		/**< @brief The stream implementation methods */
+  int flags;				/**< @brief The file id flags, e.g., @c FID_NONBLOCK */
   rlnode freelist_node;		/**< @brief Intrusive list node */
+  poll_queue pollq;			/**< @brief Pollers of the stream, for stream objects that use it */
+  rlnode event_items;		/**< @brief The event queue items of the stream (see kernel_event.c) */
 } FCB;
 
 
+/**
+  @brief The file id table of a process.
+
+  The table starts with room for @c MAX_FILEID fids, in the table itself, 
+  and grows by doubling up to the fid limit of the process. The fids in use
+  (open, or reserved by @ref FCB_reserve) are marked in a bitmap, and the
+  full words of the bitmap in a second bitmap, so that the lowest free fid 
+  is found in a bounded number of steps.
+
+  The table is protected by the lock of the process.
+ */
+typedef struct fid_table
+{
+  FCB** fcb;          /**< @brief The streams of the fids, @c capacity entries */
+  uint64_t* used;     /**< @brief Bitmap of the fids in use */
+  uint64_t* full;     /**< @brief Bitmap of the words of @c used that are full */
+  uint capacity;      /**< @brief The number of entries of @c fcb */
+  uint limit;         /**< @brief The fids are less than this */
+
+  FCB* small_fcb[MAX_FILEID];   /**< @brief The initial table */
+  uint64_t small_used;          /**< @brief The initial @c used bitmap */
+  uint64_t small_full;          /**< @brief The initial @c full bitmap */
+} fid_table;
+
+
+/** @brief Initialize an empty fid table, with limit @c MAX_FILEID. */
+void fidt_init(fid_table* fidt);
+
+/** @brief Copy the open fids of a table into an empty table.
+
+  The streams of the copied fids are referenced by the new table, 
+  which also gets the limit of @c src.
+ */
+void fidt_inherit(fid_table* fidt, fid_table* src);
+
+/** @brief Close all the fids of a table, leaving it empty.
+
+  The table must not be used by other threads.
+ */
+void fidt_close_all(fid_table* fidt);
+
+
 
 /** 
   @brief Initialization for files and streams.
@@ -56,6 +101,21 @@ typedef struct file_control_block
 void initialize_files();
 
 
+/** 
+  @brief Allocate a free FCB.
+
+  Free FCBs are cached on each core. When the cache of this core and the
+  global freelist are empty, the other cores give up some of theirs, so
+  that this fails only when no FCB is free.
+
+  @returns a free FCB, with no stream attached, or NULL if there is none.
+ */
+FCB* acquire_FCB();
+
+/** @brief Return an FCB obtained by @ref acquire_FCB, to the cache of this core. */
+void release_FCB(FCB* fcb);
+
+
 /**
 	@brief Increase the reference count of an fcb 
 
@@ -68,7 +128,8 @@ void FCB_incref(FCB* fcb);
 	@brief Decrease the reference count of the fcb.
 
 	If the reference count drops to 0, release the FCB, calling the 
-	Close method and returning its return value.
+	Close method and returning its return value. Before it is closed, the
+	stream is removed from the event queues it is in.
 	If the reference count is still >0, return 0. 
 
 	@param fcb  the fcb whose reference count is decreased
@@ -78,6 +139,14 @@ void FCB_incref(FCB* fcb);
 int FCB_decref(FCB* fcb);
 
 
+/** @brief Remove a stream from the event queues it is in.
+
+   This is called by @ref FCB_decref when the last reference to a stream 
+   is dropped, before the stream is closed.
+*/
+void event_items_drop(FCB* fcb);
+
+
 /** @brief Acquire a number of FCBs and corresponding fids.
 
    Given an array of fids and an array of pointers to FCBs  of
@@ -88,7 +157,9 @@ int FCB_decref(FCB* fcb);
    may have been overwritten).
 
    If these resources are not needed, the operation can be
-   reversed by calling @ref FCB_unreserve.
+   reversed by calling @ref FCB_unreserve. Else, the stream of
+   each FCB is set with @ref FCB_attach; until then, the fid
+   is not usable by @ref get_fcb.
 
    @param num the number of resources to reserve.
    @param fid array of size at least `num` of `Fid_t`.
@@ -118,9 +189,58 @@ int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb);
 void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 
 
+/** @brief Set the stream of a reserved FCB.
+
+   This makes an FCB returned by @ref FCB_reserve usable. 
+
+   @param fcb the reserved FCB
+   @param streamobj the stream object
+   @param streamfunc the stream implementation methods
+*/
+void FCB_attach(FCB* fcb, void* streamobj, file_ops* streamfunc);
+
+
+/** @brief The readiness of a stream.
+
+   This calls the @c Poll method of the stream, if it has one.
+
+   @param fcb the stream
+   @param pt a poll table to register to the stream, or NULL
+   @returns a mask of @c poll_event bits
+*/
+int FCB_poll(FCB* fcb, poll_table* pt);
+
+
+/** @brief Check if a stream is non-blocking.
+
+   Streams that can block check this under their own lock, to return
+   @c WOULD_BLOCK instead of waiting.
+
+   @param fcb the stream
+   @returns non-zero if @c FID_NONBLOCK is set
+*/
+static inline int FCB_nonblocking(FCB* fcb)
+{
+  return fcb->flags & FID_NONBLOCK;
+}
+
+
+/** @brief Total size of a vector of buffers. */
+static inline uint iov_total(const iovec_t* iov, uint iovcnt)
+{
+  uint n = 0;
+  for(uint i=0; i<iovcnt; i++)
+    n += iov[i].len;
+  return n;
+}
+
+
 /** @brief Translate an fid to an FCB.
 
 	This routine will return NULL if the fid is not legal.
+	Else, the reference count of the FCB is increased, so that
+	the stream is not closed (by another thread) while it is used.
+	The caller must call @ref FCB_decref when done with it.
 
 	@param fid the file ID to translate to a pointer to FCB
 	@returns a pointer to the corresponding FCB, or NULL.
@@ -12,6 +12,8 @@
  */
 
 
+#ifdef KERNEL_BIG_LOCK
+
 #define PRE_CALL \
 kernel_lock();\
 
@@ -20,6 +22,14 @@ kernel_lock();\
 #define POST_CALL \
 kernel_unlock();\
 
+#else
+
+/* Kernel objects are locked individually, see kernel_cc.h */
+#define PRE_CALL
+#define POST_CALL
+
+#endif
+
 
 /* with return */
 #define SYSCALL(NAME, RET, SIG, ARGS)\
@@ -7,24 +7,46 @@
 #define SYSCALLS \
 SYSCALL(Exec, int, (Task task, int argl, void* args), (task, argl, args))\
 SYSCALLV(Exit, (int exitval), (exitval))\
+SYSCALL(SetExitHook, ExitHook, (ExitHook hook), (hook))\
 SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadWithStack, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
+SYSCALL(IsTerminal, int, (Fid_t fd), (fd))\
 SYSCALL(OpenNull, Fid_t, (), ())\
 SYSCALL(Read,int,(Fid_t fd, char *buf, unsigned int size), (fd,buf,size))\
 SYSCALL(Write,int,(Fid_t fd, const char *buf, unsigned int size), (fd,buf,size))\
+SYSCALL(ReadV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(WriteV,int,(Fid_t fd, const iovec_t* iov, unsigned int iovcnt), (fd,iov,iovcnt))\
+SYSCALL(Poll,int,(pollfd_t* fds, unsigned int nfds, timeout_t timeout), (fds,nfds,timeout))\
+SYSCALL(EventQueue, Fid_t, (), ())\
+SYSCALL(EventCtl, int, (Fid_t eq, eventctl_op op, Fid_t fd, int events, void* data), (eq, op, fd, events, data))\
+SYSCALL(EventWait, int, (Fid_t eq, event_t* events, unsigned int maxevents, timeout_t timeout), (eq, events, maxevents, timeout))\
 SYSCALL(Close,int,(Fid_t fd),(fd))\
 SYSCALL(Dup2,int, (Fid_t oldfd, Fid_t newfd), (oldfd,newfd))\
+SYSCALL(SetFidLimit,int, (unsigned int limit), (limit))\
+SYSCALL(Splice,int, (Fid_t fid_in, Fid_t fid_out, unsigned int len), (fid_in,fid_out,len))\
+SYSCALL(GetFidFlags, int, (Fid_t fd), (fd))\
+SYSCALL(SetFidFlags, int, (Fid_t fd, int flags), (fd, flags))\
 SYSCALL(Pipe, int, (pipe_t* pipe), (pipe))\
+SYSCALL(PipeWithFlags, int, (pipe_t* pipe, int flags), (pipe, flags))\
+SYSCALL(SetPipeCapacity, int, (Fid_t fid, unsigned int capacity), (fid, capacity))\
 SYSCALL(Socket, Fid_t, (port_t port), (port))\
+SYSCALL(SocketWithFlags, Fid_t, (port_t port, int flags), (port, flags))\
+SYSCALL(SocketWithType, Fid_t, (port_t port, sock_type type), (port, type))\
+SYSCALL(SocketPair, int, (sock_type type, Fid_t pair[2]), (type, pair))\
+SYSCALL(SocketRing, int, (Fid_t sock, socket_ring** send, socket_ring** recv), (sock, send, recv))\
+SYSCALL(RingWake, int, (Fid_t sock), (sock))\
 SYSCALL(Listen, int, (Fid_t sock), (sock))\
+SYSCALL(ListenWithBacklog, int, (Fid_t sock, unsigned int backlog), (sock, backlog))\
+SYSCALL(ListenShared, int, (Fid_t sock, unsigned int backlog), (sock, backlog))\
 SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
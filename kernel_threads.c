@@ -9,6 +9,14 @@
   @brief Create a new thread in the current process.
   */
 Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadWithStack(task, argl, args, 0);
+}
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  */
+Tid_t sys_CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size)
 {
   TCB* tcb=NULL;
   //PTCB* ptcb=NULL;
@@ -17,7 +25,7 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
     return NOTHREAD;
 
   // Create a new Thread.
-  tcb=spawn_thread(CURPROC, start_main_process_thread);
+  tcb=spawn_thread(CURPROC, start_main_process_thread, stack_size);
   assert(tcb!=NULL);
 
 
@@ -52,9 +60,11 @@ Tid_t sys_CreateThread(Task task, int argl, void* args)
   rlnode_init(&ptcb->ptcb_list_node, ptcb);
 
   // Insert ptcb to the PCB list of PTCBs
+  Mutex_Lock(&pcb->lock);
   rlist_push_back(&pcb->PTCB_list, &ptcb->ptcb_list_node);
   // Increment the PCB thread counter.
   pcb->thread_count++;
+  Mutex_Unlock(&pcb->lock);
 
 //------------------------- INSTEAD OF SPAWN THREAD ---------------------------
 
@@ -96,26 +106,30 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
 {
   //Cast Tid_t to a PTCB pointer.
   PTCB* ptcb = (PTCB*)tid;
- 
+  PCB* curproc = CURPROC;
+  int retcode = -1;
+
+  // The PTCBs of the process are protected by its lock.
+  Mutex_Lock(&curproc->lock);
 
   /*
    * Make necessary checks before joining.
    */
 
+  if(ptcb==NULL)
+    goto finish;
+
   // Cannot join a Thread that does not exist.
-  if(rlist_find(&CURPROC->PTCB_list, ptcb, NULL)==NULL)
-    return -1;
+  if(rlist_find(&curproc->PTCB_list, ptcb, NULL)==NULL)
+    goto finish;
 
   // Cannot join itself.
   if(tid ==sys_ThreadSelf())
-    return -1;
+    goto finish;
 
   // Cannot join a Thread that has been detached.
   if(ptcb->detached==1)
-	   return -1;
-
-  if(ptcb==NULL)
-    return -1;
+    goto finish;
 
 
   // Join the Thread via kernel_wait func + the CondVar argument given.
@@ -123,7 +137,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
   ptcb->refcount++;
   while(!(ptcb->exited || ptcb->detached))
   {
-    kernel_wait(&ptcb->exit_cv, SCHED_USER);
+    kernel_wait(&curproc->lock, &ptcb->exit_cv, SCHED_USER);
   }
   // Decrement the refcount after it is done.
   ptcb->refcount--;
@@ -131,9 +145,7 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
  
   // Better safe than sorry!
   if(ptcb->detached==1)
-  {
-    return -1;    
-  }
+    goto finish;
   
   // Be sure to save the exitval if there is one.
   if(exitval != NULL)
@@ -141,14 +153,18 @@ int sys_ThreadJoin(Tid_t tid, int* exitval)
     *exitval=ptcb->exitval;
   }
 
-  // ???? refcount is 0. It can be deleted. A signal must be broadcast.
+  // The last joiner frees the PTCB.
   if(ptcb->refcount==0)
   {
     rlist_remove(&ptcb->ptcb_list_node);
     free(ptcb);
   }
 
-  return 0;
+  retcode = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return retcode;
 }
 
 /**
@@ -158,17 +174,20 @@ int sys_ThreadDetach(Tid_t tid)
 {
   //Cast Tid_t to a PTCB pointer.
   PTCB* ptcb = (PTCB*)tid;
+  PCB* curproc = CURPROC;
+  int retcode = -1;
+
+  Mutex_Lock(&curproc->lock);
 
   // Making necessary checks before continuing
 
   // Cannot detach a Thread that doesn't exist!
-  if(rlist_find(&CURPROC->PTCB_list, ptcb, NULL)==NULL)return -1;
+  if(rlist_find(&curproc->PTCB_list, ptcb, NULL)==NULL)
+    goto finish;
 
   // Cannot detach an exited Thread.
   if(ptcb->exited==1)
-  {
-    return -1;
-  }
+    goto finish;
 
  
   // If Thread exists and is not exited, then detach it!
@@ -181,15 +200,12 @@ int sys_ThreadDetach(Tid_t tid)
 
   // Signal that freedom has arrived!
   kernel_broadcast(&ptcb->exit_cv);
-  
 
-  
- 
-  return 0;
-
-  
+  retcode = 0;
 
-  
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return retcode;
 }
 
 /**
@@ -203,27 +219,69 @@ void sys_ThreadExit(int exitval)
   // Hold the current PTCB
   PTCB* ptcb = (PTCB*)sys_ThreadSelf();
 
+  Mutex_Lock(&curproc->lock);
+
   // Set the Thread as exited. --> Raise exited flag.
   ptcb->exited=1;
   ptcb->exitval=exitval;
 
   // Decrement PCB's thread count.
-  ptcb->tcb->owner_pcb->thread_count--;
-
+  curproc->thread_count--;
 
   // Signal that this Thread has exited in order to wake up its waiting list.
   kernel_broadcast(&ptcb->exit_cv);
 
+  // If other threads remain, the process goes on; "delete the thread".
+  if(curproc->thread_count>0)
+    kernel_sleep(EXITED, &curproc->lock, SCHED_USER);
 
-  // IF must be: if its the last thread alive.
-  if(curproc->thread_count==0)
+  /* 
+    This was the last thread, the process exits. No other thread of the
+    process can touch its PCB from now on.
+   */
+  Mutex_Unlock(&curproc->lock);
+
+  /* 
+    Do all the other cleanup we want here, close files etc. 
+    This is done without holding any lock, since closing a stream may
+    need to lock other objects.
+   */
+
+  /* Run the exit hook, while the fids of the process are still open */
+  if(curproc->exit_hook != NULL)
+    curproc->exit_hook();
+
+  /* Clean up FIDT */
+  fidt_close_all(&curproc->FIDT);
+
+  // CLEAN PTCBs
+  while(!is_rlist_empty(&curproc->PTCB_list))
   {
+    PTCB* rem_ptcb;
+    rem_ptcb = rlist_pop_front(&curproc->PTCB_list)->ptcb;
+    free(rem_ptcb);
+  }
+
+  /*
+    Now, mark the process as exited, and hand it to the parent. 
+    Lock init, the parent and this process, in this order.
+   */
+  PCB* initpcb = get_pcb(1);
+  PCB* parent = curproc->parent;
+
+  if(curproc != initpcb) {
+    Mutex_Lock(& initpcb->lock);
+    /* Holding the lock of init, my parent cannot change */
+    parent = curproc->parent;
+    if(parent != initpcb) 
+      Mutex_Lock(& parent->lock);
+  }
+  Mutex_Lock(& curproc->lock);
 
-    if(get_pid(curproc)!=1)
-    {
-      /* Reparent any children of the exiting process to the 
+  if(curproc != initpcb)
+  {
+    /* Reparent any children of the exiting process to the 
        initial task */
-    PCB* initpcb = get_pcb(1);
     while(!is_rlist_empty(& curproc->children_list)) {
       rlnode* child = rlist_pop_front(& curproc->children_list);
       child->pcb->parent = initpcb;
@@ -238,67 +296,34 @@ void sys_ThreadExit(int exitval)
     }
 
     /* Put me into my parent's exited list */
-    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
-    kernel_broadcast(& curproc->parent->child_exit);
-
-    //
-    }
+    rlist_push_front(& parent->exited_list, &curproc->exited_node);
+    kernel_broadcast(& parent->child_exit);
+  }
     
-    assert(is_rlist_empty(& curproc->children_list));
-    assert(is_rlist_empty(& curproc->exited_list));
-
-    /* 
-    Do all the other cleanup we want here, close files etc. 
-   */
+  assert(is_rlist_empty(& curproc->children_list));
+  assert(is_rlist_empty(& curproc->exited_list));
 
-    /* Release the args data */
-    if(curproc->args) 
-    {
-      free(curproc->args);
-      curproc->args = NULL;
-    }
-
-    /* Clean up FIDT */
-    for(int i=0;i<MAX_FILEID;i++) {
-      if(curproc->FIDT[i] != NULL) {
-        FCB_decref(curproc->FIDT[i]);
-        curproc->FIDT[i] = NULL;
-      }
-    }
-
-    /* Disconnect my main_thread */
-    //curproc->main_thread = NULL;
-
-    /* Now, mark the process as exited. */
-    //curproc->pstate = ZOMBIE;
-
-
-
-    // CLEAN PTCBs
-    while(!is_rlist_empty(&curproc->PTCB_list))
-    {
-      if(ptcb->refcount<1)
-      {
-        PTCB* rem_ptcb;
-        rem_ptcb = rlist_pop_front(&curproc->PTCB_list)->ptcb;
-        free(rem_ptcb);
-      }
-        
-    }
-    assert(is_rlist_empty(&curproc->PTCB_list));
+  /* Release the args data */
+  if(curproc->args) 
+  {
+    free(curproc->args);
+    curproc->args = NULL;
   }
 
   /* Disconnect my main_thread */
-    curproc->main_thread = NULL;
-
-    /* Now, mark the process as exited. */
-    curproc->pstate = ZOMBIE;
+  curproc->main_thread = NULL;
 
+  /* Now, mark the process as exited. */
+  curproc->pstate = ZOMBIE;
 
+  /* Once the locks are released, the parent may clean up the PCB */
+  Mutex_Unlock(& curproc->lock);
+  if(curproc != initpcb) {
+    if(parent != initpcb)
+      Mutex_Unlock(& parent->lock);
+    Mutex_Unlock(& initpcb->lock);
+  }
 
   // "Delete the thread"
-  kernel_sleep(EXITED, SCHED_USER);
-
-
+  kernel_sleep(EXITED, NULL, SCHED_USER);
 }
-
@@ -0,0 +1,128 @@
+
+#include "util.h"
+#include "unit_testing.h"
+#include "kernel_sched.h"
+#include "kernel_cc.h"
+
+
+/*
+	These tests look inside the kernel, through its internal interfaces,
+	at mechanisms that the system calls do not show. The behaviour of the
+	system calls is tested by validate_api.
+ */
+
+
+static int void_thread(int argl, void* args) { return 0; }
+
+static int thread_churner(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Tid_t t = CreateThread(void_thread, 0, NULL);
+		ASSERT(t != NOTHREAD);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_thread_cache,
+	"Test that threads created and joined repeatedly reuse the cached thread blocks, "
+	"and that released blocks are freed when the cache limit is 0."
+	)
+{
+	thread_cache_stats before, after;
+	get_thread_cache_stats(&before);
+
+	Tid_t tids[8];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(thread_churner, 200, NULL);
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	/* Most threads got a cached block */
+	get_thread_cache_stats(&after);
+	ASSERT(after.recycled > before.recycled);
+	ASSERT(after.hits - before.hits > 8*200/2);
+
+	/* Without a cache, released blocks are freed */
+	ASSERT(set_thread_cache_limit(0)==THREAD_CACHE_LIMIT);
+	before = after;
+	thread_churner(100, NULL);
+	get_thread_cache_stats(&after);
+	ASSERT(after.freed > before.freed);
+	ASSERT(set_thread_cache_limit(THREAD_CACHE_LIMIT)==0);
+	return 0;
+}
+
+
+static Mutex pi_mx = MUTEX_INIT;
+static volatile int pi_spinning;
+
+static int pi_spinner(int argl, void* args)
+{
+	while(pi_spinning);
+	return 0;
+}
+
+static int pi_waiter(int argl, void* args)
+{
+	Mutex_Lock(&pi_mx);
+	Mutex_Unlock(&pi_mx);
+	return 0;
+}
+
+BOOT_TEST(test_mutex_priority_inheritance,
+	"Test that a thread blocking on a mutex whose owner has a lower priority counts "
+	"as a priority inversion, and that the owner inherits its priority until it "
+	"unlocks the mutex, while a CPU-bound thread competes with it."
+	)
+{
+	TCB* self = cur_thread();
+	unsigned long inversions = get_mutex_inversions();
+
+	pi_spinning = 1;
+	Tid_t spinner = CreateThread(pi_spinner, 0, NULL);
+
+	Mutex_Lock(&pi_mx);
+
+	/* Drop to the lowest priority; the waiter starts at the highest */
+	int preempt = preempt_off;
+	Mutex_Lock(&self->state_spinlock);
+	self->priority = 0;
+	Mutex_Unlock(&self->state_spinlock);
+	if(preempt) preempt_on;
+	Tid_t waiter = CreateThread(pi_waiter, 0, NULL);
+
+	/* Wait for the waiter to block on the mutex; blocking here would let it in */
+	while(get_mutex_inversions() == inversions);
+#ifdef MUTEX_PRIORITY_INHERITANCE
+	while(__atomic_load_n(&self->inherited_priority, __ATOMIC_RELAXED) < 0);
+	ASSERT(self->inherited_priority > 0);
+#endif
+	ASSERT(get_mutex_inversions() > inversions);
+
+	/* The inherited priority goes with the mutex */
+	Mutex_Unlock(&pi_mx);
+	ASSERT(self->inherited_priority == -1);
+
+	ASSERT(ThreadJoin(waiter, NULL)==0);
+	pi_spinning = 0;
+	ASSERT(ThreadJoin(spinner, NULL)==0);
+	return 0;
+}
+
+
+TEST_SUITE(all_tests,
+	"White-box tests of the kernel."
+	)
+{
+	&test_thread_cache,
+	&test_mutex_priority_inheritance,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	register_test(&all_tests);
+	return run_program(argc, argv, &all_tests);
+}
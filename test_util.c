@@ -130,6 +130,7 @@ BARE_TEST(test_list_queue,
 		ASSERT(I==p);
 		I++;
 	}
+	ASSERT(I==n+10);
 
 	ASSERT(is_rlist_empty(&L));
 
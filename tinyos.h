@@ -46,9 +46,14 @@ typedef unsigned long timeout_t;
 typedef int Fid_t;  
 
 /** @brief The maximum number of open files per process. 
-   Only values 0 to MAX_FILEID-1 are legal for file descriptors. */
+   Only values 0 to MAX_FILEID-1 are legal for file descriptors, 
+   unless the limit is changed by @c SetFidLimit. */
 #define MAX_FILEID 16
 
+/** @brief The largest limit of open files per process. 
+   @see SetFidLimit */
+#define MAX_FID_LIMIT 65536
+
 /** @brief The invalid file id. */
 #define NOFILE  (-1)
 
@@ -74,9 +79,12 @@ typedef uintptr_t Tid_t;
 
     @see Mutex_Lock
     @see Mutex_Unlock
+    A mutex is a single word, which holds the owner of the mutex while it is
+    locked.
+
     @see MUTEX_INIT
 */
-typedef char Mutex;
+typedef uintptr_t Mutex;
 
 /**
   @brief This macro is used to initialize mutexes. 
@@ -92,7 +100,8 @@ typedef char Mutex;
 /** @brief Lock a mutex.
 
   Lock a mutex, by waiting if necessary, as long as it takes. In user-space and
-  in kernel-space (preemptive domain), the locking will yield after spinning for a few hundred times.
+  in kernel-space (preemptive domain), the locking thread spins for a bounded time
+  and then blocks, until @c Mutex_Unlock wakes it up to try again.
   In scheduler space (non-preemptive domain), the mutex lock operation is pure spinlock.
 
   @see Mutex
@@ -103,7 +112,9 @@ void Mutex_Lock(Mutex*);
 
 /** @brief Unlock a mutex that you locked. 
   
-    This operation is non-blocking.
+    This operation is non-blocking. If threads are blocked on the mutex, the
+    one that has waited the longest is woken up, to try to lock it again; a
+    thread locking it meanwhile may get it first.
     @see Mutex
     @see Mutex_Lock
 */
@@ -255,6 +266,25 @@ Pid_t Exec(Task task, int argl, void* args);
    */
 void Exit(int val);
 
+/** @brief A function to run when a process exits.
+  @see SetExitHook
+ */
+typedef void (*ExitHook)(void);
+
+/** @brief Set the function to run when the current process exits.
+
+  The hook is called, without arguments, by the last thread of the process 
+  as it exits, whether it returned from its task or called @c Exit() or 
+  @c ThreadExit(). It runs before the file ids of the process are closed, 
+  so it can still write to them, but it must not create new threads.
+
+  A new process starts without an exit hook.
+
+  @param hook the function to call, or NULL to remove the hook
+  @returns the previous exit hook of the process, or NULL if it had none.
+  */
+ExitHook SetExitHook(ExitHook hook);
+
 /** @brief Wait on a terminating child.
 
    This function will return the exit status of a terminated 
@@ -319,6 +349,25 @@ Pid_t GetPPid(void);
   */
 Tid_t CreateThread(Task task, int argl, void* args);
 
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+
+  This is the same as `CreateThread`, except that the stack of the new thread
+  will have (about) `stack_size` bytes, instead of the default. The size is
+  only a hint: it is rounded up to a multiple of the page size, and kept within
+  the limits supported by the kernel. A `stack_size` of 0 selects the default.
+
+  Stack memory is only used when it is touched, so a generous stack costs little;
+  on the other hand, a thread that overflows its stack crashes the program.
+
+  @param task a function to execute
+  @param argl the first argument of `task`
+  @param args the second argument of `task`
+  @param stack_size the requested stack size, in bytes
+  @see CreateThread
+  */
+Tid_t CreateThreadWithStack(Task task, int argl, void* args, unsigned int stack_size);
+
 /**
   @brief Return the Tid of the current thread.
  */
@@ -399,6 +448,14 @@ unsigned int GetTerminalDevices();
  */
 Fid_t OpenTerminal(unsigned int termno);
 
+/** @brief Check if a file id is a terminal.
+
+  @param fd the file id
+  @return 1 if @c fd is a stream opened by @c OpenTerminal (or a copy of one), 
+   0 if it is some other stream, or -1 if @c fd is not a legal file id.
+ */
+int IsTerminal(Fid_t fd);
+
 
 /** @brief Open a stream on the null device.
 
@@ -458,6 +515,190 @@ int Read(Fid_t fd, char *buf, unsigned int size);
 int Write(Fid_t fd, const char* buf, unsigned int size);
 
 
+/** @brief A buffer for vectored I/O.
+
+  An array of these describes a sequence of buffers, for @c ReadV and @c WriteV.
+ */
+typedef struct iovec_s {
+	void* base;				/**< The start of the buffer */
+	unsigned int len;		/**< The size of the buffer, in bytes */
+} iovec_t;
+
+/** @brief The maximum number of buffers in a @c ReadV or @c WriteV call. */
+#define MAX_IOV 1024
+
+/** @brief Read bytes from a stream into a sequence of buffers.
+
+   This is like @c Read, but the data read is placed into the buffers of
+   @c iov in order, filling each buffer before moving to the next. As with
+   @c Read, the call may return fewer bytes than the total size of the
+   buffers, but at least 1, if data is available.
+
+  @param fd  the file ID of the stream to read from
+  @param iov an array of @c iovcnt buffers
+  @param iovcnt the number of buffers, at most @c MAX_IOV
+  @return the number of bytes copied, 0 if we have reached EOF, or -1, indicating some error.
+        Possible errors are:
+         - The file descriptor is invalid.
+         - @c iovcnt is larger than @c MAX_IOV, or the buffers total more than 2GB.
+         - There was a I/O runtime problem.
+ */
+int ReadV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+/** @brief Write bytes to a stream from a sequence of buffers.
+
+   This is like @c Write, with the data taken from the buffers of @c iov in order.
+   For pipes and sockets, the data of all the buffers is written in a single 
+   operation, as if it was in one buffer.
+
+  @param fd  the file ID of the stream to write to
+  @param iov an array of @c iovcnt buffers
+  @param iovcnt the number of buffers, at most @c MAX_IOV
+  @return the number of bytes copied, or -1 on error. 
+   Possible errors are:
+   - The file id is invalid.
+   - @c iovcnt is larger than @c MAX_IOV, or the buffers total more than 2GB.
+   - There was a I/O runtime problem.
+ */
+int WriteV(Fid_t fd, const iovec_t* iov, unsigned int iovcnt);
+
+
+/**
+   @brief Poll events.
+
+   These constants are the bits of the @c events and @c revents fields of @c pollfd_t.
+
+   @see Poll
+*/
+typedef enum {
+  POLL_READ=0x01,   /**< Data can be read without blocking (or the read returns 0). */
+  POLL_WRITE=0x02,  /**< Data can be written without blocking. */
+  POLL_ERROR=0x04,  /**< An error condition (e.g., the read end of a pipe is closed). */
+  POLL_HANGUP=0x08, /**< Hang up (e.g., the write end of a pipe is closed). */
+  POLL_INVALID=0x10 /**< The file id is invalid. */
+} poll_event;
+
+/** @brief A stream polled by @c Poll. */
+typedef struct pollfd_s {
+	Fid_t fd;			/**< The stream to poll, or @c NOFILE to ignore this entry */
+	short events;		/**< The events of interest, @c POLL_READ and/or @c POLL_WRITE */
+	short revents;		/**< The events that occurred, set by @c Poll */
+} pollfd_t;
+
+/** @brief Wait for some of a number of streams to become ready for I/O.
+
+   For each element of @c fds, this call checks the stream @c fd for the 
+   events in @c events, and stores the events that occurred in @c revents.
+   Events @c POLL_ERROR, @c POLL_HANGUP and @c POLL_INVALID are always reported, even 
+   if they are not in @c events. Entries whose @c fd is @c NOFILE are ignored.
+
+   If no stream is ready, the call blocks until one becomes ready, or 
+   until @c timeout milliseconds have passed. A timeout of 0 returns 
+   immediately, and a timeout of @c (timeout_t)-1 waits for ever.
+
+   Pipes, sockets (listeners report @c POLL_READ when a connection can be 
+   accepted), serial devices and the null device can be polled. Other 
+   streams are always ready.
+
+  @param fds an array of @c nfds streams
+  @param nfds the number of streams
+  @param timeout the time to wait, in milliseconds
+  @return the number of elements of @c fds with a non-zero @c revents,
+    0 on timeout, or -1 on error. Possible reasons for error:
+    - @c fds is NULL while @c nfds is positive.
+    - @c nfds is larger than the number of file ids of the process 
+      (see @c SetFidLimit).
+ */
+int Poll(pollfd_t* fds, unsigned int nfds, timeout_t timeout);
+
+
+/**
+   @brief Event queue control operations.
+
+   These constants are the legal values for the second argument of @c EventCtl.
+
+   @see EventCtl
+*/
+typedef enum {
+  EVENT_ADD=1,    /**< Add a stream to the event queue. */
+  EVENT_MOD=2,    /**< Change the events and data of a stream in the event queue. */
+  EVENT_DEL=3     /**< Remove a stream from the event queue. */
+} eventctl_op;
+
+/** @brief An event returned by @c EventWait. */
+typedef struct event_s {
+	short events;		/**< The @c poll_event bits of the stream */
+	void* data;			/**< The data given to @c EventCtl for the stream */
+} event_t;
+
+/** @brief Create an event queue.
+
+   An event queue holds a set of streams, registered by @c EventCtl, and
+   returns their events with @c EventWait. Unlike @c Poll, the streams are 
+   registered once, and the cost of a wait depends only on the number of 
+   events returned.
+
+   The event queue is edge-triggered: a stream is reported when it may have 
+   become ready (e.g., when data arrives at an empty pipe) since it was last
+   reported, and not again until its state changes anew. Therefore, a stream 
+   should be read (or written) until it is drained (or full), before waiting
+   for more events.
+
+   The event queue is closed by @c Close, like other streams. It cannot be 
+   read or written.
+
+   @returns a file id for the event queue, or @c NOFILE if the file ids of the
+     process are exhausted.
+ */
+Fid_t EventQueue();
+
+/** @brief Add, change or remove a stream of an event queue.
+
+   Operation @c EVENT_ADD registers the stream @c fd with the events of 
+   interest @c events (@c POLL_READ and/or @c POLL_WRITE) and some user
+   data, returned with its events. If the stream is ready, its events are 
+   reported at the next wait. The event queue does not hold the stream open:
+   when the last file id of the stream is closed, the stream is removed from
+   the event queue, as if by @c EVENT_DEL.
+
+   Operation @c EVENT_MOD changes the events and the data of a registered
+   stream, and checks it again for readiness.  Operation @c EVENT_DEL removes 
+   a stream; the @c events and @c data arguments are ignored.
+
+   @param eq the event queue
+   @param op the operation
+   @param fd the stream
+   @param events the events of interest
+   @param data user data, returned with the events of the stream
+   @returns 0 on success and -1 on error. Possible reasons for error:
+     - @c eq is not an event queue, or @c fd is not a legal file id.
+     - @c fd is an event queue.
+     - the stream is already registered (@c EVENT_ADD) or is not registered 
+       (@c EVENT_MOD, @c EVENT_DEL).
+     - @c op is illegal.
+ */
+int EventCtl(Fid_t eq, eventctl_op op, Fid_t fd, int events, void* data);
+
+/** @brief Wait for events at an event queue.
+
+   This call returns the events of up to @c maxevents streams of the event
+   queue, blocking until there is at least one, or until @c timeout 
+   milliseconds have passed. A timeout of 0 returns immediately, and a 
+   timeout of @c (timeout_t)-1 waits for ever. As with @c Poll, events 
+   @c POLL_ERROR and @c POLL_HANGUP are always reported.
+
+   @param eq the event queue
+   @param events an array of @c maxevents events, to return the events
+   @param maxevents the maximum number of events to return
+   @param timeout the time to wait, in milliseconds
+   @returns the number of events stored in @c events, 0 on timeout, or -1 on 
+     error. Possible reasons for error:
+     - @c eq is not an event queue.
+     - @c events is NULL or @c maxevents is 0.
+ */
+int EventWait(Fid_t eq, event_t* events, unsigned int maxevents, timeout_t timeout);
+
+
 /** @brief Close a file id.
    
 
@@ -486,9 +727,91 @@ int Close(Fid_t fd);
   Possible reasons for failure:
   - Either oldfd or newfd is invalid.
   - oldfd is not an open file.
+  - newfd is being opened by another thread of the process.
  */
 int Dup2(Fid_t oldfd, Fid_t newfd);
 
+
+/** @brief Set the number of file ids of the process.
+
+  Initially, the legal file ids of a process are 0 to @c MAX_FILEID-1.
+  This call makes them 0 to @c limit-1, for up to @c MAX_FID_LIMIT
+  open files. New file ids are always the lowest ones that are free.
+  A process created by @c Exec inherits the limit of its parent.
+
+  @param limit the new number of file ids
+  @return This call returns 0 on success and -1 on failure.
+  Possible reasons for failure:
+  - @c limit is 0 or larger than @c MAX_FID_LIMIT.
+  - A file id at or above @c limit is in use.
+ */
+int SetFidLimit(unsigned int limit);
+
+
+/** @brief Move data from one stream to another.
+
+  Read up to @c len bytes from @c fid_in and write them to @c fid_out,
+  without copying them to user space. Like @c Read, the call blocks until
+  some data is available at @c fid_in, and then moves what is available, 
+  up to @c len bytes. Data buffered in a pipe or a connected socket is 
+  written to @c fid_out directly from the pipe buffer.
+
+  If either stream is non-blocking (see @c FID_NONBLOCK) and the call would
+  block on it, it returns @c WOULD_BLOCK. A non-blocking @c fid_out is not
+  waited for: no more is read than it takes without waiting.
+
+  @param fid_in the file id to read from
+  @param fid_out the file id to write to
+  @param len the maximum number of bytes to move
+  @return The number of bytes moved, 0 at the end of data of @c fid_in,
+  or -1 on failure. Possible reasons for failure:
+  - Either file id is invalid.
+  - @c fid_in cannot be read or @c fid_out cannot be written.
+  - @c len is 0.
+  - @c fid_out is the write end of the pipe @c fid_in reads from.
+  - There was an I/O runtime problem at either stream.
+ */
+int Splice(Fid_t fid_in, Fid_t fid_out, unsigned int len);
+
+
+/** @brief The stream is non-blocking.
+
+  A flag of a file id, set by @c SetFidFlags, or at creation by @c PipeWithFlags
+  and @c SocketWithFlags. It belongs to the stream, and so it is shared by the
+  copies of the file id made by @c Dup2.
+
+  On a non-blocking stream, a call that would block returns @c WOULD_BLOCK
+  instead. This applies to @c Read, @c ReadV, @c Write, @c WriteV,
+  @c Splice and @c Accept. A write that can only be done in part returns the
+  bytes written. Use @c Poll or an event queue to wait for the stream to
+  become ready.
+ */
+#define FID_NONBLOCK 0x01
+
+/** @brief The return value of a call on a non-blocking stream that would block.
+
+  It is distinct from the error value -1 and from all file ids.
+  @see FID_NONBLOCK
+ */
+#define WOULD_BLOCK (-2)
+
+/** @brief Return the flags of a file id.
+
+  @param fd the file id
+  @returns the flags (e.g., @c FID_NONBLOCK), or -1 if @c fd is not a legal file id.
+ */
+int GetFidFlags(Fid_t fd);
+
+/** @brief Set the flags of a file id.
+
+  @param fd the file id
+  @param flags the new flags, a combination of @c FID_NONBLOCK
+  @returns 0 on success, or -1 on error. Possible reasons for error:
+    - @c fd is not a legal file id.
+    - @c flags contains unknown flags.
+ */
+int SetFidFlags(Fid_t fd, int flags);
+
 /*******************************************
  *
  * Pipes
@@ -516,8 +839,8 @@ typedef struct pipe_s {
 
 	A pipe is a one-directional buffer accessed via two file ids,
 	one for each end of the buffer. The size of the buffer is 
-	implementation-specific, but can be assumed to be between 4 and 16 
-	kbytes. 
+	adaptive, between 4 and 256 kbytes, but can be set by 
+	@c SetPipeCapacity(). 
 
 	Once a pipe is constructed, it remains operational as long as both
 	ends are open. If the read end is closed, the write end becomes 
@@ -531,6 +854,43 @@ typedef struct pipe_s {
 */
 int Pipe(pipe_t* pipe);
 
+/**
+	@brief Construct and return a pipe, with the given file id flags.
+
+	This is like @c Pipe(), with @c flags (e.g., @c FID_NONBLOCK) set on
+	both ends of the pipe.
+
+	@param pipe a pointer to a pipe_t structure for storing the file ids.
+	@param flags the flags of the two file ids
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- the available file ids for the process are exhausted.
+		- @c flags contains unknown flags.
+	@see SetFidFlags
+*/
+int PipeWithFlags(pipe_t* pipe, int flags);
+
+/**
+	@brief Set the capacity of a pipe.
+
+	By default, a pipe is adaptive: its buffer starts at 4 kbytes, grows up to 256 kbytes
+	while the writer keeps filling it, and shrinks back when the reader keeps up with the
+	writer. A pipe allocates its buffer only when data is first written to it.
+
+	This call sets a fixed capacity for the pipe instead, rounded up to a power of two
+	between 512 bytes and 1 Mbyte, or makes it adaptive again if @c capacity is 0.
+	If the pipe holds more data than the new capacity, the change takes
+	effect when the data has been read.
+
+	The call can be made on either end of the pipe. For a connected socket, it 
+	applies to the data received by the socket.
+
+	@param fid the file id of a pipe end or a connected socket
+	@param capacity the new capacity, in bytes, or 0 for an adaptive capacity
+	@returns 0 on success, or -1 on error. Possible reasons for error:
+		- @c fid is not a legal file id of a pipe end or a connected socket.
+*/
+int SetPipeCapacity(Fid_t fid, unsigned int capacity);
+
 /*******************************************
  *
  * Sockets (local)
@@ -571,6 +931,148 @@ typedef int16_t port_t;
 */
 Fid_t Socket(port_t port);
 
+/**
+	@brief Return a new socket bound on a port, with the given file id flags.
+
+	This is like @c Socket(), with @c flags (e.g., @c FID_NONBLOCK) set on
+	the new file id. The sockets returned by @c Accept() do not inherit the
+	flags of the listener.
+
+	@param port the port the new socket will be bound to
+	@param flags the flags of the file id
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is iilegal
+		- the available file ids for the process are exhausted
+		- @c flags contains unknown flags.
+	@see SetFidFlags
+*/
+Fid_t SocketWithFlags(port_t port, int flags);
+
+/**
+	@brief Socket types.
+*/
+typedef enum {
+	SOCK_STREAM,		/**< A byte stream, like a pair of pipes; the type of @c Socket() */
+	SOCK_SEQPACKET,		/**< A sequence of messages, which keep their boundaries */
+	SOCK_RING			/**< A byte stream through rings shared with the program, see @c SocketRing() */
+} sock_type;
+
+/**
+	@brief The largest message of a @c SOCK_SEQPACKET socket, in bytes.
+*/
+#define MAX_MESSAGE 1024
+
+/**
+	@brief Return a new socket of a given type, bound on a port.
+
+	This is like @c Socket(), for a socket of type @c type. 
+
+	A socket of type @c SOCK_SEQPACKET listens for, and connects to, only 
+	sockets of the same type; the sockets returned by @c Accept() have the
+	type of the listener. When connected, each @c Write() or @c WriteV()
+	sends one message of up to @c MAX_MESSAGE bytes (larger ones fail),
+	and each @c Read() or @c ReadV() receives one whole message. If the 
+	message is larger than the buffers of the read, the rest of it is 
+	discarded. A bounded number of messages can be in transit in each 
+	direction; a writer blocks while they are all pending. 
+
+	@param port the port the new socket will be bound to
+	@param type the type of the socket
+	@returns a file id for the new socket, or NOFILE on error. Possible
+		reasons for error:
+		- the port is iilegal
+		- the type is illegal
+		- the available file ids for the process are exhausted
+*/
+Fid_t SocketWithType(port_t port, sock_type type);
+
+/**
+	@brief Return two sockets connected to each other.
+
+	This call makes two new sockets of type @c type, not bound to a port,
+	and connects them to each other, as if one had connected to a listener 
+	and the other had been returned by @c Accept(). They are stored in 
+	@c pair[0] and @c pair[1].
+
+	@param type the type of the sockets
+	@param pair an array of two file ids, where the sockets are returned
+	@returns 0 on success and -1 on error. Possible reasons for error:
+		- the type is illegal
+		- the available file ids for the process are exhausted
+*/
+int SocketPair(sock_type type, Fid_t pair[2]);
+
+/**
+	@brief The size of each ring of a connected @c SOCK_RING socket, in bytes.
+*/
+#define SOCKET_RING_SIZE (64*1024)
+
+/**
+	@brief A single-producer/single-consumer byte ring.
+
+	Two connected sockets of type @c SOCK_RING share two rings, one in
+	each direction, which the program can use directly (see 
+	@c SocketRing()). The bytes of the ring are those from @c head to 
+	@c tail, at positions modulo @c size in @c data. The writer of the
+	ring copies data in and then advances @c tail; the reader takes data
+	out, in place, and then advances @c head. Both update their counter
+	atomically, with release semantics, and read the other's with 
+	acquire semantics.
+
+	While the reader of a ring may sleep, @c reader_waiting is set, and
+	after advancing @c tail the writer must call @c RingWake(); likewise 
+	for @c writer_waiting and the reader. The helpers in tinyoslib.h
+	follow this protocol.
+*/
+typedef struct socket_ring {
+	unsigned int head;		/**< @brief Bytes taken out; advanced by the reader */
+	unsigned int tail;		/**< @brief Bytes put in; advanced by the writer */
+	unsigned int size;		/**< @brief The size of @c data, a power of two */
+	int reader_waiting;		/**< @brief Set while the reader may sleep */
+	int writer_waiting;		/**< @brief Set while the writer may sleep */
+	int reader_closed;		/**< @brief Set when the reader is gone */
+	int writer_closed;		/**< @brief Set when the writer is gone */
+	char* data;				/**< @brief The buffer */
+} socket_ring;
+
+/**
+	@brief Return the rings of a connected @c SOCK_RING socket.
+
+	Connected sockets of type @c SOCK_RING send data through two rings in 
+	memory that their programs share (@c send of one socket is @c recv 
+	of the other). Using the rings directly, the program can read data in 
+	place, without copying it out, and make a kernel call only to sleep 
+	(by @c Poll() on the socket) or to wake up the other side (by 
+	@c RingWake()).
+
+	@c Read() and @c Write() also work on these sockets, through the rings.
+	Each ring has a single reader and a single writer: the program must not
+	read (or write) a socket both directly and by calls at the same time. 
+	The rings remain valid while either of the sockets is open.
+
+	@param sock the socket
+	@param send where the ring to the other socket is returned
+	@param recv where the ring from the other socket is returned
+	@returns 0 on success and -1 on error. Possible reasons for error:
+		- the file id @c sock is not a connected socket of type @c SOCK_RING
+*/
+int SocketRing(Fid_t sock, socket_ring** send, socket_ring** recv);
+
+/**
+	@brief Wake up the other side of a @c SOCK_RING connection.
+
+	This is called after advancing the @c tail of the @c send ring, or the
+	@c head of the @c recv ring, of socket @c sock, if the other side was 
+	waiting for it. It clears @c reader_waiting of @c send and 
+	@c writer_waiting of @c recv, and wakes up the other socket's pollers.
+
+	@param sock the socket
+	@returns 0 on success and -1 on error. Possible reasons for error:
+		- the file id @c sock is not a connected socket of type @c SOCK_RING
+*/
+int RingWake(Fid_t sock);
+
 /**
 	@brief Initialize a socket as a listening socket.
 
@@ -581,7 +1083,8 @@ Fid_t Socket(port_t port);
 
 	The socket must be bound to a port, as a result of calling @c Socket.
 	On each port there must be a unique listening socket (although any number
-	of non-listening sockets are allowed).
+	of non-listening sockets are allowed), unless the listeners of the port
+	are made by @c ListenShared().
 
 	@param sock the socket to initialize as a listening socket
 	@returns 0 on success, -1 on error. Possible reasons for error:
@@ -590,9 +1093,65 @@ Fid_t Socket(port_t port);
 		- the port bound to the socket is occupied by another listener
 		- the socket has already been initialized
 	@see Socket
+	@see ListenWithBacklog
  */
 int Listen(Fid_t sock);
 
+/**
+	@brief The backlog of a socket initialized by @c Listen().
+*/
+#define DEFAULT_BACKLOG 128
+
+/**
+	@brief The largest backlog accepted by @c ListenWithBacklog().
+*/
+#define MAX_BACKLOG 4096
+
+/**
+	@brief Initialize a socket as a listening socket, with a given backlog.
+
+	This is like @c Listen(), but at most @c backlog connection requests
+	can be pending on the listener, waiting for @c Accept(). While the 
+	backlog is full, @c Connect() to the port fails immediately, instead
+	of waiting for its timeout.
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the number of pending connection requests, from 1 to 
+		@c MAX_BACKLOG
+	@returns 0 on success, -1 on error. Possible reasons for error:
+		- any of the reasons of @c Listen()
+		- the backlog is out of range
+	@see Listen
+ */
+int ListenWithBacklog(Fid_t sock, unsigned int backlog);
+
+/**
+	@brief Initialize a socket as a listening socket, which shares its port.
+
+	This is like @c ListenWithBacklog(), but any number of sockets bound to
+	the same port can listen on it this way, e.g., one per accepting thread.
+	Each @c Connect() to the port is queued to the listener with the fewest
+	pending requests, taking turns among equals, and wakes up only the
+	threads accepting on that listener. When a shared listener is closed,
+	its pending requests move to the other listeners of the port, as far 
+	as their backlogs allow.
+
+	A port cannot have both shared listeners and a listener made by
+	@c Listen() or @c ListenWithBacklog().
+
+	@param sock the socket to initialize as a listening socket
+	@param backlog the number of pending connection requests, from 1 to 
+		@c MAX_BACKLOG
+	@returns 0 on success, -1 on error. Possible reasons for error:
+		- the file id is not legal
+		- the socket is not bound to a port
+		- the port has a listener which is not shared, or of another type
+		- the socket has already been initialized
+		- the backlog is out of range
+	@see ListenWithBacklog
+ */
+int ListenShared(Fid_t sock, unsigned int backlog);
+
 
 /**
 	@brief Wait for a connection.
@@ -613,6 +1172,8 @@ int Listen(Fid_t sock);
 		- the file id is not initialized by @c Listen()
 		- the available file ids for the process are exhausted
 		- while waiting, the listening socket @c lsock was closed
+	    If @c lsock is non-blocking and there is no pending request, the call 
+	    returns @c WOULD_BLOCK.
 
 	@see Connect
 	@see Listen
@@ -634,7 +1195,7 @@ Fid_t Accept(Fid_t lsock);
 	The connect call will block for approximately the specified amount of time.
 	The resolution of this timeout is implementation specific, but should be
 	in the order of 100's of msec. Therefore, a timeout of at least 500 msec is
-	reasonable. If a negative timeout is given, it means, "infinite timeout".
+	reasonable. A timeout of @c (timeout_t)-1 means "infinite timeout".
 
 	@params sock the socket to connect to the other end
 	@params port the port on which to seek a listening socket
@@ -644,6 +1205,8 @@ Fid_t Accept(Fid_t lsock);
 	   - the file id @c sock is not legal (i.e., an unconnected, non-listening socket)
 	   - the given port is illegal.
 	   - the port does not have a listening socket bound to it by @c Listen.
+	   - the listening socket is of another type (see @c SocketWithType).
+	   - the backlog of the listening socket is full.
 	   - the timeout has expired without a successful connection.
 */
 int Connect(Fid_t sock, port_t port, timeout_t timeout);
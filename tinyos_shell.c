@@ -254,8 +254,8 @@ int Fibonacci(size_t argc, const char** argv)
 int Capitalize(size_t argc, const char** argv)
 {
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r");
+	FILE* fout = fidopen_buffered(1, "w");
 	while((c=fgetc(fin))!=EOF) {
 		fputc(toupper(c), fout);
 	}
@@ -267,7 +267,7 @@ int Capitalize(size_t argc, const char** argv)
 
 int Echo(size_t argc, const char** argv)
 {
-	FILE* fout = fidopen(1, "w");
+	FILE* fout = fidopen_buffered(1, "w");
 	for(size_t i=1; i<argc; i++) {
 		if(i>1) fputs(" ", fout);
 		fprintf(fout,"%s", argv[i]);
@@ -281,8 +281,8 @@ int Echo(size_t argc, const char** argv)
 int LowerCase(size_t argc, const char** argv)
 {
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r");
+	FILE* fout = fidopen_buffered(1, "w");
 	while((c=fgetc(fin))!=EOF) {
 		fputc(tolower(c), fout);
 	}
@@ -295,8 +295,8 @@ int LowerCase(size_t argc, const char** argv)
 int LineEnum(size_t argc, const char** argv)
 {
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r");
+	FILE* fout = fidopen_buffered(1, "w");
 	int atend=1;
 	size_t count=0;
 	while((c=fgetc(fin))!=EOF) {
@@ -325,8 +325,8 @@ int More(size_t argc, const char** argv)
 	}
 
 	char c;
-	FILE* fin = fidopen(0, "r");
-	FILE* fout = fidopen(1, "w");
+	FILE* fin = fidopen_buffered(0, "r");
+	FILE* fout = fidopen_buffered(1, "w");
 	FILE* fkbd = fidopen(1, "r");
 
 	int atend=1;
@@ -339,6 +339,7 @@ int More(size_t argc, const char** argv)
 			if(count % page == 0) {
 				/* Here, we have to use getline, unless we change terminal */
 				fprintf(fout, "press enter to continue:");
+				fflush(fout);
 				(void)getline(&_line, &_lno, fkbd);
 			}
 		}
@@ -361,7 +362,7 @@ int WordCount(size_t argc, const char** argv)
 	nchar = nword = nline = 0;
 	int wspace = 1;
 	char c;
-	FILE* fin = fidopen(0, "r");
+	FILE* fin = fidopen_buffered(0, "r");
 	while((c=fgetc(fin))!=EOF) {
 		nchar++;
 		if(wspace && !isblank(c)) {
@@ -760,14 +761,8 @@ int RemoteClient(size_t argc, const char** argv)
 	ShutDown(sock, SHUTDOWN_WRITE);
 
 	/* Read the server data and display */
-	char c;
-	FILE* fin = fidopen(sock, "r");
-	FILE* fout = fidopen(1, "w");
-	while((c=fgetc(fin))!=EOF) {
-		fputc(c, fout);
-	}
-	fclose(fin);
-	fclose(fout);
+	while(Splice(sock, 1, 4096) > 0);
+	Close(sock);
 	return 0;
 }
 
@@ -11,20 +11,48 @@
 
 
 
+/*
+	The cookie of a stream opened by fidopen. Buffered streams are also
+	kept in a list, so that the streams a process leaves open are flushed
+	and closed by its exit hook.
+ */
+typedef struct fid_stream {
+	Fid_t fid;
+	Pid_t owner;			/* The process that opened the stream */
+	FILE* file;
+	rlnode node;			/* Node in buffered_streams, or alone */
+} fid_stream;
+
+static rlnode buffered_streams = { .obj=NULL, .prev=&buffered_streams, .next=&buffered_streams };
+static Mutex buffered_streams_lock = MUTEX_INIT;
+
+
 static ssize_t tinyos_fid_read(void *cookie, char *buf, size_t size)
 {
-	return Read(*(Fid_t*)cookie, buf, size); 
+	return Read(((fid_stream*)cookie)->fid, buf, size); 
 }
 
 static ssize_t tinyos_fid_write(void *cookie, const char *buf, size_t size)
 {
-	int ret = Write(*(Fid_t*)cookie, buf, size); 
-	return (ret<0) ? 0 : ret;
+	Fid_t fid = ((fid_stream*)cookie)->fid;
+
+	/* A buffered stream may pass more than a pipe takes in one call */
+	size_t count = 0;
+	while(count < size) {
+		int ret = Write(fid, buf+count, size-count); 
+		if(ret <= 0) break;
+		count += ret;
+	}
+	return count;
 }
 
 static int tinyos_fid_close(void* cookie)
 {
-	free(cookie);
+	fid_stream* fs = cookie;
+	Mutex_Lock(&buffered_streams_lock);
+	rlist_remove(&fs->node);
+	Mutex_Unlock(&buffered_streams_lock);
+	free(fs);
 	return 0;
 }
 
@@ -46,15 +74,71 @@ static FILE* get_std_stream(int fid, const char* mode)
 }
 
 
+static fid_stream* fid_stream_open(Fid_t fid, const char* mode, int buffering)
+{
+	fid_stream* fs = (fid_stream*) malloc(sizeof(fid_stream));
+	fs->fid = fid;
+	fs->owner = GetPid();
+	rlnode_init(&fs->node, fs);
+
+	fs->file = fopencookie(fs, mode, tinyos_fid_functions);
+	if(fs->file==NULL) {
+		free(fs);
+		return NULL;
+	}
+	CHECKRC(setvbuf(fs->file, NULL, buffering, (buffering==_IONBF) ? 0 : BUFSIZ));
+	return fs;
+}
+
+
 FILE* fidopen(Fid_t fid, const char* mode)
 {
+	fid_stream* fs = fid_stream_open(fid, mode, _IONBF);
+	return fs ? fs->file : NULL;
+}
+
+
+FILE* fidopen_buffered(Fid_t fid, const char* mode)
+{
+	int term = IsTerminal(fid);
+	if(term < 0)
+		return NULL;
 
-	Fid_t* fidloc = (Fid_t *) malloc(sizeof(Fid_t));
-	* fidloc = fid;
-	FILE* f = fopencookie(fidloc, mode, tinyos_fid_functions);
+	fid_stream* fs = fid_stream_open(fid, mode, term ? _IOLBF : _IOFBF);
+	if(fs==NULL)
+		return NULL;
 
-	CHECKRC(setvbuf(f, NULL, _IONBF, 0));
-	return f;
+	Mutex_Lock(&buffered_streams_lock);
+	rlist_push_back(&buffered_streams, &fs->node);
+	Mutex_Unlock(&buffered_streams_lock);
+
+	/* The process drops its streams when it exits, before its pid can be reused */
+	SetExitHook(fidclose_all);
+	return fs->file;
+}
+
+
+void fidclose_all(void)
+{
+	Pid_t pid = GetPid();
+
+	/* Take the streams of the process off the list, then close them */
+	rlnode mine;
+	rlnode_new(&mine);
+	Mutex_Lock(&buffered_streams_lock);
+	rlnode* n = buffered_streams.next;
+	while(n != &buffered_streams) {
+		rlnode* next = n->next;
+		if(((fid_stream*)n->obj)->owner == pid)
+			rlist_push_back(&mine, rlist_remove(n));
+		n = next;
+	}
+	Mutex_Unlock(&buffered_streams_lock);
+
+	while(! is_rlist_empty(&mine)) {
+		fid_stream* fs = rlist_pop_front(&mine)->obj;
+		fclose(fs->file);
+	}
 }
 
 FILE *saved_in = NULL, *saved_out = NULL;
@@ -191,3 +275,47 @@ void BarrierSync(barrier* bar, unsigned int n)
 }
 
 
+/*
+	The ring protocol: each end reads the counter of the other end with 
+	acquire semantics, and publishes its own with a sequentially consistent
+	store before it checks the waiting flag of the other end. The kernel sets
+	a flag before it looks at the counters again and sleeps, so one of the
+	two ends always sees the other.
+ */
+unsigned int ring_peek(socket_ring* ring, const char** ptr)
+{
+	unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	unsigned int head = ring->head;
+	unsigned int off = head & (ring->size - 1);
+	unsigned int n = tail - head;
+
+	*ptr = ring->data + off;
+	return (n < ring->size - off) ? n : ring->size - off;
+}
+
+void ring_consume(Fid_t sock, socket_ring* ring, unsigned int n)
+{
+	__atomic_store_n(&ring->head, ring->head + n, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->writer_waiting, __ATOMIC_SEQ_CST))
+		RingWake(sock);
+}
+
+unsigned int ring_space(socket_ring* ring, char** ptr)
+{
+	unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	unsigned int tail = ring->tail;
+	unsigned int off = tail & (ring->size - 1);
+	unsigned int n = ring->size - (tail - head);
+
+	*ptr = ring->data + off;
+	return (n < ring->size - off) ? n : ring->size - off;
+}
+
+void ring_produce(Fid_t sock, socket_ring* ring, unsigned int n)
+{
+	__atomic_store_n(&ring->tail, ring->tail + n, __ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&ring->reader_waiting, __ATOMIC_SEQ_CST))
+		RingWake(sock);
+}
+
+
@@ -16,11 +16,36 @@
 /**
     @brief Open a C stream on a tinyos file descriptor.
 
-	This call returns a new FILE pointer on success and NULL
+	The stream is unbuffered, so that each output call is written
+	out at once. This call returns a new FILE pointer on success and NULL
 	on failure.
 */
 FILE* fidopen(Fid_t fid, const char* mode);
 
+/**
+    @brief Open a buffered C stream on a tinyos file descriptor.
+
+	The stream is line buffered if @c fid is a terminal, and fully buffered
+	otherwise (e.g., for pipes and sockets), so that output takes far fewer
+	@c Write calls. Output is written out by @c fflush() and @c fclose().
+	Buffered input may read ahead of what the program consumes.
+
+	The buffered streams a process leaves open are flushed and closed when 
+	it exits, by an exit hook (see @c SetExitHook) that this call installs.
+
+	This call returns a new FILE pointer on success and NULL
+	on failure.
+*/
+FILE* fidopen_buffered(Fid_t fid, const char* mode);
+
+/**
+	@brief Flush and close the buffered streams of the current process.
+
+	This closes the streams opened by @c fidopen_buffered in the current
+	process, which have not been closed.
+*/
+void fidclose_all(void);
+
 void tinyos_replace_stdio();
 void tinyos_restore_stdio();
 void tinyos_pseudo_console();
@@ -86,4 +111,38 @@ typedef struct barrier {
 void BarrierSync(barrier* bar, unsigned int n);
 
 
+/**
+	@brief Return the readable bytes of a ring, in place.
+
+	The bytes at @c *ptr, up to the returned count, can be read in place
+	until they are consumed by @c ring_consume(). The count stops at the end
+	of the buffer of the ring; the rest is returned after that is consumed.
+	A count of 0 means that the ring is empty: if @c writer_closed is set,
+	this is the end of the data, else the program may sleep by @c Poll().
+
+	@param ring the @c recv ring of a socket (see @c SocketRing)
+	@param ptr where the address of the bytes is returned
+	@returns the number of bytes at @c *ptr
+*/
+unsigned int ring_peek(socket_ring* ring, const char** ptr);
+
+/**
+	@brief Consume bytes returned by @c ring_peek(), waking up the writer if needed.
+*/
+void ring_consume(Fid_t sock, socket_ring* ring, unsigned int n);
+
+/**
+	@brief Return the writable space of a ring, in place.
+
+	Like @c ring_peek(), for the @c send ring of a socket. A count of 0 
+	means that the ring is full.
+*/
+unsigned int ring_space(socket_ring* ring, char** ptr);
+
+/**
+	@brief Send bytes written at the space returned by @c ring_space(), waking up the reader if needed.
+*/
+void ring_produce(Fid_t sock, socket_ring* ring, unsigned int n);
+
+
 #endif
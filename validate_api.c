@@ -2631,11 +2631,1408 @@ BARE_TEST(dummy_user_test,
 }
 
 
+static int timed_waiter(int argl, void* args)
+{
+	timeout_t t = (timeout_t) argl;
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+
+	struct timespec t1, t2;
+	clock_gettime(CLOCK_REALTIME, &t1);
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, t);
+	Mutex_Unlock(&mx);
+
+	clock_gettime(CLOCK_REALTIME, &t2);
+
+	unsigned long Dt = tspec2msec(t2)-tspec2msec(t1);
+
+	/* The kernel clock is coarse (a few msec), and so is the check */
+	ASSERT(Dt+5 >= t);
+	ASSERT(Dt <= t + t/5 + 30);
+	return 0;
+}
+
+BOOT_TEST(test_timeouts_across_wheel_levels,
+	"Test that many concurrent timed waits, on every level of the timer wheel, expire on time."
+	)
+{
+	static const timeout_t T[] = { 1, 5, 30, 70, 250, 1500, 4500 };
+	Tid_t tids[5*sizeof(T)/sizeof(T[0])];
+	int n = 0;
+
+	for(int r=0; r<5; r++)
+		for(unsigned i=0; i<sizeof(T)/sizeof(T[0]); i++)
+			tids[n++] = CreateThread(timed_waiter, T[i]+r, NULL);
+
+	for(int i=0; i<n; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
+static int thread_churner(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Tid_t t = CreateThread(void_child, 0, NULL);
+		ASSERT(t != NOTHREAD);
+		ASSERT(ThreadJoin(t, NULL)==0);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_thread_create_join_churn,
+	"Test that threads can be created and joined repeatedly by many threads at once, "
+	"so that thread blocks are recycled across cores."
+	)
+{
+	Tid_t tids[8];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(thread_churner, 200, NULL);
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	return 0;
+}
+
+
+static int deep_stack_user(int argl, void* args)
+{
+	/* Use argl bytes of stack */
+	volatile char buf[argl];
+	for(int i=0; i<argl; i+=512) buf[i] = (char)i;
+	for(int i=0; i<argl; i+=512) ASSERT(buf[i] == (char)i);
+	return argl;
+}
+
+BOOT_TEST(test_thread_stack_size,
+	"Test that CreateThreadWithStack gives threads stacks of the requested size, "
+	"both larger and smaller than the default."
+	)
+{
+	int exitval;
+
+	/* A stack larger than the default 128 kbytes */
+	Tid_t t = CreateThreadWithStack(deep_stack_user, 1024*1024, NULL, 2*1024*1024);
+	ASSERT(t != NOTHREAD);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 1024*1024);
+
+	/* Many threads with small stacks */
+	Tid_t tids[200];
+	for(int i=0; i<200; i++) {
+		tids[i] = CreateThreadWithStack(deep_stack_user, 4096, NULL, 16*1024);
+		ASSERT(tids[i] != NOTHREAD);
+	}
+	for(int i=0; i<200; i++) {
+		ASSERT(ThreadJoin(tids[i], &exitval)==0);
+		ASSERT(exitval == 4096);
+	}
+
+	/* The default is used for 0 */
+	t = CreateThreadWithStack(deep_stack_user, 64*1024, NULL, 0);
+	ASSERT(ThreadJoin(t, &exitval)==0);
+	ASSERT(exitval == 64*1024);
+	return 0;
+}
+
+
+static Mutex contended_mx = MUTEX_INIT;
+static int contended_inside = 0;
+static int contended_count = 0;
+
+static int mutex_contender(int argl, void* args)
+{
+	for(int i=0; i<argl; i++) {
+		Mutex_Lock(&contended_mx);
+		ASSERT(contended_inside++ == 0);
+		/* Make the critical section long enough to be preempted in */
+		for(volatile int j=0; j<200; j++);
+		contended_count++;
+		ASSERT(--contended_inside == 0);
+		Mutex_Unlock(&contended_mx);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_mutex_contention,
+	"Test that a Mutex contended by many threads provides mutual exclusion, and "
+	"that threads blocked on it are woken up to lock it in turn."
+	)
+{
+	Tid_t tids[16];
+	for(int i=0; i<16; i++)
+		tids[i] = CreateThread(mutex_contender, 5000, NULL);
+	for(int i=0; i<16; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+	ASSERT(contended_count == 16*5000);
+	return 0;
+}
+
+
+static int pipe_ponger(int argl, void* args)
+{
+	pipe_t* p = args;
+	char c;
+	for(int i=0; i<argl; i++) {
+		ASSERT(Read(p[0].read, &c, 1)==1);
+		ASSERT(c == (char)i);
+		ASSERT(Write(p[1].write, &c, 1)==1);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_pipe_ping_pong,
+	"Test a round-trip exchange of single bytes between two threads, over a pair of pipes."
+	)
+{
+	pipe_t p[2];
+	ASSERT(Pipe(&p[0])==0);
+	ASSERT(Pipe(&p[1])==0);
+
+	const int N = 20000;
+	Tid_t t = CreateThread(pipe_ponger, N, p);
+	for(int i=0; i<N; i++) {
+		char c = (char)i;
+		ASSERT(Write(p[0].write, &c, 1)==1);
+		ASSERT(Read(p[1].read, &c, 1)==1);
+		ASSERT(c == (char)i);
+	}
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+static int pattern_writer(int argl, void* args)
+{
+	Fid_t w = *(Fid_t*)args;
+	char buf[5000];
+	for(int i=0; i<argl; ) {
+		int n = (argl-i < 5000) ? argl-i : 5000;
+		for(int j=0; j<n; j++) buf[j] = (char)((i+j)%251);
+		ASSERT(Write(w, buf, n)==n);
+		i += n;
+	}
+	Close(w);
+	return 0;
+}
+
+/* Read a pattern_writer stream to EOF, returning the largest single read */
+static int pattern_read(Fid_t r, int nbytes)
+{
+	static char buf[1<<20];
+	int count = 0, maxread = 0, rc;
+	while((rc = Read(r, buf, sizeof(buf))) > 0) {
+		for(int j=0; j<rc; j++) ASSERT(buf[j] == (char)((count+j)%251));
+		count += rc;
+		if(rc > maxread) maxread = rc;
+	}
+	ASSERT(rc == 0);
+	ASSERT(count == nbytes);
+	return maxread;
+}
+
+BOOT_TEST(test_pipe_capacity,
+	"Test that SetPipeCapacity bounds the data buffered in a pipe, and that adaptive pipes "
+	"transfer data intact while resizing."
+	)
+{
+	pipe_t p;
+	Tid_t t;
+
+	/* A small fixed capacity: no read can return more than that */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SetPipeCapacity(p.read, 1000)==0);
+	t = CreateThread(pattern_writer, 200000, &p.write);
+	ASSERT(pattern_read(p.read, 200000) <= 1024);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(p.read);
+
+	/* Adaptive, the default */
+	ASSERT(Pipe(&p)==0);
+	t = CreateThread(pattern_writer, 3000000, &p.write);
+	ASSERT(pattern_read(p.read, 3000000) <= 256*1024);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(p.read);
+
+	/* A large fixed capacity, set on the write end */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(SetPipeCapacity(p.write, 1<<20)==0);
+	t = CreateThread(pattern_writer, 3000000, &p.write);
+	ASSERT(pattern_read(p.read, 3000000) <= 1<<20);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(p.read);
+
+	/* Only pipes and connected sockets have a capacity */
+	ASSERT(SetPipeCapacity(NOFILE, 0)==-1);
+	ASSERT(SetPipeCapacity(MAX_FILEID, 0)==-1);
+	Fid_t null = OpenNull();
+	ASSERT(SetPipeCapacity(null, 0)==-1);
+	Close(null);
+	return 0;
+}
+
+
+BOOT_TEST(test_splice,
+	"Test that Splice moves data intact from pipes, sockets and other streams."
+	)
+{
+	pipe_t p1, p2;
+	ASSERT(Pipe(&p1)==0);
+	ASSERT(Pipe(&p2)==0);
+
+	/* Pipe to pipe: the writer fills p1, we splice it all into p2, and read p2 */
+	Tid_t t = CreateThread(pattern_writer, 1000000, &p1.write);
+
+	int rc, total = 0;
+	static char buf[4096];
+	while((rc = Splice(p1.read, p2.write, 3000)) > 0) {
+		ASSERT(rc <= 3000);
+		/* Drain p2 */
+		for(int got = 0; got < rc; ) {
+			int r = Read(p2.read, buf, sizeof(buf));
+			ASSERT(r > 0);
+			for(int j=0; j<r; j++) ASSERT(buf[j] == (char)((total+got+j)%251));
+			got += r;
+		}
+		total += rc;
+	}
+	ASSERT(rc == 0);
+	ASSERT(total == 1000000);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(p1.read);
+
+	/* Socket to pipe */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT), srv;
+	connect_sockets(cli, lsock, &srv, 100);
+	t = CreateThread(pattern_writer, 100000, &cli);
+	total = 0;
+	while((rc = Splice(srv, p2.write, 100000)) > 0) {
+		for(int got = 0; got < rc; ) {
+			int r = Read(p2.read, buf, sizeof(buf));
+			ASSERT(r > 0);
+			for(int j=0; j<r; j++) ASSERT(buf[j] == (char)((total+got+j)%251));
+			got += r;
+		}
+		total += rc;
+	}
+	ASSERT(total == 100000);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* A stream that is not a pipe: copy through the kernel */
+	Fid_t null = OpenNull();
+	ASSERT(Write(p2.write, "hello", 5)==5);
+	ASSERT(Splice(p2.read, null, 100)==5);
+	ASSERT(Splice(null, p2.write, 100)==100);	/* The null device reads zeros */
+	ASSERT(Read(p2.read, buf, sizeof(buf))==100);
+	for(int j=0; j<100; j++) ASSERT(buf[j]==0);
+
+	/* Errors */
+	ASSERT(Splice(p2.read, p2.write, 100)==-1);
+	ASSERT(Splice(p2.read, null, 0)==-1);
+	ASSERT(Splice(NOFILE, null, 10)==-1);
+	ASSERT(Splice(p2.read, MAX_FILEID, 10)==-1);
+	ASSERT(Splice(p2.write, null, 10)==-1);
+
+	/* A socket does not splice into its peer, which writes to the same pipe */
+	Fid_t pair[2];
+	ASSERT(SocketPair(SOCK_STREAM, pair)==0);
+	ASSERT(Write(pair[1], "x", 1)==1);
+	ASSERT(Splice(pair[0], pair[1], 10)==-1);
+	Close(pair[0]);
+	Close(pair[1]);
+
+	/* The input socket is shut down while the splice is blocked on a full output */
+	pipe_t p3;
+	ASSERT(Pipe(&p3)==0);
+	ASSERT(SetPipeCapacity(p3.write, 512)==0);
+	ASSERT(Write(p3.write, buf, 512)==512);
+	ASSERT(SocketPair(SOCK_STREAM, pair)==0);
+	ASSERT(Write(pair[1], buf, 2000)==2000);
+
+	int splicer(int argl, void* args)
+	{
+		ASSERT(Splice(pair[0], p3.write, 1000)==1000);
+		return 0;
+	}
+	t = CreateThread(splicer, 0, NULL);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	ASSERT(ShutDown(pair[0], SHUTDOWN_READ)==0);
+	for(total = 0; total < 512+1000; total += rc)
+		ASSERT((rc = Read(p3.read, buf, sizeof(buf))) > 0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(pair[0]);
+	Close(pair[1]);
+	Close(p3.read);
+	Close(p3.write);
+	return 0;
+}
+
+
+BOOT_TEST(test_readv_writev,
+	"Test that ReadV and WriteV move framed data intact through pipes, sockets and other streams."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	/* A header and a payload go in with one call, and come out in order */
+	unsigned int hdr = 0x12345678, hdr2 = 0;
+	char payload[100], payload2[100];
+	for(int j=0; j<100; j++) payload[j] = j;
+
+	iovec_t out[3] = { { &hdr, sizeof(hdr) }, { NULL, 0 }, { payload, sizeof(payload) } };
+	iovec_t in[2] = { { &hdr2, sizeof(hdr2) }, { payload2, sizeof(payload2) } };
+	ASSERT(WriteV(p.write, out, 3)==104);
+	ASSERT(ReadV(p.read, in, 2)==104);
+	ASSERT(hdr2==hdr);
+	ASSERT(memcmp(payload, payload2, 100)==0);
+
+	/* A short read fills the buffers in order */
+	ASSERT(WriteV(p.write, out, 3)==104);
+	in[1].len = 10;
+	ASSERT(ReadV(p.read, in, 2)==14);
+	in[0] = (iovec_t){ payload2, 50 };
+	in[1] = (iovec_t){ payload2+50, 50 };
+	ASSERT(ReadV(p.read, in, 2)==90);
+	ASSERT(memcmp(payload+10, payload2, 90)==0);
+
+	/* Frames written concurrently by many threads are not interleaved */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	Fid_t cli = Socket(NOPORT), srv;
+	connect_sockets(cli, lsock, &srv, 100);
+
+	int frame_writer(int argl, void* args)
+	{
+		Fid_t sock = *(Fid_t*)args;
+		unsigned int h = argl;
+		char body[1000];
+		memset(body, argl, sizeof(body));
+		iovec_t v[2] = { { &h, sizeof(h) }, { body, sizeof(body) } };
+		for(int i=0; i<100; i++)
+			ASSERT(WriteV(sock, v, 2)==sizeof(h)+sizeof(body));
+		return 0;
+	}
+
+	Tid_t t[4];
+	for(int i=0; i<4; i++) t[i] = CreateThread(frame_writer, i+1, &cli);
+
+	static char frame[1004];
+	for(int f=0; f<400; f++) {
+		for(int got=0; got < 1004; ) {
+			iovec_t v = { frame+got, 1004-got };
+			int r = ReadV(srv, &v, 1);
+			ASSERT(r > 0);
+			got += r;
+		}
+		unsigned int h;
+		memcpy(&h, frame, sizeof(h));
+		ASSERT(h>=1 && h<=4);
+		for(int j=4; j<1004; j++) ASSERT(frame[j]==(char)h);
+	}
+	for(int i=0; i<4; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	/* A stream without vectored operations */
+	Fid_t null = OpenNull();
+	ASSERT(WriteV(null, out, 3)==104);
+	ASSERT(ReadV(null, in, 2)==50);
+
+	/* Errors */
+	ASSERT(ReadV(p.write, in, 2)==-1);
+	ASSERT(WriteV(p.read, out, 3)==-1);
+	ASSERT(WriteV(NOFILE, out, 3)==-1);
+	ASSERT(WriteV(p.write, out, MAX_IOV+1)==-1);
+	iovec_t huge[2] = { { payload, 0x7fffffff }, { payload, 2 } };
+	ASSERT(WriteV(p.write, huge, 2)==-1);
+	Close(p.read);
+	ASSERT(WriteV(p.write, out, 3)==-1);
+	return 0;
+}
+
+
+BOOT_TEST(test_poll,
+	"Test that Poll reports readiness of pipes, sockets and devices, and that one thread can serve many sockets with it."
+	)
+{
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+
+	/* An empty pipe is writable, but not readable */
+	pollfd_t fds[3] = { 
+		{ .fd = p.read, .events = POLL_READ }, 
+		{ .fd = p.write, .events = POLL_READ|POLL_WRITE },
+		{ .fd = NOFILE, .events = POLL_READ }
+	};
+	ASSERT(Poll(fds, 3, 0)==1);
+	ASSERT(fds[0].revents==0 && fds[1].revents==POLL_WRITE && fds[2].revents==0);
+	ASSERT(Poll(fds, 1, 100)==0);
+
+	/* Wake up when data arrives */
+	int late_writer(int argl, void* args)
+	{
+		sleep_thread(1);
+		ASSERT(Write(*(Fid_t*)args, "x", 1)==1);
+		return 0;
+	}
+	Tid_t t = CreateThread(late_writer, 0, &p.write);
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+	ASSERT(fds[0].revents==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Closing the ends */
+	char c;
+	ASSERT(Read(p.read, &c, 1)==1);
+	Close(p.write);
+	ASSERT(Poll(fds, 1, 0)==1);
+	ASSERT(fds[0].revents==(POLL_READ|POLL_HANGUP));
+	ASSERT(Pipe(&p)==0);
+	Close(p.read);
+	fds[0] = (pollfd_t){ .fd = p.write, .events = POLL_WRITE };
+	ASSERT(Poll(fds, 1, 0)==1 && fds[0].revents==POLL_ERROR);
+	Close(p.write);
+
+	/* Bad file ids and the null device */
+	fds[0] = (pollfd_t){ .fd = MAX_FILEID-1, .events = POLL_READ };
+	fds[1] = (pollfd_t){ .fd = OpenNull(), .events = POLL_READ|POLL_WRITE };
+	ASSERT(Poll(fds, 2, 0)==2);
+	ASSERT(fds[0].revents==POLL_INVALID && fds[1].revents==(POLL_READ|POLL_WRITE));
+	Close(fds[1].fd);
+	ASSERT(Poll(NULL, 1, 0)==-1);
+	ASSERT(Poll(fds, MAX_FID_LIMIT+1, 0)==-1);
+	ASSERT(Poll(fds, (unsigned int)-1, 0)==-1);
+
+	/* An echo server, serving all its clients in one thread */
+	const int N = 5;		/* Both ends of each connection need a fid */
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+
+	int client(int argl, void* args)
+	{
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(Connect(sock, 100, 1000)==0);
+		for(int i=0; i<20; i++) {
+			int msg = argl*100+i, reply;
+			ASSERT(Write(sock, (char*)&msg, sizeof(msg))==sizeof(msg));
+			ASSERT(Read(sock, (char*)&reply, sizeof(reply))==sizeof(reply));
+			ASSERT(reply==msg);
+		}
+		Close(sock);
+		return 0;
+	}
+	Tid_t clients[N];
+	for(int i=0; i<N; i++) clients[i] = CreateThread(client, i, NULL);
+
+	pollfd_t sfd[N+1];
+	sfd[0] = (pollfd_t){ .fd = lsock, .events = POLL_READ };
+	for(int i=1; i<=N; i++) sfd[i] = (pollfd_t){ .fd = NOFILE, .events = POLL_READ };
+
+	int accepted = 0, done = 0;
+	while(done < N) {
+		ASSERT(Poll(sfd, N+1, (timeout_t)-1) > 0);
+		if(sfd[0].revents & POLL_READ) {
+			ASSERT(accepted < N);
+			sfd[++accepted].fd = Accept(lsock);
+			ASSERT(sfd[accepted].fd != NOFILE);
+		}
+		for(int i=1; i<=N; i++) {
+			if(sfd[i].revents == 0) continue;
+			int msg;
+			int rc = Read(sfd[i].fd, (char*)&msg, sizeof(msg));
+			if(rc == 0) {
+				Close(sfd[i].fd);
+				sfd[i].fd = NOFILE;
+				done++;
+			} else {
+				ASSERT(rc == sizeof(msg));
+				ASSERT(Write(sfd[i].fd, (char*)&msg, sizeof(msg))==sizeof(msg));
+			}
+		}
+	}
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(clients[i], NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_event_queue,
+	"Test that an event queue reports each readiness change of its streams once, "
+	"and that one thread can serve many sockets with it."
+	)
+{
+	Fid_t eq = EventQueue();
+	ASSERT(eq != NOFILE);
+
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	int rtag, wtag;
+	event_t ev[4];
+
+	/* The write end is ready when it is added, the read end is not */
+	ASSERT(EventCtl(eq, EVENT_ADD, p.read, POLL_READ, &rtag)==0);
+	ASSERT(EventCtl(eq, EVENT_ADD, p.write, POLL_WRITE, &wtag)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].events==POLL_WRITE && ev[0].data==&wtag);
+	ASSERT(EventWait(eq, ev, 4, 100)==0);
+
+	/* Data arriving is reported once, even if it is not read */
+	ASSERT(Write(p.write, "abc", 3)==3);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].events==POLL_READ && ev[0].data==&rtag);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	/* Changing the registration checks the stream again */
+	ASSERT(EventCtl(eq, EVENT_MOD, p.read, POLL_READ, &wtag)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].events==POLL_READ && ev[0].data==&wtag);
+
+	/* Drained and refilled, by another thread */
+	char buf[8];
+	ASSERT(Read(p.read, buf, 8)==3);
+	int late_writer(int argl, void* args)
+	{
+		sleep_thread(1);
+		ASSERT(Write(*(Fid_t*)args, "x", 1)==1);
+		return 0;
+	}
+	Tid_t t = CreateThread(late_writer, 0, &p.write);
+	ASSERT(EventWait(eq, ev, 4, (timeout_t)-1)==1);
+	ASSERT(ev[0].events==POLL_READ);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* Removal and errors */
+	ASSERT(EventCtl(eq, EVENT_DEL, p.write, 0, NULL)==0);
+	ASSERT(EventCtl(eq, EVENT_DEL, p.write, 0, NULL)==-1);
+	ASSERT(EventCtl(eq, EVENT_MOD, p.write, POLL_WRITE, NULL)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, p.read, POLL_READ, NULL)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, eq, POLL_READ, NULL)==-1);
+	ASSERT(EventCtl(eq, 42, p.write, POLL_READ, NULL)==-1);
+	ASSERT(EventCtl(p.read, EVENT_ADD, p.write, POLL_WRITE, NULL)==-1);
+	ASSERT(EventCtl(eq, EVENT_ADD, NOFILE, POLL_READ, NULL)==-1);
+	ASSERT(EventWait(p.read, ev, 4, 0)==-1);
+	ASSERT(EventWait(eq, NULL, 4, 0)==-1);
+	ASSERT(Read(eq, buf, 8)==-1);
+
+	/* Closing a stream removes it from the event queue */
+	Close(p.write);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].events==(POLL_READ|POLL_HANGUP));
+	ASSERT(Read(p.read, buf, 8)==1);
+	Close(p.read);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+
+	/* The event queue does not hold the stream open */
+	ASSERT(Pipe(&p)==0);
+	ASSERT(EventCtl(eq, EVENT_ADD, p.write, POLL_WRITE, &wtag)==0);
+	ASSERT(EventCtl(eq, EVENT_ADD, p.read, POLL_READ, &rtag)==0);
+	Close(p.write);
+	ASSERT(Read(p.read, buf, 8)==0);
+	ASSERT(EventWait(eq, ev, 4, 0)==1);
+	ASSERT(ev[0].data==&rtag);
+	Close(p.read);
+	ASSERT(EventWait(eq, ev, 4, 0)==0);
+	ASSERT(Close(eq)==0);
+
+	/* An echo server, serving all its clients in one thread */
+	const int N = 5;		/* Both ends of each connection need a fid */
+	eq = EventQueue();
+	Fid_t lsock = Socket(100);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(EventCtl(eq, EVENT_ADD, lsock, POLL_READ, NULL)==0);
+
+	int client(int argl, void* args)
+	{
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(Connect(sock, 100, 1000)==0);
+		for(int i=0; i<20; i++) {
+			int msg = argl*100+i, reply;
+			ASSERT(Write(sock, (char*)&msg, sizeof(msg))==sizeof(msg));
+			ASSERT(Read(sock, (char*)&reply, sizeof(reply))==sizeof(reply));
+			ASSERT(reply==msg);
+		}
+		Close(sock);
+		return 0;
+	}
+	Tid_t clients[N];
+	for(int i=0; i<N; i++) clients[i] = CreateThread(client, i, NULL);
+
+	int done = 0;
+	while(done < N) {
+		int n = EventWait(eq, ev, 4, (timeout_t)-1);
+		ASSERT(n > 0);
+		for(int i=0; i<n; i++) {
+			if(ev[i].data == NULL) {
+				/* Accept all queued connections, as there may be no more events for them */
+				pollfd_t lp = { .fd = lsock, .events = POLL_READ };
+				do {
+					Fid_t sock = Accept(lsock);
+					ASSERT(sock != NOFILE);
+					ASSERT(EventCtl(eq, EVENT_ADD, sock, POLL_READ, (void*)(intptr_t)(sock+1))==0);
+				} while(Poll(&lp, 1, 0)==1);
+				continue;
+			}
+			Fid_t sock = (intptr_t)ev[i].data - 1;
+			int msg;
+			int rc = Read(sock, (char*)&msg, sizeof(msg));
+			if(rc == 0) {
+				ASSERT(EventCtl(eq, EVENT_DEL, sock, 0, NULL)==0);
+				Close(sock);
+				done++;
+			} else {
+				ASSERT(rc == sizeof(msg));
+				ASSERT(Write(sock, (char*)&msg, sizeof(msg))==sizeof(msg));
+			}
+		}
+	}
+	for(int i=0; i<N; i++) ASSERT(ThreadJoin(clients[i], NULL)==0);
+	Close(eq);
+	return 0;
+}
+
+
+BOOT_TEST(test_nonblocking,
+	"Test that calls on non-blocking pipes and sockets return WOULD_BLOCK instead of blocking."
+	)
+{
+	pipe_t p;
+	ASSERT(PipeWithFlags(&p, 0x100)==-1);
+	ASSERT(PipeWithFlags(&p, FID_NONBLOCK)==0);
+	ASSERT(GetFidFlags(p.read)==FID_NONBLOCK && GetFidFlags(p.write)==FID_NONBLOCK);
+	ASSERT(GetFidFlags(MAX_FILEID-1)==-1);
+
+	/* Reading an empty pipe */
+	char buf[1024];
+	ASSERT(Read(p.read, buf, sizeof(buf))==WOULD_BLOCK);
+	iovec_t iov[2] = { { buf, 10 }, { buf+10, 10 } };
+	ASSERT(ReadV(p.read, iov, 2)==WOULD_BLOCK);
+
+	/* Writing to a full pipe: a short write, then nothing */
+	ASSERT(SetPipeCapacity(p.write, 512)==0);
+	ASSERT(Write(p.write, buf, sizeof(buf))==512);
+	ASSERT(Write(p.write, buf, 1)==WOULD_BLOCK);
+	ASSERT(WriteV(p.write, iov, 2)==WOULD_BLOCK);
+
+	/* The flags are shared by copies of the fid */
+	Fid_t rd = p.read+1;
+	while(rd==p.write) rd++;
+	ASSERT(Dup2(p.read, rd)==0);
+	ASSERT(Read(rd, buf, sizeof(buf))==512);
+	ASSERT(Read(p.read, buf, sizeof(buf))==WOULD_BLOCK);
+	ASSERT(SetFidFlags(rd, 0x100)==-1);
+	ASSERT(SetFidFlags(rd, 0)==0);
+	ASSERT(GetFidFlags(p.read)==0);
+	Close(rd);
+
+	/* End of file is not would-block */
+	ASSERT(Write(p.write, "ab", 2)==2);
+	Close(p.write);
+	ASSERT(SetFidFlags(p.read, FID_NONBLOCK)==0);
+	ASSERT(Read(p.read, buf, sizeof(buf))==2);
+	ASSERT(Read(p.read, buf, sizeof(buf))==0);
+	Close(p.read);
+
+	/* Splicing out of an empty pipe */
+	ASSERT(PipeWithFlags(&p, FID_NONBLOCK)==0);
+	Fid_t null = OpenNull();
+	ASSERT(Splice(p.read, null, 100)==WOULD_BLOCK);
+	ASSERT(Write(p.write, "abc", 3)==3);
+	ASSERT(Splice(p.read, null, 100)==3);
+
+	/* Splicing into a full pipe reads no more than the pipe takes */
+	ASSERT(SetPipeCapacity(p.write, 512)==0);
+	ASSERT(Splice(null, p.write, sizeof(buf))==512);
+	ASSERT(Splice(null, p.write, sizeof(buf))==WOULD_BLOCK);
+	ASSERT(Read(p.read, buf, sizeof(buf))==512);
+	Close(null);
+	Close(p.read);
+	Close(p.write);
+
+	/* A non-blocking listener, served by Poll */
+	Fid_t lsock = SocketWithFlags(100, FID_NONBLOCK);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+	ASSERT(Accept(lsock)==WOULD_BLOCK);
+
+	int client(int argl, void* args)
+	{
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(Connect(sock, 100, 1000)==0);
+		ASSERT(Write(sock, "hello", 5)==5);
+		char c;
+		ASSERT(Read(sock, &c, 1)==1);
+		Close(sock);
+		return 0;
+	}
+	Tid_t t = CreateThread(client, 0, NULL);
+
+	pollfd_t fds[1] = { { .fd = lsock, .events = POLL_READ } };
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+	Fid_t sock = Accept(lsock);
+	ASSERT(sock>=0);
+	ASSERT(GetFidFlags(sock)==0);
+	ASSERT(Accept(lsock)==WOULD_BLOCK);
+	ASSERT(SetFidFlags(sock, FID_NONBLOCK)==0);
+
+	/* Drain the socket, as an event loop would */
+	int got = 0;
+	while(got < 5) {
+		fds[0] = (pollfd_t){ .fd = sock, .events = POLL_READ };
+		ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+		int rc;
+		while((rc = Read(sock, buf+got, sizeof(buf)-got)) > 0)
+			got += rc;
+		ASSERT(rc==WOULD_BLOCK);
+	}
+	ASSERT(memcmp(buf, "hello", 5)==0);
+
+	/* Release the client; then the socket reads end of file */
+	ASSERT(Write(sock, "x", 1)==1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Read(sock, buf, sizeof(buf))==0);
+
+	Close(sock);
+	Close(lsock);
+	return 0;
+}
+
+
+BOOT_TEST(test_many_fids,
+	"Test that the file ids of a process can be raised far beyond MAX_FILEID, "
+	"that the lowest free fid is always used, and that children inherit them."
+	)
+{
+	const int N = 10000;
+	ASSERT(SetFidLimit(0)==-1);
+	ASSERT(SetFidLimit(MAX_FID_LIMIT+1)==-1);
+	ASSERT(SetFidLimit(N)==0);
+
+	/* Fill the table, leaving room for a pipe */
+	for(int i=0; i<N-2; i++)
+		ASSERT(OpenNull()==i);
+	pipe_t p;
+	ASSERT(Pipe(&p)==0);
+	ASSERT(p.read==N-2 && p.write==N-1);
+	ASSERT(OpenNull()==NOFILE);
+	ASSERT(Pipe(&p)==-1);
+	ASSERT(Write(N-1, "hello", 5)==5);
+
+	/* The lowest free fids are reused first */
+	ASSERT(Close(7000)==0);
+	ASSERT(Close(70)==0);
+	ASSERT(OpenNull()==70);
+	ASSERT(OpenNull()==7000);
+	ASSERT(Dup2(3, N)==-1);
+	ASSERT(Close(N)==-1);
+
+	/* The limit cannot drop below an open fid */
+	ASSERT(SetFidLimit(N-1)==-1);
+
+	/* The child inherits all the fids, and the limit */
+	int child(int argl, void* args)
+	{
+		char buf[5];
+		ASSERT(Read(argl-2, buf, 5)==5);
+		ASSERT(memcmp(buf, "hello", 5)==0);
+		ASSERT(Write(4321, buf, 5)==5);
+		ASSERT(OpenNull()==NOFILE);
+		ASSERT(Close(4321)==0);
+		ASSERT(OpenNull()==4321);
+		return 0;
+	}
+	Pid_t pid = Exec(child, N, NULL);
+	ASSERT(pid != NOPROC);
+	ASSERT(WaitChild(pid, NULL)==pid);
+
+	/* Close all, and go back to the initial limit */
+	for(int i=0; i<N; i++)
+		ASSERT(Close(i)==0);
+	ASSERT(SetFidLimit(MAX_FILEID)==0);
+	ASSERT(Close(MAX_FILEID)==-1);
+	for(int i=0; i<MAX_FILEID; i++)
+		ASSERT(OpenNull()==i);
+	ASSERT(OpenNull()==NOFILE);
+	return 0;
+}
+
+
+BOOT_TEST(test_stream_churn,
+	"Test that threads on many cores can create and close pipes and sockets concurrently."
+	)
+{
+	const int T = 4, N = 500;
+
+	int churn(int argl, void* args)
+	{
+		for(int i=0; i<N; i++) {
+			pipe_t p;
+			ASSERT(Pipe(&p)==0);
+			int msg = argl*N+i, got;
+			ASSERT(Write(p.write, (char*)&msg, sizeof(msg))==sizeof(msg));
+			Fid_t s = Socket(NOPORT);
+			ASSERT(s!=NOFILE);
+			ASSERT(Read(p.read, (char*)&got, sizeof(got))==sizeof(got));
+			ASSERT(got==msg);
+			ASSERT(Close(s)==0);
+			ASSERT(Close(p.write)==0);
+			ASSERT(Close(p.read)==0);
+		}
+		return 0;
+	}
+
+	/* Three fids for each thread */
+	ASSERT(SetFidLimit(3*T)==0);
+	Tid_t t[T];
+	for(int i=0; i<T; i++) t[i] = CreateThread(churn, i, NULL);
+	for(int i=0; i<T; i++) ASSERT(ThreadJoin(t[i], NULL)==0);
+
+	/* All the fids are free again */
+	for(int i=0; i<3*T; i++)
+		ASSERT(OpenNull()==i);
+	ASSERT(OpenNull()==NOFILE);
+	return 0;
+}
+
+
+/* Open pipes until Pipe fails, and return how many were opened */
+static int pipes_until_full()
+{
+	int n = 0;
+	pipe_t p;
+	while(Pipe(&p)==0)
+		n++;
+	return n;
+}
+
+static int pipe_cacher(int argl, void* args)
+{
+	/* Leave some free streams in the cache of the core we run on */
+	pipe_t p[argl];
+	for(int i=0; i<argl; i++)
+		ASSERT(Pipe(&p[i])==0);
+	for(int i=0; i<argl; i++) {
+		ASSERT(Close(p[i].read)==0);
+		ASSERT(Close(p[i].write)==0);
+	}
+	return 0;
+}
+
+BOOT_TEST(test_open_until_full,
+	"Test that as many streams can be opened as before, after threads on other "
+	"cores have opened and closed streams."
+	)
+{
+	ASSERT(SetFidLimit(MAX_FID_LIMIT)==0);
+
+	int n = pipes_until_full();
+	ASSERT(n > 0);
+	for(Fid_t fid=0; fid < 2*n; fid++)
+		ASSERT(Close(fid)==0);
+
+	/* Threads, which may run on other cores, free streams there */
+	Tid_t tids[8];
+	for(int i=0; i<8; i++)
+		tids[i] = CreateThread(pipe_cacher, 32, NULL);
+	for(int i=0; i<8; i++)
+		ASSERT(ThreadJoin(tids[i], NULL)==0);
+
+	ASSERT(pipes_until_full()==n);
+	for(Fid_t fid=0; fid < 2*n; fid++)
+		ASSERT(Close(fid)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_fidopen_buffered,
+	"Test that streams opened by fidopen_buffered hold their output until they are "
+	"flushed, or the process exits."
+	)
+{
+	Fid_t null = OpenNull();
+	ASSERT(IsTerminal(null)==0);
+	ASSERT(IsTerminal(MAX_FILEID-1)==-1);
+	ASSERT(fidopen_buffered(MAX_FILEID-1, "w")==NULL);
+	Close(null);
+
+	pipe_t p, ready, go;
+	ASSERT(PipeWithFlags(&p, FID_NONBLOCK)==0);
+	ASSERT(SetFidFlags(p.write, 0)==0);
+	ASSERT(Pipe(&ready)==0);
+	ASSERT(Pipe(&go)==0);
+
+	int writer(size_t argc, const char** argv)
+	{
+		FILE* f = fidopen_buffered(p.write, "w");
+		ASSERT(f!=NULL);
+		for(int i=0; i<100; i++) fputc('a'+i%26, f);
+		fflush(f);
+		for(int i=0; i<100; i++) fputc('a'+i%26, f);
+
+		/* The stream installed the exit hook */
+		ASSERT(SetExitHook(fidclose_all)==fidclose_all);
+
+		char c;
+		ASSERT(Write(ready.write, "r", 1)==1);
+		ASSERT(Read(go.read, &c, 1)==1);
+		/* Returning flushes f */
+		return 0;
+	}
+	const char* argv[] = { "writer" };
+	Pid_t pid = Execute(writer, 1, argv);
+	ASSERT(pid!=NOPROC);
+
+	/* Only the flushed output is in the pipe */
+	char buf[256], c;
+	ASSERT(Read(ready.read, &c, 1)==1);
+	ASSERT(Read(p.read, buf, sizeof(buf))==100);
+	ASSERT(Read(p.read, buf, sizeof(buf))==WOULD_BLOCK);
+
+	ASSERT(Write(go.write, "g", 1)==1);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Read(p.read, buf, sizeof(buf))==100);
+	for(int i=0; i<100; i++) ASSERT(buf[i]=='a'+i%26);
+	ASSERT(Read(p.read, buf, sizeof(buf))==WOULD_BLOCK);
+
+	/* A process that calls Exit, and was not started by Execute, is flushed too */
+	int exiter(int argl, void* args)
+	{
+		FILE* f = fidopen_buffered(p.write, "w");
+		ASSERT(f!=NULL);
+		for(int i=0; i<argl; i++) fputc('A'+i%26, f);
+		Exit(0);
+		return 1;
+	}
+	pid = Exec(exiter, 50, NULL);
+	ASSERT(pid!=NOPROC);
+	Close(p.write);
+	ASSERT(WaitChild(pid, NULL)==pid);
+	ASSERT(Read(p.read, buf, sizeof(buf))==50);
+	for(int i=0; i<50; i++) ASSERT(buf[i]=='A'+i%26);
+	ASSERT(Read(p.read, buf, sizeof(buf))==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_listen_backlog,
+	"Test that Connect to a listener with a full backlog fails at once, and that requests leave the backlog."
+	)
+{
+	Fid_t lsock = Socket(101);
+	ASSERT(ListenWithBacklog(lsock, 0)==-1);
+	ASSERT(ListenWithBacklog(lsock, MAX_BACKLOG+1)==-1);
+	ASSERT(ListenWithBacklog(lsock, 1)==0);
+	ASSERT(ListenWithBacklog(lsock, 1)==-1);
+
+	int client(int argl, void* args)
+	{
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(Connect(sock, 101, (timeout_t)-1)==argl);
+		Close(sock);
+		return 0;
+	}
+
+	/* Fill the backlog */
+	Tid_t t = CreateThread(client, 0, NULL);
+	pollfd_t fds[1] = { { .fd = lsock, .events = POLL_READ } };
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+
+	/* This does not wait for its timeout */
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 101, 10000)==-1);
+
+	Fid_t peer = Accept(lsock);
+	ASSERT(peer!=NOFILE);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(peer);
+
+	/* A request that times out leaves the backlog */
+	ASSERT(Connect(sock, 101, 100)==-1);
+	ASSERT(Poll(fds, 1, 0)==0);
+	Close(sock);
+
+	/* Closing the listener fails the pending request */
+	t = CreateThread(client, -1, NULL);
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+	Close(lsock);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	return 0;
+}
+
+
+BOOT_TEST(test_listen_shared,
+	"Test that connection requests are spread over the shared listeners of a port."
+	)
+{
+	Fid_t l1 = Socket(102);
+	Fid_t l2 = Socket(102);
+	Fid_t l3 = Socket(102);
+	ASSERT(ListenShared(l1, 0)==-1);
+	ASSERT(ListenShared(l1, 1)==0);
+	ASSERT(ListenWithBacklog(l3, 1)==-1);
+	ASSERT(ListenShared(l2, 1)==0);
+
+	/* A port with an ordinary listener cannot be shared */
+	Fid_t l4 = Socket(103);
+	Fid_t l5 = Socket(103);
+	ASSERT(Listen(l4)==0);
+	ASSERT(ListenShared(l5, 1)==-1);
+	Close(l4);
+	Close(l5);
+
+	int client(int argl, void* args)
+	{
+		Fid_t sock = Socket(NOPORT);
+		ASSERT(Connect(sock, 102, 10000)==0);
+		Close(sock);
+		return 0;
+	}
+
+	/* One request goes to each listener */
+	Tid_t t1 = CreateThread(client, 0, NULL);
+	Tid_t t2 = CreateThread(client, 0, NULL);
+	pollfd_t fds[1] = { { .fd = l1, .events = POLL_READ } };
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+	fds[0].fd = l2;
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+
+	/* Both backlogs are full */
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 102, 10000)==-1);
+	Close(sock);
+
+	/* A request of a closed listener moves to another */
+	Fid_t peer = Accept(l2);
+	ASSERT(peer!=NOFILE);
+	Close(peer);
+	ASSERT(Poll(fds, 1, 0)==0);
+	Close(l1);
+	ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+	peer = Accept(l2);
+	ASSERT(peer!=NOFILE);
+	Close(peer);
+	ASSERT(ThreadJoin(t1, NULL)==0);
+	ASSERT(ThreadJoin(t2, NULL)==0);
+
+	/* With the last one closed, the port can have an ordinary listener */
+	ASSERT(ListenWithBacklog(l3, 1)==-1);
+	Close(l2);
+	ASSERT(Listen(l3)==0);
+	Close(l3);
+	return 0;
+}
+
+
+BOOT_TEST(test_seqpacket_socket,
+	"Test that the sockets of type SOCK_SEQPACKET keep message boundaries."
+	)
+{
+	ASSERT(SocketWithType(104, 7)==NOFILE);
+	Fid_t lsock = SocketWithType(104, SOCK_SEQPACKET);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* Only sockets of the same type connect */
+	Fid_t sock = Socket(NOPORT);
+	ASSERT(Connect(sock, 104, 10000)==-1);
+	Close(sock);
+
+	static char big[MAX_MESSAGE+1];
+	pipe_t done;
+	ASSERT(Pipe(&done)==0);
+
+	int client(int argl, void* args)
+	{
+		Fid_t sock = SocketWithType(NOPORT, SOCK_SEQPACKET);
+		ASSERT(Connect(sock, 104, 10000)==0);
+		ASSERT(Write(sock, "hello", 5)==5);
+		ASSERT(Write(sock, "world!", 6)==6);
+		iovec_t iov[2] = { { "ab", 2 }, { "cd", 2 } };
+		ASSERT(WriteV(sock, iov, 2)==4);
+		ASSERT(Write(sock, big, MAX_MESSAGE+1)==-1);
+		ASSERT(Write(sock, big, MAX_MESSAGE)==MAX_MESSAGE);
+
+		/* Wait before closing, with the messages to us unread */
+		char c;
+		ASSERT(Read(done.read, &c, 1)==1);
+		Close(sock);
+		return 0;
+	}
+	Tid_t t = CreateThread(client, 0, NULL);
+
+	sock = Accept(lsock);
+	ASSERT(sock!=NOFILE);
+
+	/* One message per read */
+	char buf[100];
+	ASSERT(Read(sock, buf, sizeof(buf))==5 && memcmp(buf, "hello", 5)==0);
+	ASSERT(Read(sock, buf, sizeof(buf))==6 && memcmp(buf, "world!", 6)==0);
+	iovec_t iov[2] = { { buf, 3 }, { buf+3, 10 } };
+	ASSERT(ReadV(sock, iov, 2)==4 && memcmp(buf, "abcd", 4)==0);
+
+	/* The rest of a message that does not fit is dropped */
+	ASSERT(Read(sock, buf, 10)==10);
+
+	/* The queue is bounded */
+	ASSERT(SetFidFlags(sock, FID_NONBLOCK)==0);
+	ASSERT(Read(sock, buf, sizeof(buf))==WOULD_BLOCK);
+	int rc, sent = 0;
+	while((rc = Write(sock, "m", 1))==1)
+		sent++;
+	ASSERT(rc==WOULD_BLOCK && sent>0);
+	pollfd_t fds[1] = { { .fd = sock, .events = POLL_WRITE } };
+	ASSERT(Poll(fds, 1, 0)==0);
+	ASSERT(SetFidFlags(sock, 0)==0);
+
+	ASSERT(Write(done.write, "x", 1)==1);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	ASSERT(Read(sock, buf, sizeof(buf))==0);
+	ASSERT(Write(sock, "m", 1)==-1);
+	Close(sock);
+	Close(lsock);
+	Close(done.read);
+	Close(done.write);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_pair,
+	"Test that SocketPair returns two connected sockets."
+	)
+{
+	Fid_t pair[2];
+	ASSERT(SocketPair(7, pair)==-1);
+
+	/* A byte stream in each direction */
+	ASSERT(SocketPair(SOCK_STREAM, pair)==0);
+	char buf[16];
+	ASSERT(Write(pair[0], "ping", 4)==4);
+	ASSERT(Write(pair[0], "!", 1)==1);
+	ASSERT(Read(pair[1], buf, sizeof(buf))==5 && memcmp(buf, "ping!", 5)==0);
+	ASSERT(Write(pair[1], "pong", 4)==4);
+	ASSERT(Read(pair[0], buf, sizeof(buf))==4 && memcmp(buf, "pong", 4)==0);
+
+	/* They are not listeners, nor can they connect again */
+	ASSERT(Accept(pair[0])==NOFILE);
+	ASSERT(Connect(pair[0], 105, 1000)==-1);
+
+	ASSERT(ShutDown(pair[0], SHUTDOWN_WRITE)==0);
+	ASSERT(Read(pair[1], buf, sizeof(buf))==0);
+	Close(pair[0]);
+	ASSERT(Write(pair[1], "x", 1)==-1);
+	Close(pair[1]);
+
+	/* A writer blocked on a full socket fails when the socket is shut down for writing */
+	ASSERT(SocketPair(SOCK_STREAM, pair)==0);
+	ASSERT(SetPipeCapacity(pair[1], 512)==0);
+	int blocked_writer(int argl, void* args)
+	{
+		char data[1024] = { 0 };
+		ASSERT(Write(pair[0], data, sizeof(data))==-1);
+		return 0;
+	}
+	Tid_t w = CreateThread(blocked_writer, 0, NULL);
+
+	Mutex mx = MUTEX_INIT;
+	CondVar cv = COND_INIT;
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	ASSERT(ShutDown(pair[0], SHUTDOWN_WRITE)==0);
+	ASSERT(ThreadJoin(w, NULL)==0);
+	ASSERT(Read(pair[1], buf, sizeof(buf))==sizeof(buf));
+	Close(pair[0]);
+	Close(pair[1]);
+
+	/* The same, for a writer blocked on a full message queue */
+	ASSERT(SocketPair(SOCK_SEQPACKET, pair)==0);
+	ASSERT(SetFidFlags(pair[0], FID_NONBLOCK)==0);
+	while(Write(pair[0], "m", 1)==1);
+	ASSERT(SetFidFlags(pair[0], 0)==0);
+	int blocked_sender(int argl, void* args)
+	{
+		ASSERT(Write(pair[0], "m", 1)==-1);
+		return 0;
+	}
+	w = CreateThread(blocked_sender, 0, NULL);
+
+	Mutex_Lock(&mx);
+	Cond_TimedWait(&mx, &cv, 100);
+	Mutex_Unlock(&mx);
+
+	ASSERT(ShutDown(pair[0], SHUTDOWN_WRITE)==0);
+	ASSERT(ThreadJoin(w, NULL)==0);
+	Close(pair[0]);
+	Close(pair[1]);
+
+	/* A pair of message sockets, used by two threads */
+	ASSERT(SocketPair(SOCK_SEQPACKET, pair)==0);
+
+	int echo(int argl, void* args)
+	{
+		char msg[MAX_MESSAGE];
+		int n;
+		while((n = Read(pair[1], msg, sizeof(msg))) > 0)
+			ASSERT(Write(pair[1], msg, n)==n);
+		ASSERT(n==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(echo, 0, NULL);
+
+	for(int i=1; i<=10; i++) {
+		char msg[10];
+		memset(msg, 'a'+i, i);
+		ASSERT(Write(pair[0], msg, i)==i);
+		ASSERT(Read(pair[0], buf, sizeof(buf))==i && memcmp(buf, msg, i)==0);
+	}
+	ASSERT(ShutDown(pair[0], SHUTDOWN_WRITE)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+	Close(pair[0]);
+	Close(pair[1]);
+	return 0;
+}
+
+
+BOOT_TEST(test_socket_ring,
+	"Test that the sockets of type SOCK_RING pass data through shared rings."
+	)
+{
+	Fid_t pair[2];
+	socket_ring *send0, *recv0, *send1, *recv1;
+
+	/* Only connected ring sockets have rings */
+	ASSERT(SocketPair(SOCK_STREAM, pair)==0);
+	ASSERT(SocketRing(pair[0], &send0, &recv0)==-1);
+	ASSERT(RingWake(pair[0])==-1);
+	Close(pair[0]);
+	Close(pair[1]);
+
+	ASSERT(SocketPair(SOCK_RING, pair)==0);
+	ASSERT(SocketRing(pair[0], &send0, &recv0)==0);
+	ASSERT(SocketRing(pair[1], &send1, &recv1)==0);
+	ASSERT(send0==recv1 && send1==recv0);
+	ASSERT(send0->size==SOCKET_RING_SIZE);
+
+	/* The calls go through the rings */
+	char buf[16];
+	const char* p;
+	ASSERT(Write(pair[0], "hello", 5)==5);
+	ASSERT(ring_peek(recv1, &p)==5 && memcmp(p, "hello", 5)==0);
+	ring_consume(pair[1], recv1, 5);
+	char* q;
+	ASSERT(ring_space(send1, &q) > 3);
+	memcpy(q, "abc", 3);
+	ring_produce(pair[1], send1, 3);
+	ASSERT(Read(pair[0], buf, sizeof(buf))==3 && memcmp(buf, "abc", 3)==0);
+
+	/* A producer, filling the ring many times over */
+	const unsigned int total = 5*SOCKET_RING_SIZE + 1234;
+	int producer(int argl, void* args)
+	{
+		pollfd_t fds[1] = { { .fd = pair[1], .events = POLL_WRITE } };
+		unsigned int sent = 0;
+		while(sent < total) {
+			char* q;
+			unsigned int n = ring_space(send1, &q);
+			if(n == 0) {
+				ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+				continue;
+			}
+			if(n > total - sent)
+				n = total - sent;
+			if(n > 1000)
+				n = 1000;
+			for(unsigned int i=0; i<n; i++)
+				q[i] = (sent + i) % 251;
+			ring_produce(pair[1], send1, n);
+			sent += n;
+		}
+		ASSERT(Write(pair[1], "end", 3)==3);
+		ASSERT(ShutDown(pair[1], SHUTDOWN_WRITE)==0);
+		return 0;
+	}
+	Tid_t t = CreateThread(producer, 0, NULL);
+
+	pollfd_t fds[1] = { { .fd = pair[0], .events = POLL_READ } };
+	unsigned int received = 0;
+	while(received < total) {
+		unsigned int n = ring_peek(recv0, &p);
+		if(n == 0) {
+			ASSERT(Poll(fds, 1, (timeout_t)-1)==1);
+			continue;
+		}
+		if(n > total - received)
+			n = total - received;
+		for(unsigned int i=0; i<n; i++)
+			ASSERT((unsigned char)p[i] == (received + i) % 251);
+		ring_consume(pair[0], recv0, n);
+		received += n;
+	}
+
+	ASSERT(Read(pair[0], buf, 3)==3 && memcmp(buf, "end", 3)==0);
+	ASSERT(ThreadJoin(t, NULL)==0);
+
+	/* The end of the data */
+	ASSERT(Read(pair[0], buf, sizeof(buf))==0);
+	ASSERT(ring_peek(recv0, &p)==0 && recv0->writer_closed);
+	ASSERT(Poll(fds, 1, 0)==1 && (fds[0].revents & POLL_HANGUP));
+
+	/* The rings stay valid while one side is open */
+	Close(pair[1]);
+	ASSERT(send0->reader_closed);
+	ASSERT(Write(pair[0], "x", 1)==-1);
+	Close(pair[0]);
+
+	/* The kernel does not trust the size, data and counters of the rings */
+	ASSERT(SocketPair(SOCK_RING, pair)==0);
+	ASSERT(SocketRing(pair[0], &send0, &recv0)==0);
+	send0->size = 1u << 31;
+	send0->data = NULL;
+	ASSERT(Write(pair[0], "abc", 3)==3);
+	ASSERT(Read(pair[1], buf, sizeof(buf))==3 && memcmp(buf, "abc", 3)==0);
+
+	send0->tail += 3*SOCKET_RING_SIZE;
+	char* big = malloc(4*SOCKET_RING_SIZE);
+	ASSERT(Read(pair[1], big, 4*SOCKET_RING_SIZE)==SOCKET_RING_SIZE);
+	free(big);
+	Close(pair[0]);
+	Close(pair[1]);
+	return 0;
+}
+
+
 TEST_SUITE(user_tests, 
 	"These are tests defined by the user."
 	)
 {
 	&dummy_user_test,
+	&test_timeouts_across_wheel_levels,
+	&test_thread_create_join_churn,
+	&test_thread_stack_size,
+	&test_mutex_contention,
+	&test_pipe_ping_pong,
+	&test_pipe_capacity,
+	&test_splice,
+	&test_readv_writev,
+	&test_poll,
+	&test_event_queue,
+	&test_nonblocking,
+	&test_many_fids,
+	&test_stream_churn,
+	&test_open_until_full,
+	&test_fidopen_buffered,
+	&test_listen_backlog,
+	&test_listen_shared,
+	&test_seqpacket_socket,
+	&test_socket_pair,
+	&test_socket_ring,
 	NULL
 };
 